@@ -0,0 +1,154 @@
+//
+// BB-CP frame submission client
+//
+// Copyright (c) 2017 Larry Bank
+// email: bitbank@pobox.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bbcp_client.h"
+
+//
+// Connect to bbcp and map the frame ring it sends us
+//
+BBCP_CLIENT *bbcpConnect(const char *szPath)
+{
+BBCP_CLIENT *pClient;
+BBCP_HELLO hello;
+struct sockaddr_un addr;
+struct msghdr msg;
+struct iovec iov;
+struct cmsghdr *cmsg;
+char cBuf[CMSG_SPACE(3 * sizeof(int))];
+int fd[3], iSock;
+void *p;
+
+	iSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (iSock < 0)
+		return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, szPath, sizeof(addr.sun_path)-1);
+	if (connect(iSock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(iSock);
+		return NULL;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cBuf;
+	msg.msg_controllen = sizeof(cBuf);
+	if (recvmsg(iSock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello)) // busy; bbcp hung up
+	{
+		close(iSock);
+		return NULL;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+	{
+		close(iSock);
+		return NULL;
+	}
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(fd));
+	p = MAP_FAILED;
+	if (hello.u32Magic == BBCP_MAGIC && hello.u32Version == BBCP_VERSION)
+		p = mmap(NULL, hello.u32Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd[0], 0);
+	close(fd[0]); // the mapping keeps the memory
+	pClient = (p == MAP_FAILED) ? NULL : malloc(sizeof(BBCP_CLIENT));
+	if (pClient == NULL)
+	{
+		if (p != MAP_FAILED)
+			munmap(p, hello.u32Size);
+		close(fd[1]);
+		close(fd[2]);
+		close(iSock);
+		return NULL;
+	}
+	pClient->pRing = (BBCP_RING *)p;
+	pClient->iWidth = pClient->pRing->u32Width;
+	pClient->iHeight = pClient->pRing->u32Height;
+	pClient->iPitch = pClient->pRing->u32Pitch;
+	pClient->iSock = iSock;
+	pClient->fdFrame = fd[1];
+	pClient->fdFree = fd[2];
+	pClient->iMapSize = hello.u32Size;
+	return pClient;
+} /* bbcpConnect() */
+
+//
+// Wait for a free buffer (bbcp takes the frames in order)
+//
+uint16_t *bbcpGetFrame(BBCP_CLIENT *pClient)
+{
+BBCP_RING *pRing = pClient->pRing;
+struct pollfd fds[2];
+uint64_t u64;
+uint32_t u32Head = pRing->u32Head;
+
+	while (u32Head - __atomic_load_n(&pRing->u32Tail, __ATOMIC_ACQUIRE) >= pRing->u32Slots)
+	{
+		fds[0].fd = pClient->fdFree; fds[0].events = POLLIN;
+		fds[1].fd = pClient->iSock; fds[1].events = POLLIN; // only wakes up when bbcp quits
+		if (poll(fds, 2, -1) < 0)
+			continue;
+		if (fds[1].revents)
+			return NULL;
+		if (read(pClient->fdFree, &u64, sizeof(u64)) < 0) {};
+	}
+	return (uint16_t *)((uint8_t *)pRing + pRing->u32PixelOffset + (u32Head % pRing->u32Slots) * pRing->u32SlotSize);
+} /* bbcpGetFrame() */
+
+int bbcpSubmit(BBCP_CLIENT *pClient, const BBCP_RECT *pRects, int iCount)
+{
+BBCP_RING *pRing = pClient->pRing;
+BBCP_SLOT *pSlot;
+struct timespec ts;
+uint32_t u32Head = pRing->u32Head;
+uint64_t u64 = 1;
+
+	pSlot = &pRing->slot[u32Head % pRing->u32Slots];
+	if (iCount < 0 || iCount > BBCP_MAX_RECTS)
+		iCount = 0; // the whole frame
+	if (iCount)
+		memcpy(pSlot->rects, pRects, iCount * sizeof(BBCP_RECT));
+	pSlot->u32Rects = iCount;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pSlot->llSubmitTime = ts.tv_nsec + (ts.tv_sec * 1000000000LL);
+	__atomic_store_n(&pRing->u32Head, u32Head + 1, __ATOMIC_RELEASE); // the frame is bbcp's now
+	if (write(pClient->fdFrame, &u64, sizeof(u64)) != sizeof(u64))
+		return -1;
+	return (int)u32Head;
+} /* bbcpSubmit() */
+
+void bbcpDisconnect(BBCP_CLIENT *pClient)
+{
+	if (pClient == NULL)
+		return;
+	munmap(pClient->pRing, pClient->iMapSize);
+	close(pClient->fdFrame);
+	close(pClient->fdFree);
+	close(pClient->iSock); // bbcp goes back to /dev/fb0
+	free(pClient);
+} /* bbcpDisconnect() */
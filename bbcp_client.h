@@ -0,0 +1,115 @@
+//
+// BB-CP frame submission client
+//
+// Copyright (c) 2017 Larry Bank
+// email: bitbank@pobox.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// Instead of letting bbcp scrape /dev/fb0, an emulator or frontend can hand
+// it finished RGB565 frames along with the rectangles which changed. bbcp
+// (started with --shm <socket>) creates a ring of frame buffers in shared
+// memory (memfd) and passes it to the client over a unix socket, together
+// with two eventfds: one the client signals when it submits a frame and one
+// bbcp signals when a buffer is free again. Frames are drawn straight into
+// the ring; nothing is copied on the way in.
+//
+//    BBCP_CLIENT *pClient = bbcpConnect(BBCP_SOCKET);
+//    while (running) {
+//       uint16_t *pFrame = bbcpGetFrame(pClient); // waits while all buffers are queued
+//       ... draw the rectangles which changed into pFrame (pClient->iPitch bytes per line)
+//       bbcpSubmit(pClient, rects, iRectCount); // 0 rects = the whole frame
+//    }
+//    bbcpDisconnect(pClient);
+//
+// bbcp only reads the submitted rectangles of each buffer and keeps the rest
+// of the image itself, so only the areas which changed need to be drawn; a
+// buffer still holds whatever was drawn into it BBCP_SLOTS frames ago.
+// When the client disconnects, bbcp goes back to copying /dev/fb0.
+//
+#ifndef __BBCP_CLIENT_H__
+#define __BBCP_CLIENT_H__
+
+#include <stdint.h>
+
+#define BBCP_SOCKET "/tmp/bbcp-frames.sock" // suggested path for --shm
+#define BBCP_MAGIC 0x50434242 // "BBCP"
+#define BBCP_VERSION 1
+#define BBCP_SLOTS 3 // frame buffers in the ring
+#define BBCP_MAX_RECTS 32 // more than this is treated as the whole frame
+
+typedef struct tag_BBCP_RECT
+{
+	uint16_t x, y, w, h;
+} BBCP_RECT;
+
+// Per buffer information
+typedef struct tag_BBCP_SLOT
+{
+	uint64_t llSubmitTime; // CLOCK_MONOTONIC ns, set by bbcpSubmit()
+	uint32_t u32Rects; // 0 = the whole frame changed (or isn't known)
+	uint32_t u32Reserved;
+	BBCP_RECT rects[BBCP_MAX_RECTS];
+} BBCP_SLOT;
+
+//
+// Start of the shared memory; the pixels of buffer n are at
+// u32PixelOffset + n*u32SlotSize bytes from here
+// Frame n (counting from 0) goes in buffer n % u32Slots.
+//
+typedef struct tag_BBCP_RING
+{
+	uint32_t u32Magic, u32Version;
+	uint32_t u32Width, u32Height, u32Pitch; // the LCD image, RGB565 native endian
+	uint32_t u32Slots, u32SlotSize, u32PixelOffset;
+	uint32_t u32Head; // frames submitted (written by the client)
+	uint32_t u32Tail; // frames taken by bbcp; their buffers can be reused
+	uint32_t u32Shown; // frames whose changes have been sent to the LCD
+	uint32_t u32Reserved;
+	uint64_t llShownTime[BBCP_SLOTS]; // when frame n was sent, at [n % u32Slots]
+	BBCP_SLOT slot[BBCP_SLOTS];
+} BBCP_RING;
+
+// Sent by bbcp when a client connects, with the memfd and the
+// "frame submitted" and "buffer free" eventfds (in that order)
+typedef struct tag_BBCP_HELLO
+{
+	uint32_t u32Magic, u32Version, u32Size; // u32Size = bytes to map
+} BBCP_HELLO;
+
+typedef struct tag_BBCP_CLIENT
+{
+	BBCP_RING *pRing;
+	int iWidth, iHeight, iPitch; // size of the frames bbcp wants
+	int iSock, fdFrame, fdFree, iMapSize;
+} BBCP_CLIENT;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns NULL if bbcp isn't listening or already has a client
+BBCP_CLIENT *bbcpConnect(const char *szPath);
+// Returns the buffer to draw the next frame into, or NULL if bbcp went away
+uint16_t *bbcpGetFrame(BBCP_CLIENT *pClient);
+// Queue the frame from bbcpGetFrame(); returns its frame number or -1 if bbcp went away
+int bbcpSubmit(BBCP_CLIENT *pClient, const BBCP_RECT *pRects, int iCount);
+void bbcpDisconnect(BBCP_CLIENT *pClient);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __BBCP_CLIENT_H__
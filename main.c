@@ -30,9 +30,39 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <linux/fb.h>
 #include <linux/uinput.h>
+#include <linux/gpio.h>
+#if defined( __arm__ ) || defined( __aarch64__ )
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#ifdef HAVE_DRM
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#endif
+#ifndef NO_SPI_LCD
 #include <spi_lcd.h>
+#else
+// Building without the SPI_LCD library; only the virtual LCD is available
+#define LCD_ILI9341 1
+#define LCD_ORIENTATION_NATIVE 1
+#define LCD_ORIENTATION_ROTATED 2
+#define spilcdReadPin(iPin) 1
+#define spilcdConfigurePin(iPin) 1
+#endif // NO_SPI_LCD
+#include "bbcp_client.h"
 
 // Use dispmanx API on RPi0
 #if defined( _RPIZERO_ ) || defined (_RPI3_)
@@ -45,9 +75,47 @@ uint32_t image_prt;
 VC_RECT_T rect1;
 #endif // _RPIZERO_
 
-// We only support the ILI9341 (240x320), but define these just in case
-#define LCD_CX 320
-#define LCD_CY 240
+//
+// Supported LCD controllers
+// The size is the (landscape) image we send; the orientation is what it
+// takes to get there from the panel's native scan direction.
+// Controllers which an older SPI_LCD doesn't define stay in the list, so
+// --lcd virtual can model them and the spi backend can say what's missing
+//
+typedef struct tag_LCDTYPE
+{
+	const char *szName;
+	int iType; // SPI_LCD controller type, -1 = this SPI_LCD doesn't know it
+	int iWidth, iHeight;
+	int iOrientation;
+} LCDTYPE;
+
+static const LCDTYPE LCDTypes[] = {
+	{"ili9341", LCD_ILI9341, 320, 240, LCD_ORIENTATION_ROTATED}, // 240x320 panel turned sideways
+#ifdef LCD_ILI9342
+	{"ili9342", LCD_ILI9342, 320, 240, LCD_ORIENTATION_NATIVE},
+#else
+	{"ili9342", -1, 320, 240, LCD_ORIENTATION_NATIVE},
+#endif
+#ifdef LCD_ILI9486
+	{"ili9486", LCD_ILI9486, 480, 320, LCD_ORIENTATION_ROTATED},
+#else
+	{"ili9486", -1, 480, 320, LCD_ORIENTATION_ROTATED},
+#endif
+#ifdef LCD_HX8357
+	{"hx8357", LCD_HX8357, 480, 320, LCD_ORIENTATION_ROTATED},
+#else
+	{"hx8357", -1, 480, 320, LCD_ORIENTATION_ROTATED},
+#endif
+#ifdef LCD_ST7789
+	{"st7789", LCD_ST7789, 240, 240, LCD_ORIENTATION_NATIVE},
+#else
+	{"st7789", -1, 240, 240, LCD_ORIENTATION_NATIVE},
+#endif
+	{NULL, 0, 0, 0, 0}
+};
+static const LCDTYPE *pLCDType; // the controller we're driving
+static int iLCDWidth, iLCDHeight; // size of the LCD image in pixels
 
 // Maximum supported GPIO pins
 #define MAX_GPIO 43
@@ -55,23 +123,125 @@ VC_RECT_T rect1;
 // Pointers to the local copies of the framebuffer
 static unsigned char *pScreen, *pAltScreen;
 #if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
-static unsigned char *pFB; // pointer to /dev/fb0
+static unsigned char *pFB; // pointer to /dev/fb0 (the page being shown)
+static unsigned char *pFBMap; // start of the fb0 mapping
+static uint32_t u32PanX = ~0U, u32PanY = ~0U; // pan offset of the page pFB points at; ~0 = not read yet
 static int iFBPitch; // bytes per line of /dev/fb0
 static int iScreenSize;
 // Framebuffer variable and fixed info
 static struct fb_var_screeninfo vinfo;
 static struct fb_fix_screeninfo finfo;
+static void SelectConverter(void);
+#ifdef HAVE_DRM
+static int InitDRM(void);
+#endif
 #endif // !_RPIZERO_
+// With the KMS capture backend (--drm), only the rows of tiles inside the
+// producer's damage clips are converted and compared
+static int bDamageFrame; // pDamageRows applies to the frame being captured
+static int bDRMFull = 1; // compare all of the next KMS frame, not only its damage
+static unsigned char *pDamageRows; // 1 byte per row of tiles, non-zero = damaged
 static int iLCDPitch; // bytes per line of our LCD buffer
-static int fbfd; // framebuffer file handle
+static int fbfd = -1; // framebuffer file handle
 static int iTileWidth, iTileHeight;
+// The dirty tile map has 1 bit per tile; each row of tiles starts on a new
+// 64-bit word so a row can be scanned with count-trailing-zeros
+static int iTilesX, iTilesY, iTileWords; // tile grid size, words per row of tiles
+static uint64_t *pDirtyMap; // dirty tiles of the current frame
+// With --tight, only the part of each dirty tile which changed is sent
+typedef struct tag_TILERECT
+{
+	uint16_t x0, y0, x1, y1; // bounds of the changes relative to the tile (x1,y1 exclusive)
+} TILERECT;
+static int bTightRects;
+static TILERECT *pTileRects; // one per tile, only valid for dirty tiles
+static uint64_t llBytesSent, llBytesChanged; // SPI pixel bytes vs bytes which actually changed
+// With --coalesce, runs of dirty tiles are merged into larger rectangles
+typedef struct tag_BBRECT
+{
+	int16_t x, y, w, h;
+} BBRECT;
+static int bCoalesce;
+static BBRECT *pRectList; // rectangles to send for the current frame
+// With --budget, only the dirty tiles which fit in the SPI time of one frame
+// are sent; the rest wait (at most --max_stale frames) in the pending map
+static int bBudget, iMaxStale;
+static uint64_t *pPending, *pSendMap; // tiles waiting to be sent, tiles sent this frame
+static uint8_t *pTileAge; // frames each pending tile has waited
+static TILERECT *pPendRects; // changed area of each pending tile
+static uint64_t *pTileKeys; // sort keys used to pick the pending tiles to send
+static volatile int iPendingTiles; // tiles still owed to the LCD (--budget or --interlace)
+static int iStaleMax, iDeferred; // statistics since the last report
+static uint64_t llStaleSum, llStaleTiles;
+// With --interlace, frames whose changes don't fit in the SPI time of a frame
+// are sent as fields: the even lines of the dirty tiles, then the odd lines
+// on the next frame. Progressive mode returns once the load drops below
+// --interlace_off percent of the budget.
+static int bInterlace, iInterlaceOn, iInterlaceOff; // enable, enter/leave thresholds (% of a frame)
+static int bInterlaced, iField; // current mode, parity of the next field
+static uint64_t *pOwedMap; // tiles which still need the other field
+static int iFieldFrames, iProgressiveFrames; // statistics
+//
+// Per-tile signatures (--hash)
+//
+static int bHashTiles;
+static uint64_t *pTileHash; // signature of each tile as last sent to the LCD
+static uint64_t *pRowHash; // signatures of the frame being captured
+//
+// Solid color fills (--fill)
+//
+static int bFillTiles;
+static uint16_t *pFillLine; // one LCD line of the current fill color
+static int iFillColor = -1; // color in pFillLine, -1 = none yet
+static int iFillRects, iPixelRects; // statistics
+static uint64_t llFillBytes;
+// Simple model of the SPI bus; each transaction sends the address window
+// commands (CASET + PASET + RAMWR = 11 bytes) and costs a fixed amount
+// of driver/chip select overhead on top of the bytes on the wire
+#define SPI_WINDOW_BYTES 11
+static int iSPIOverhead; // per transaction overhead in ns
+static unsigned char *pLineBuf; // one converted line of the LCD image
 static int bRunning, bShowFPS, bLCDFlip, iSPIChan, iSPIFreq, iDC, iReset, iLED;
 static char szKeyConfig[256]; // text file defining GPIO keyboard mapping
 static int iKeyDefs; // number of GPIO keys defined
 static int iGPIOList[MAX_GPIO], iKeyList[MAX_GPIO], iKeyState[MAX_GPIO];
+static int iLineList[MAX_GPIO]; // gpiochip line offset of each key
+static char szGPIOChip[64]; // read the keys from this GPIO character device (--gpiochip)
+static int iDebounce; // ms to ignore a key's edges after it changes state
 static int fdui; // file handle for uinput
 static int bBackground; // indicates if our process is running in the bkgd
-void shutdown(void);
+static char szBench[32]; // name of the benchmark to run instead of copying
+static int bFused; // capture, compare and update the shadow copy in one pass
+static char szRecord[256], szTrace[256]; // trace file to write (--record) or replay (--replay)
+static int iTargetFPS; // frame rate the copy thread paces itself to
+#define SYNC_AUTO 0
+#define SYNC_VSYNC 1
+#define SYNC_TIMER 2
+static int iSyncMode, iIdleFPS; // capture scheduling (--sync, --idle_fps)
+static float fLastFPS; // measured over the last second
+static volatile int bPaused; // stop copying until resumed (control socket)
+static volatile int iNewTileWidth, iNewTileHeight; // tile size change requested at runtime
+static int bAutoTile = 1; // pick the tile size by trying them on the frames (--tile pins it)
+static char szTileProfiles[256] = "/var/lib/bbcp/tiles.txt"; // the sizes learned for each application
+static char szProfile[32]; // name to save them under (--profile), otherwise found
+static pthread_mutex_t ctl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ctl_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tinfo; // copy thread
+static char szControl[108]; // path of the control socket
+#define MAX_WORKERS 8
+static int iWorkers = 1; // threads splitting the capture (--workers), including the copy thread
+static int iWorkerCPU[MAX_WORKERS] = {-1, -1, -1, -1, -1, -1, -1, -1}; // CPU to pin each one to (--affinity), -1 = any
+static __thread int iWorkerIndex; // which worker this thread is; 0 = the copy thread
+static int ChangeTileSize(int iWidth, int iHeight);
+void Shutdown(void);
+//
+// Estimated time (ns) for a number of transactions and pixel bytes on the SPI bus
+//
+static uint64_t SPITransferTime(int iTransactions, uint64_t llBytes)
+{
+	return (uint64_t)iTransactions * iSPIOverhead + ((llBytes + (uint64_t)iTransactions * SPI_WINDOW_BYTES) * 8ULL * 1000000000ULL) / iSPIFreq;
+} /* SPITransferTime() */
+
 //
 // Get the current time in nanoseconds
 //
@@ -124,6 +294,16 @@ int ParseNumber(char *pBuf, int *i, int iLen)
     return iValue;
 } /* ParseNumber() */
 
+//
+// BCM GPIO number of each pin on the Raspberry Pi's 40 pin header
+// (the line offset on its gpiochip0); -1 for power and ground
+//
+static const int iHeaderToBCM[41] = {-1,
+	-1, -1, 2, -1, 3, -1, 4, 14, -1, 15,
+	17, 18, 27, -1, 22, 23, -1, 24, 10, -1,
+	9, 25, 11, 8, -1, 7, 0, 1, 5, -1,
+	6, 12, 13, -1, 19, 16, 26, 20, -1, 21};
+
 //
 // Parse config file which defines GPIO keyboard mapping
 //
@@ -159,14 +339,31 @@ struct uinput_user_dev uidev;
             		i+=4;
 			j = ParseNumber(pBuf, &i, iLen); // capture GPIO pin number
 			k = ParseNumber(pBuf, &i, iLen); // capture keyboard code
-			if (j <= MAX_GPIO && k >= 1 && k < 255) // valid?
+			if (j <= MAX_GPIO && k >= 1 && k < 255 && iKeyDefs < MAX_GPIO) // valid?
 			{
 				iGPIOList[iKeyDefs] = j;
+				iLineList[iKeyDefs] = (j < 41) ? iHeaderToBCM[j] : -1;
 				iKeyList[iKeyDefs] = k;
 				iKeyState[iKeyDefs] = 1; // set to on (not pressed)
 				iKeyDefs++;
 			}
         	}
+		else if (memcmp(&pBuf[i], "line_", 5) == 0) // gpiochip line offset (--gpiochip only)
+		{
+			i+=5;
+			j = ParseNumber(pBuf, &i, iLen);
+			k = ParseNumber(pBuf, &i, iLen);
+			if (szGPIOChip[0] == 0)
+				fprintf(stderr, "line_%d needs --gpiochip; ignoring it\n", j);
+			else if (j >= 0 && k >= 1 && k < 255 && iKeyDefs < MAX_GPIO)
+			{
+				iGPIOList[iKeyDefs] = -1; // not a header pin
+				iLineList[iKeyDefs] = j;
+				iKeyList[iKeyDefs] = k;
+				iKeyState[iKeyDefs] = 1;
+				iKeyDefs++;
+			}
+		}
 		else
 		{
 			i++;
@@ -213,12 +410,624 @@ static void NanoSleep(uint64_t ns)
 {
 struct timespec ts;
 
-	if (ns <= 100LL || ns > 999999999LL) return;
-	ts.tv_sec = 0;
-	ts.tv_nsec = ns;
+	if (ns <= 100LL) return;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
 	nanosleep(&ts, NULL);
 } /* NanoSleep() */
 
+//
+// qsort() helper
+//
+static int CompareU64(const void *p1, const void *p2)
+{
+uint64_t ll1 = *(const uint64_t *)p1, ll2 = *(const uint64_t *)p2;
+
+	return (ll1 > ll2) - (ll1 < ll2);
+} /* CompareU64() */
+
+//
+// Set the tile size and recalculate the tile grid which covers the LCD
+//
+static void SetTileSize(int iWidth, int iHeight)
+{
+	if (iWidth < 1) iWidth = 1;
+	if (iHeight < 1) iHeight = 1;
+	if (iWidth > iLCDWidth) iWidth = iLCDWidth;
+	if (iHeight > iLCDHeight) iHeight = iLCDHeight;
+	iTileWidth = iWidth;
+	iTileHeight = iHeight;
+	iTilesX = (iLCDWidth + iTileWidth - 1) / iTileWidth;
+	iTilesY = (iLCDHeight + iTileHeight - 1) / iTileHeight;
+	iTileWords = (iTilesX + 63) >> 6;
+} /* SetTileSize() */
+
+//
+// Allocate a cleared dirty tile map for the current tile grid
+//
+static uint64_t *AllocDirtyMap(void)
+{
+	return (uint64_t *)calloc(iTilesY * iTileWords, sizeof(uint64_t));
+} /* AllocDirtyMap() */
+
+//
+// Returns true if any tile in this row of the dirty map is set
+//
+static int RowIsDirty(uint64_t *pRow)
+{
+int i;
+
+	for (i=0; i<iTileWords; i++)
+	{
+		if (pRow[i])
+			return 1;
+	}
+	return 0;
+} /* RowIsDirty() */
+
+//
+// Allocate the buffers which depend on the tile grid
+// Return 0 for success, 1 for failure
+//
+static int AllocTileBuffers(void)
+{
+	pTileKeys = malloc(iTilesX * iTilesY * sizeof(uint64_t));
+	pDirtyMap = AllocDirtyMap();
+	pTileRects = malloc(iTilesX * iTilesY * sizeof(TILERECT));
+	pRectList = malloc(iTilesX * iTilesY * sizeof(BBRECT));
+	pPending = AllocDirtyMap();
+	pSendMap = AllocDirtyMap();
+	pTileAge = calloc(iTilesX * iTilesY, 1);
+	pPendRects = malloc(iTilesX * iTilesY * sizeof(TILERECT));
+	pOwedMap = AllocDirtyMap();
+	pTileHash = malloc(iTilesX * iTilesY * sizeof(uint64_t));
+	pRowHash = malloc(iTilesX * iTilesY * sizeof(uint64_t));
+	pDamageRows = calloc(iTilesY, 1);
+	iPendingTiles = 0;
+	bDRMFull = 1; // the grid changed
+	if (pDirtyMap == NULL || pTileRects == NULL || pRectList == NULL || pPending == NULL || pSendMap == NULL || pTileAge == NULL || pPendRects == NULL || pTileKeys == NULL || pOwedMap == NULL || pTileHash == NULL || pRowHash == NULL || pDamageRows == NULL)
+		return 1;
+	// nothing is known about the LCD yet; every tile will look changed
+	memset(pTileHash, 0xff, iTilesX * iTilesY * sizeof(uint64_t));
+	return 0;
+} /* AllocTileBuffers() */
+
+static void FreeTileBuffers(void)
+{
+	free(pDirtyMap);
+	free(pTileRects);
+	free(pRectList);
+	free(pPending);
+	free(pSendMap);
+	free(pTileAge);
+	free(pPendRects);
+	free(pTileKeys);
+	free(pOwedMap);
+	free(pTileHash);
+	free(pRowHash);
+	free(pDamageRows);
+	pDamageRows = NULL;
+	pTileKeys = pTileHash = pRowHash = NULL;
+	pDirtyMap = pPending = pSendMap = pOwedMap = NULL;
+	pTileRects = pPendRects = NULL;
+	pRectList = NULL;
+	pTileAge = NULL;
+} /* FreeTileBuffers() */
+
+//
+// Allocate the local copies of the LCD image and the dirty tile map
+// for the current geometry
+// Return 0 for success, 1 for failure
+//
+static int AllocBuffers(void)
+{
+	// Allocate 2 local copies of the framebuffer for comparison
+	iLCDPitch = iLCDWidth * 2;
+	pScreen = malloc(iLCDPitch * iLCDHeight);
+	pAltScreen = malloc(iLCDPitch * iLCDHeight); // our copy of the display
+	pLineBuf = malloc(iLCDPitch);
+	pFillLine = malloc(iLCDPitch);
+	iFillColor = -1;
+	if (pScreen == NULL || pAltScreen == NULL || pLineBuf == NULL || pFillLine == NULL)
+		return 1;
+	return AllocTileBuffers();
+} /* AllocBuffers() */
+
+//
+// Free the buffers allocated by AllocBuffers()
+//
+static void FreeBuffers(void)
+{
+	free(pScreen);
+	free(pAltScreen);
+	free(pLineBuf);
+	free(pFillLine);
+	pScreen = pAltScreen = pLineBuf = NULL;
+	pFillLine = NULL;
+	FreeTileBuffers();
+} /* FreeBuffers() */
+
+//
+// Stage metrics (--stats <file>, "metrics" on the control socket)
+// Each stage of a frame is timed with the monotonic clock into an HDR style
+// histogram: every power of 2 is split into 8 linear buckets, so any value
+// from 1ns to 4s is kept to within ~12% in 240 counters. Each histogram
+// has one writer (the copy thread, or the send thread for the send stages
+// with --pipeline) which uses plain relaxed stores, and readers take a
+// snapshot without any locking. Nothing is timed unless --stats or
+// --latency is given or the metrics were read in the last minute; then
+// each probe is a single test of bMetrics.
+//
+enum {
+	STAGE_KEYS = 0,
+	STAGE_CAPTURE, // fb0 to pScreen (with --fused, --hash or --workers: + compare + shadow)
+	STAGE_DIFF, // dirty tiles and their rectangles
+	STAGE_SHADOW, // shadow copy update
+	STAGE_SEND, // all of the LCD output of a frame
+	STAGE_SPI, // one transfer to the LCD
+	STAGE_FRAME, // one pass of the copy loop
+	STAGE_INPUT, // key press to the end of the first frame drawn after it
+	STAGE_GPIO, // GPIO edge (kernel timestamp) to the uinput event (--gpiochip)
+	STAGE_TILES, // changed tiles per frame sent (not a time)
+	STAGE_BYTES, // pixel bytes per frame sent (not a time)
+	STAGE_COUNT
+};
+static const char *szStageNames[STAGE_COUNT] = {"keys", "capture", "diff", "shadow", "send", "spi", "frame", "key->lcd", "gpio->key", "tiles/frm", "bytes/frm"};
+#define HIST_BUCKETS 240
+typedef struct tag_HISTOGRAM
+{
+	uint32_t u32Count, u32Max;
+	uint32_t u32Bucket[HIST_BUCKETS];
+} HISTOGRAM;
+static HISTOGRAM Histograms[STAGE_COUNT];
+static volatile int bMetrics, bMetricsReset;
+static uint32_t u32MetricFrames, u32MissedFrames; // frames which took longer than 1/fps
+static uint64_t llMetricsRead; // when they were last asked for
+static char szStatsFile[256];
+static int bLatency; // print the key->lcd latencies when we quit
+static uint64_t llKeyPress; // oldest key press no frame has answered yet
+static uint32_t u32KeyPresses, u32KeysDropped;
+static pthread_mutex_t key_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define KEY_TIMEOUT 1000000000LL
+
+static int HistBucket(uint32_t u32)
+{
+int iLog;
+
+	if (u32 < 16)
+		return u32; // exact
+	iLog = 31 - __builtin_clz(u32);
+	return ((iLog - 2) << 3) + ((u32 >> (iLog - 3)) & 7);
+} /* HistBucket() */
+
+//
+// Largest value which falls in a bucket
+//
+static uint32_t HistBucketMax(int iBucket)
+{
+int iLog;
+
+	if (iBucket < 16)
+		return iBucket;
+	iLog = (iBucket >> 3) + 2;
+	return ((8U + (iBucket & 7)) << (iLog - 3)) + (1U << (iLog - 3)) - 1;
+} /* HistBucketMax() */
+
+static void HistAdd(HISTOGRAM *pHist, uint64_t llValue)
+{
+uint32_t u32 = (llValue > 0xffffffffULL) ? 0xffffffff : (uint32_t)llValue;
+int i = HistBucket(u32);
+
+	__atomic_store_n(&pHist->u32Bucket[i], pHist->u32Bucket[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pHist->u32Count, pHist->u32Count + 1, __ATOMIC_RELAXED);
+	if (u32 > pHist->u32Max)
+		__atomic_store_n(&pHist->u32Max, u32, __ATOMIC_RELAXED);
+} /* HistAdd() */
+
+//
+// Value at or below which iPercent of the samples are (bucket resolution)
+//
+static uint32_t HistPercentile(HISTOGRAM *pHist, uint32_t u32Count, int iPercent)
+{
+uint64_t llTarget, llSum = 0;
+uint32_t u32Max = __atomic_load_n(&pHist->u32Max, __ATOMIC_RELAXED);
+int i;
+
+	llTarget = ((uint64_t)u32Count * iPercent + 99) / 100;
+	for (i=0; i<HIST_BUCKETS; i++)
+	{
+		llSum += __atomic_load_n(&pHist->u32Bucket[i], __ATOMIC_RELAXED);
+		if (llSum >= llTarget) // report the bucket's top edge, but never above the largest sample
+			return (HistBucketMax(i) < u32Max) ? HistBucketMax(i) : u32Max;
+	}
+	return u32Max;
+} /* HistPercentile() */
+
+//
+// Timing probes; a start time of 0 means the metrics are off
+//
+static inline uint64_t StageStart(void)
+{
+	return bMetrics ? NanoClock() : 0;
+} /* StageStart() */
+
+// Record the time since llStart and return the current time as the next start
+static inline uint64_t StageNext(int iStage, uint64_t llStart)
+{
+uint64_t llNow;
+
+	if (llStart == 0)
+		return 0;
+	llNow = NanoClock();
+	HistAdd(&Histograms[iStage], llNow - llStart);
+	return llNow;
+} /* StageNext() */
+
+static inline void StageValue(int iStage, uint64_t llValue)
+{
+	if (bMetrics)
+		HistAdd(&Histograms[iStage], llValue);
+} /* StageValue() */
+
+//
+// Print the metrics as a text table; returns the length
+//
+static int FormatMetrics(char *szOut, int iLen)
+{
+HISTOGRAM *pHist;
+uint32_t u32Count;
+int i, iPos;
+
+	iPos = snprintf(szOut, iLen, "stage         count     p50        p99        max  (us, or per frame)\n");
+	for (i=0; i<STAGE_COUNT && iPos < iLen; i++)
+	{
+		pHist = &Histograms[i];
+		u32Count = __atomic_load_n(&pHist->u32Count, __ATOMIC_RELAXED);
+		if (i < STAGE_TILES) // times
+			iPos += snprintf(&szOut[iPos], iLen - iPos, "%-10s %8u %10.1f %10.1f %10.1f\n", szStageNames[i], u32Count,
+				u32Count ? HistPercentile(pHist, u32Count, 50) / 1000.0 : 0.0, u32Count ? HistPercentile(pHist, u32Count, 99) / 1000.0 : 0.0,
+				pHist->u32Max / 1000.0);
+		else
+			iPos += snprintf(&szOut[iPos], iLen - iPos, "%-10s %8u %10u %10u %10u\n", szStageNames[i], u32Count,
+				u32Count ? HistPercentile(pHist, u32Count, 50) : 0, u32Count ? HistPercentile(pHist, u32Count, 99) : 0, pHist->u32Max);
+	}
+	if (iPos < iLen)
+		iPos += snprintf(&szOut[iPos], iLen - iPos, "frames %u missed %u (longer than 1/%d s)\n", u32MetricFrames, u32MissedFrames, iTargetFPS);
+	if (u32KeyPresses && iPos < iLen)
+		iPos += snprintf(&szOut[iPos], iLen - iPos, "key presses %u, %u changed nothing on the screen\n", u32KeyPresses, u32KeysDropped);
+	return (iPos < iLen) ? iPos : iLen - 1;
+} /* FormatMetrics() */
+
+//
+// Clear the histograms; only called by the copy thread (when asked to)
+//
+static void ResetMetrics(void)
+{
+	memset(Histograms, 0, sizeof(Histograms));
+	u32MetricFrames = u32MissedFrames = 0;
+	pthread_mutex_lock(&key_mutex);
+	u32KeyPresses = u32KeysDropped = 0;
+	llKeyPress = 0;
+	pthread_mutex_unlock(&key_mutex);
+	bMetricsReset = 0;
+} /* ResetMetrics() */
+
+//
+// Replace the --stats file with the current metrics (written to a temporary
+// file and renamed, so a reader never sees half of it)
+//
+static void WriteStatsFile(void)
+{
+char szTemp[272], szText[2048];
+FILE *pf;
+
+	snprintf(szTemp, sizeof(szTemp), "%s.tmp", szStatsFile);
+	pf = fopen(szTemp, "w");
+	if (pf == NULL)
+		return;
+	fwrite(szText, 1, FormatMetrics(szText, sizeof(szText)), pf);
+	fclose(pf);
+	rename(szTemp, szStatsFile);
+} /* WriteStatsFile() */
+
+//
+// Input-to-photon latency
+// ProcessKeys() stamps each key press as it's written to uinput. The first
+// frame captured after it with anything to draw answers it, and the time
+// from the press until the last byte of that frame has been sent to the LCD
+// goes in the key->lcd histogram. This includes the app's reaction and the
+// compositor as well as our own capture, compare and send, which is what the
+// player sees. Presses which arrive before the answer are counted but not
+// timed (the frame answers the oldest one), and a press which doesn't change
+// the screen within a second is dropped rather than charged to some
+// unrelated change later on. With --gpiochip the presses come from the
+// key thread, so the pending press is handed over under key_mutex.
+//
+static void KeyPressed(uint64_t llTime)
+{
+	if (!bMetrics)
+		return;
+	pthread_mutex_lock(&key_mutex);
+	u32KeyPresses++;
+	if (llKeyPress == 0)
+		llKeyPress = llTime;
+	pthread_mutex_unlock(&key_mutex);
+} /* KeyPressed() */
+
+//
+// Called once a frame has been compared; returns the time of the press it
+// answers (to be finished by KeyAnswered when it has been sent) or 0
+//
+static uint64_t KeyFrame(int iChanged)
+{
+uint64_t llPress;
+
+	if (!bMetrics)
+		return 0;
+	pthread_mutex_lock(&key_mutex);
+	llPress = llKeyPress;
+	if (llPress && iChanged)
+		llKeyPress = 0;
+	else if (llPress && NanoClock() - llPress > KEY_TIMEOUT)
+	{
+		u32KeysDropped++;
+		llKeyPress = llPress = 0;
+	}
+	else
+		llPress = 0;
+	pthread_mutex_unlock(&key_mutex);
+	return llPress;
+} /* KeyFrame() */
+
+static void KeyAnswered(uint64_t llPress)
+{
+	if (llPress && bMetrics)
+		HistAdd(&Histograms[STAGE_INPUT], NanoClock() - llPress);
+} /* KeyAnswered() */
+
+//
+// Print the key->lcd latency distribution (--latency)
+//
+static void ShowLatency(void)
+{
+HISTOGRAM *pHist = &Histograms[STAGE_INPUT];
+uint32_t u32Count = pHist->u32Count;
+
+	printf("Key press to LCD latency: %u presses, %u timed, %u changed nothing\n", u32KeyPresses, u32Count, u32KeysDropped);
+	if (u32Count)
+		printf("  p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", HistPercentile(pHist, u32Count, 50) / 1000000.0,
+			HistPercentile(pHist, u32Count, 90) / 1000000.0, HistPercentile(pHist, u32Count, 99) / 1000000.0, pHist->u32Max / 1000000.0);
+	pHist = &Histograms[STAGE_GPIO];
+	u32Count = pHist->u32Count;
+	if (u32Count) // --gpiochip
+		printf("GPIO edge to uinput event: %u edges, p50 %.1f us, p99 %.1f us, max %.1f us\n", u32Count, HistPercentile(pHist, u32Count, 50) / 1000.0,
+			HistPercentile(pHist, u32Count, 99) / 1000.0, pHist->u32Max / 1000.0);
+} /* ShowLatency() */
+
+//
+// LCD output backends ("sinks")
+// All drawing goes through one of these so that the capture/compare/send
+// code can run and be measured without a real display
+//
+typedef struct tag_LCDSINK
+{
+	const char *szName;
+	int (*pfnInit)(int bLCDFlip, int iSPIChan, int iSPIFreq, int iDC, int iReset, int iLED);
+	void (*pfnShutdown)(void);
+	void (*pfnDrawTile)(int x, int y, int iWidth, int iHeight, unsigned char *pPixels, int iPitch);
+	void (*pfnFlush)(void); // called after the last transfer of each frame
+	void (*pfnScroll)(int iOffset); // set the panel's scroll start line (VSCRSADD); NULL = can't scroll
+} LCDSINK;
+
+// Hardware scrolling (--hwscroll)
+// The panel can only scroll along its native vertical axis; that's the LCD's
+// y axis in native orientation and its x axis when the panel is turned sideways.
+// Once scrolled, LCD line n is shown from panel memory line n + iScrollOffset.
+#define SCROLL_ROWS 1
+#define SCROLL_COLUMNS 2
+#define SCROLL_PROBES 16 // lines of the new frame looked up in the old one
+static int bHWScroll, iScrollAxis, iScrollLines, iScrollOffset;
+
+#ifndef NO_SPI_LCD
+//
+// SPI_LCD library backend
+//
+static int SPIInit(int bLCDFlip, int iSPIChan, int iSPIFreq, int iDC, int iReset, int iLED)
+{
+	if (spilcdInit(pLCDType->iType, bLCDFlip, iSPIChan, iSPIFreq, iDC, iReset, iLED))
+		return 1;
+	spilcdSetOrientation(pLCDType->iOrientation); // e.g. we want landscape mode on the ili9341
+	return 0;
+} /* SPIInit() */
+
+static void SPIShutdown(void)
+{
+	spilcdShutdown();
+} /* SPIShutdown() */
+
+static void SPIDrawTile(int x, int y, int iWidth, int iHeight, unsigned char *pPixels, int iPitch)
+{
+	spilcdDrawTile(x, y, iWidth, iHeight, pPixels, iPitch);
+} /* SPIDrawTile() */
+
+static void SPIFlush(void)
+{
+} /* SPIFlush() */
+#endif // NO_SPI_LCD
+
+//
+// Virtual LCD backend
+// Keeps the panel contents in memory and adds up how long the transfers
+// would take on the SPI bus (see SPITransferTime()). With --virtual_realtime
+// it also sleeps for that long so frame rates look like the real thing.
+// Frames can be written out as PPM files with --dump <directory>.
+//
+static uint16_t *pVirtualPanel;
+static int bVirtualRealtime, iVirtualFrame, iVirtualScroll;
+static char szDumpDir[256];
+static int iBusTransactions; // totals since the last call of ShowBusStats()
+static uint64_t llBusBytes, llBusTime, llFrameBusTime;
+
+static int VirtualInit(int bLCDFlip, int iSPIChan, int iSPIFreq, int iDC, int iReset, int iLED)
+{
+	pVirtualPanel = calloc(iLCDWidth * iLCDHeight, sizeof(uint16_t));
+	iVirtualFrame = iVirtualScroll = 0;
+	return (pVirtualPanel == NULL);
+} /* VirtualInit() */
+
+static void VirtualShutdown(void)
+{
+	free(pVirtualPanel);
+	pVirtualPanel = NULL;
+} /* VirtualShutdown() */
+
+static void VirtualDrawTile(int x, int y, int iWidth, int iHeight, unsigned char *pPixels, int iPitch)
+{
+int i;
+uint64_t llTime;
+
+	for (i=0; i<iHeight; i++)
+	{
+		memcpy(&pVirtualPanel[(y+i) * iLCDWidth + x], &pPixels[i * iPitch], iWidth * 2);
+	}
+	llTime = SPITransferTime(1, iWidth * iHeight * 2);
+	iBusTransactions++;
+	llBusBytes += iWidth * iHeight * 2 + SPI_WINDOW_BYTES;
+	llBusTime += llTime;
+	llFrameBusTime += llTime;
+} /* VirtualDrawTile() */
+
+static void VirtualScroll(int iOffset)
+{
+uint64_t llTime;
+
+	iVirtualScroll = iOffset;
+	llTime = SPITransferTime(1, 0); // one command, about the size of a window
+	iBusTransactions++;
+	llBusBytes += SPI_WINDOW_BYTES;
+	llBusTime += llTime;
+	llFrameBusTime += llTime;
+} /* VirtualScroll() */
+
+//
+// Copy what the virtual panel shows (with its scroll offset) to pOut
+//
+static void VirtualSnapshot(uint16_t *pOut)
+{
+int x, y, m;
+
+	for (y=0; y<iLCDHeight; y++)
+	{
+		if (iScrollAxis == SCROLL_ROWS)
+		{
+			m = (y + iVirtualScroll) % iLCDHeight;
+			memcpy(&pOut[y * iLCDWidth], &pVirtualPanel[m * iLCDWidth], iLCDWidth * 2);
+		}
+		else
+		{
+			for (x=0; x<iLCDWidth; x++)
+				pOut[y * iLCDWidth + x] = pVirtualPanel[y * iLCDWidth + (x + iVirtualScroll) % iLCDWidth];
+		}
+	}
+} /* VirtualSnapshot() */
+
+//
+// Write the virtual panel as a binary PPM file
+//
+static void VirtualDump(void)
+{
+char szName[300];
+unsigned char *pRGB;
+uint16_t us, *pShown;
+FILE *pf;
+int i;
+
+	snprintf(szName, sizeof(szName), "%s/frame_%06d.ppm", szDumpDir, iVirtualFrame);
+	pf = fopen(szName, "wb");
+	if (pf == NULL)
+		return;
+	pRGB = malloc(iLCDWidth * iLCDHeight * 3);
+	pShown = malloc(iLCDWidth * iLCDHeight * 2);
+	VirtualSnapshot(pShown);
+	for (i=0; i<iLCDWidth * iLCDHeight; i++)
+	{
+		us = pShown[i]; // expand RGB565 to RGB888
+		pRGB[i*3] = ((us >> 8) & 0xf8) | (us >> 13);
+		pRGB[i*3+1] = ((us >> 3) & 0xfc) | ((us >> 9) & 3);
+		pRGB[i*3+2] = ((us << 3) & 0xf8) | ((us >> 2) & 7);
+	}
+	fprintf(pf, "P6\n%d %d\n255\n", iLCDWidth, iLCDHeight);
+	if (fwrite(pRGB, 1, iLCDWidth * iLCDHeight * 3, pf) != (size_t)(iLCDWidth * iLCDHeight * 3))
+		fprintf(stderr, "Error writing %s\n", szName);
+	fclose(pf);
+	free(pRGB);
+	free(pShown);
+} /* VirtualDump() */
+
+static void VirtualFlush(void)
+{
+	if (szDumpDir[0])
+		VirtualDump();
+	iVirtualFrame++;
+	if (bVirtualRealtime) // wait as long as the bus would have been busy
+		NanoSleep(llFrameBusTime);
+	llFrameBusTime = 0;
+} /* VirtualFlush() */
+
+static const LCDSINK LCDSinks[] = {
+#ifndef NO_SPI_LCD
+	{"spi", SPIInit, SPIShutdown, SPIDrawTile, SPIFlush, NULL}, // no --hwscroll until it's been tried on a panel
+#endif
+	{"virtual", VirtualInit, VirtualShutdown, VirtualDrawTile, VirtualFlush, VirtualScroll},
+	{NULL, NULL, NULL, NULL, NULL, NULL}
+};
+static const LCDSINK *pSink = &LCDSinks[0]; // where our output goes
+
+//
+// Draw a rectangle given in LCD coordinates; when the panel is scrolled
+// this maps it to panel memory and splits it where the memory wraps
+//
+static void LCDDrawTile(int x, int y, int iWidth, int iHeight, unsigned char *pPixels, int iPitch)
+{
+uint64_t t = StageStart();
+int i;
+
+	if (iScrollOffset == 0)
+	{
+		(*pSink->pfnDrawTile)(x, y, iWidth, iHeight, pPixels, iPitch);
+	}
+	else if (iScrollAxis == SCROLL_ROWS)
+	{
+		y = (y + iScrollOffset) % iScrollLines;
+		i = (y + iHeight > iScrollLines) ? iScrollLines - y : iHeight;
+		(*pSink->pfnDrawTile)(x, y, iWidth, i, pPixels, iPitch);
+		if (i < iHeight)
+			(*pSink->pfnDrawTile)(x, 0, iWidth, iHeight - i, &pPixels[i * iPitch], iPitch);
+	}
+	else
+	{
+		x = (x + iScrollOffset) % iScrollLines;
+		i = (x + iWidth > iScrollLines) ? iScrollLines - x : iWidth;
+		(*pSink->pfnDrawTile)(x, y, i, iHeight, pPixels, iPitch);
+		if (i < iWidth)
+			(*pSink->pfnDrawTile)(0, y, iWidth - i, iHeight, &pPixels[i * 2], iPitch);
+	}
+	StageNext(STAGE_SPI, t);
+} /* LCDDrawTile() */
+
+//
+// Print and reset the (modeled) bus usage of the virtual LCD
+//
+static void ShowBusStats(uint64_t llElapsed)
+{
+	if (!bBackground && iBusTransactions)
+		printf("  bus: %d transactions, %d KB, %.1f ms modeled transfer time (%.0f%% busy)\n",
+			iBusTransactions, (int)(llBusBytes >> 10), (double)llBusTime / 1000000.0,
+			llElapsed ? 100.0 * (double)llBusTime / (double)llElapsed : 0.0);
+	iBusTransactions = 0;
+	llBusBytes = llBusTime = 0;
+} /* ShowBusStats() */
+
 //
 // Initialize the framebuffer and SPI LCD
 //
@@ -243,7 +1052,7 @@ static int InitDisplay(int bLCDFlip, int iSPIChan, int iSPIFreq, int iDC, int iR
 		fprintf(stderr, "Unable to get primary display information\n");
 		return 1;
 	}
-	screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, LCD_CX, LCD_CY, &image_prt);
+	screen_resource = vc_dispmanx_resource_create(VC_IMAGE_RGB565, iLCDWidth, iLCDHeight, &image_prt);
 	if (!screen_resource)
 	{
 		fprintf(stderr, "Unable to create screen buffer\n");
@@ -251,428 +1060,6080 @@ static int InitDisplay(int bLCDFlip, int iSPIChan, int iSPIFreq, int iDC, int iR
 		vc_dispmanx_display_close(display);
 		return 1;
 	}
-	vc_dispmanx_rect_set(&rect1, 0, 0, LCD_CX, LCD_CY);
+	vc_dispmanx_rect_set(&rect1, 0, 0, iLCDWidth, iLCDHeight);
 }
 #else
-	// Open and map a pointer to the fb0 framebuffer
-	fbfd = open("/dev/fb0", O_RDWR);
-	if (fbfd)
+	// Open and map a pointer to the fb0 framebuffer (unless a KMS one was found)
+	fbfd = -1;
+#ifdef HAVE_DRM
+	if (InitDRM())
+#endif // HAVE_DRM
+		fbfd = open("/dev/fb0", O_RDWR);
+	if (fbfd >= 0)
 	{
         // get the fixed screen info
         ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo);
       	// get the variable screen info
         ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo);
-        iFBPitch = (vinfo.xres * vinfo.bits_per_pixel) / 8;
+        iFBPitch = finfo.line_length ? finfo.line_length : (vinfo.xres * vinfo.bits_per_pixel) / 8;
         iScreenSize = finfo.smem_len;
-        pFB = (unsigned char *)mmap(0, iScreenSize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+        pFBMap = (unsigned char *)mmap(0, iScreenSize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+        pFB = pFBMap; // FBPage() moves it to the page being shown
+        SelectConverter();
 	}
-	else // can't open display
+	else if (pFB == NULL) // can't open display
 	{
 		return 1;
 	}
 #endif // _RPIZERO_
 
-	if (spilcdInit(LCD_ILI9341, bLCDFlip, iSPIChan, iSPIFreq, iDC, iReset, iLED))
+	if ((*pSink->pfnInit)(bLCDFlip, iSPIChan, iSPIFreq, iDC, iReset, iLED))
 		return 1;
-	spilcdSetOrientation(LCD_ORIENTATION_ROTATED); // we want landscape mode on the ili9341; an ili9342 wouldn't require this
 	
-	// Allocate 2 local copies of the framebuffer for comparison
-	iLCDPitch = LCD_CX * 2;
-	pScreen = malloc(iLCDPitch * LCD_CY);
-	pAltScreen = malloc(iLCDPitch * LCD_CY); // our copy of the display
-
-	return 0;
+	return AllocBuffers();
 } /* InitDisplay() */
 
 //
-// Compare the current frame with the previous and mark changed tiles
-// as a set bit in an array of flags
-//
-static int FindChangedRegion(unsigned char *pSrc, unsigned char *pDst, int iWidth,
- int iHeight, int iPitch, int iTileWidth, int iTileHeight, uint32_t *pRegions)
-{
-int x, y, xc, yc, dy;
-int xCount, yCount;
-uint32_t *s, *d, u32RowBits;
-int iTotalChanged = 0;
-//
-// Divide the image into 16x16 tiles; each tile on a row is 1 bit in the changed bit field
-// This makes managing the changes easier for display on a normal monitor and on LCDs with
-// slow connections (e.g. SPI/I2C)
-// The code has an "early exit" for each tile. In essence, the more the bitmaps are alike
-// the harder this code will work and the less of the screen will need to be repainted
-// In other words, the performance is balanced such that it should maintain a constant output rate
-// no matter what the bitmap conditions are
+// Tile compare kernels
+// Each one compares a rectangle of iWidthBytes x iHeight bytes between
+// the new and old frames and returns 1 as soon as any byte differs (early exit)
+// or 0 if the tile is unchanged. The fastest supported one is chosen at startup.
 //
-   yCount = (iHeight+iTileHeight-1) / iTileHeight; // divide it into NxN tiles
-   xCount = (iWidth+iTileWidth-1) / iTileWidth;
-
-  // Loop through all of the tiles
-   for (yc=0; yc<yCount; yc++)
-   {
-      u32RowBits = 0;
-      for (xc=0; xc<xCount; xc++)
-      {
-         //point to the current tile
-         s = (uint32_t *)&pSrc[(((yc*iTileHeight)/*+iPatOff*/) * iPitch) + (xc*iTileWidth*2)];
-         d = (uint32_t *)&pDst[(((yc*iTileHeight)/*+iPatOff*/) * iPitch) + (xc*iTileWidth*2)];
-         // loop through the pixels of this tile
-	 if ((yc+1)*iTileHeight > iHeight)
-		dy = iHeight - (yc*iTileHeight);
-	 else
-		dy = iTileHeight;
-         for (y =0/* iPatOff */; y<dy; y++)
-         {
-            for (x = 0; x < iTileWidth/2; x++) // compare pairs of pixels
-            { // test pairs of RGB565 pixels
-               if (s[x] != d[x]) // any change means we mark this strip as being changed and move on
-               {
-                  u32RowBits |= (1 << xc);
-                  iTotalChanged++;
-                  y = iTileHeight; x = iTileWidth; // continue to next tile
-               }
-            } // for x
-            s += (iPitch/4);
-            d += (iPitch/4);
-         } // for y
-      } // for xc
-   pRegions[yc] = u32RowBits;
-   } // for yc
-   return iTotalChanged;
-} /* FindChangedRegion() */
+typedef int (*TILECOMPARE)(unsigned char *pSrc, unsigned char *pDst, int iWidthBytes, int iHeight, int iPitch);
 
-//
-// Take a snapshot of the current FrameBuffer
-// Converts the pixels from RGB8888 to RGB565  if needed
-//
-static void FBCapture(void)
+static int TileCompareC(unsigned char *pSrc, unsigned char *pDst, int iWidthBytes, int iHeight, int iPitch)
 {
-#if defined( _RPIZERO_ ) || defined( _RPI3_ )
-	vc_dispmanx_snapshot(display, screen_resource, 0);
-	vc_dispmanx_resource_read_data(screen_resource, &rect1, pScreen, iLCDPitch);
-#else
-	if (vinfo.xres >= LCD_CX * 2) // need to shrink by 1/4
+int x, y, iPairs;
+uint32_t *s, *d;
+
+	iPairs = iWidthBytes >> 2; // pairs of RGB565 pixels
+	for (y=0; y<iHeight; y++)
 	{
-		if (vinfo.bits_per_pixel == 16)
+		s = (uint32_t *)pSrc;
+		d = (uint32_t *)pDst;
+		for (x=0; x<iPairs; x++)
 		{
-		uint32_t *s, *d, u32Magic, u32_1, u32_2;
-		int x, y;
-			u32Magic = 0xf7def7de;
-			for (y=0; y<LCD_CY; y++)
-			{
-				s = (uint32_t *)&pFB[y*2*iFBPitch];
-				d = (uint32_t *)&pScreen[y*iLCDPitch];
-				for (x=0; x<LCD_CX; x+=2)
-				{
-				// average horizontally
-					u32_1 = s[0];
-					u32_2 = s[1];
-					u32_1 = (u32_1 & u32Magic) >> 1;
-					u32_2 = (u32_2 & u32Magic) >> 1;
-					u32_1 += (u32_1 << 16);
-					u32_2 += (u32_2 >> 16); // average
-					u32_1 = (u32_1 >> 16) | (u32_2 << 16);
-					*d++ = u32_1;
-					s += 2;
-				} // for x
-			} // for y
-		}
-		else // need to convert to RGB565
-		{
-		uint32_t u32, *pSrc;
-		int x, y;
-		uint16_t u16, *pDest;
-
-			for (y=0; y<LCD_CY; y++)
-			{
-				pSrc = (uint32_t *)&pFB[iFBPitch * y * 2];
-				pDest = (uint16_t *)&pScreen[iLCDPitch * y];
-				for (x=0; x<LCD_CX; x++)
+			if (s[x] != d[x]) // any change means the tile is dirty
+				return 1;
+		}
+		if ((iWidthBytes & 2) && *(uint16_t *)&s[iPairs] != *(uint16_t *)&d[iPairs]) // odd pixel
+			return 1;
+		pSrc += iPitch;
+		pDst += iPitch;
+	}
+	return 0;
+} /* TileCompareC() */
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+__attribute__((target("sse2")))
+static int TileCompareSSE2(unsigned char *pSrc, unsigned char *pDst, int iWidthBytes, int iHeight, int iPitch)
+{
+int x, y, iVecBytes;
+__m128i xmmDiff;
+
+	iVecBytes = iWidthBytes & ~15;
+	for (y=0; y<iHeight; y++)
+	{
+		xmmDiff = _mm_setzero_si128();
+		for (x=0; x<iVecBytes; x+=16) // OR together the differences of the whole row
+		{
+			xmmDiff = _mm_or_si128(xmmDiff, _mm_xor_si128(_mm_loadu_si128((__m128i *)&pSrc[x]), _mm_loadu_si128((__m128i *)&pDst[x])));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(xmmDiff, _mm_setzero_si128())) != 0xffff)
+			return 1; // early exit on the first changed row
+		for (; x<iWidthBytes; x+=2) // leftover pixels
+		{
+			if (*(uint16_t *)&pSrc[x] != *(uint16_t *)&pDst[x])
+				return 1;
+		}
+		pSrc += iPitch;
+		pDst += iPitch;
+	}
+	return 0;
+} /* TileCompareSSE2() */
+
+__attribute__((target("avx2")))
+static int TileCompareAVX2(unsigned char *pSrc, unsigned char *pDst, int iWidthBytes, int iHeight, int iPitch)
+{
+int x, y, iVecBytes;
+__m256i ymmDiff;
+
+	iVecBytes = iWidthBytes & ~31;
+	for (y=0; y<iHeight; y++)
+	{
+		ymmDiff = _mm256_setzero_si256();
+		for (x=0; x<iVecBytes; x+=32)
+		{
+			ymmDiff = _mm256_or_si256(ymmDiff, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&pSrc[x]), _mm256_loadu_si256((__m256i *)&pDst[x])));
+		}
+		if (!_mm256_testz_si256(ymmDiff, ymmDiff))
+			return 1;
+		for (; x<iWidthBytes; x+=2)
+		{
+			if (*(uint16_t *)&pSrc[x] != *(uint16_t *)&pDst[x])
+				return 1;
+		}
+		pSrc += iPitch;
+		pDst += iPitch;
+	}
+	return 0;
+} /* TileCompareAVX2() */
+#endif // x86
+
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+static int TileCompareNEON(unsigned char *pSrc, unsigned char *pDst, int iWidthBytes, int iHeight, int iPitch)
+{
+int x, y, iVecBytes;
+uint8x16_t vDiff;
+uint32x2_t vFold;
+
+	iVecBytes = iWidthBytes & ~15;
+	for (y=0; y<iHeight; y++)
+	{
+		vDiff = vdupq_n_u8(0);
+		for (x=0; x<iVecBytes; x+=16)
+		{
+			vDiff = vorrq_u8(vDiff, veorq_u8(vld1q_u8(&pSrc[x]), vld1q_u8(&pDst[x])));
+		}
+		// fold 128 bits down to 32 to test for any difference
+		vFold = vreinterpret_u32_u8(vorr_u8(vget_low_u8(vDiff), vget_high_u8(vDiff)));
+		if (vget_lane_u32(vFold, 0) | vget_lane_u32(vFold, 1))
+			return 1;
+		for (; x<iWidthBytes; x+=2)
+		{
+			if (*(uint16_t *)&pSrc[x] != *(uint16_t *)&pDst[x])
+				return 1;
+		}
+		pSrc += iPitch;
+		pDst += iPitch;
+	}
+	return 0;
+} /* TileCompareNEON() */
+#endif // __ARM_NEON
+
+typedef struct tag_COMPAREKERNEL
+{
+	const char *szName;
+	TILECOMPARE pfnCompare;
+	int bSupported;
+} COMPAREKERNEL;
+
+static COMPAREKERNEL CompareKernels[] = {
+	{"c", TileCompareC, 1},
+#if defined( __x86_64__ ) || defined( __i386__ )
+	{"sse2", TileCompareSSE2, 0},
+	{"avx2", TileCompareAVX2, 0},
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	{"neon", TileCompareNEON, 0},
+#endif
+	{NULL, NULL, 0}
+};
+static TILECOMPARE pfnTileCompare = TileCompareC;
+static char szSIMD[16]; // user override of the compare kernel
+
+//
+// Tile hash kernels (--hash)
+// Each one continues the 64-bit signature of a tile with the next line
+// segment of iBytes bytes. The signature is 2 independent 32-bit lanes
+// which take turns consuming the data, so they can run in parallel and a
+// change has to fool both of them to go unnoticed.
+//
+typedef uint64_t (*TILEHASH)(uint64_t u64Hash, const unsigned char *pSrc, int iBytes);
+#define TILE_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+//
+// Portable version: xor, multiply and rotate. Each step is a bijection of
+// the lane, so a single changed word always changes the signature; the
+// rotate keeps changes to the top bits from cancelling each other out.
+//
+static uint64_t TileHashC(uint64_t u64Hash, const unsigned char *pSrc, int iBytes)
+{
+uint32_t a = (uint32_t)(u64Hash >> 32), b = (uint32_t)u64Hash;
+const uint32_t *s = (const uint32_t *)pSrc;
+int i, iPairs = iBytes >> 2;
+
+	for (i=0; i+1<iPairs; i+=2)
+	{
+		a = (a ^ s[i]) * 0x9e3779b1;
+		a = (a << 15) | (a >> 17);
+		b = (b ^ s[i+1]) * 0x85ebca77;
+		b = (b << 13) | (b >> 19);
+	}
+	if (i < iPairs)
+	{
+		a = (a ^ s[i]) * 0x9e3779b1;
+		a = (a << 15) | (a >> 17);
+	}
+	if (iBytes & 2) // odd pixel
+	{
+		b = (b ^ *(const uint16_t *)&s[iPairs]) * 0x85ebca77;
+		b = (b << 13) | (b >> 19);
+	}
+	return ((uint64_t)a << 32) | b;
+} /* TileHashC() */
+
+#if defined( __x86_64__ )
+__attribute__((target("sse4.2")))
+static uint64_t TileHashSSE42(uint64_t u64Hash, const unsigned char *pSrc, int iBytes)
+{
+uint64_t a = u64Hash >> 32, b = (uint32_t)u64Hash;
+int i;
+
+	for (i=0; i+16<=iBytes; i+=16)
+	{
+		a = _mm_crc32_u64(a, *(const uint64_t *)&pSrc[i]);
+		b = _mm_crc32_u64(b, *(const uint64_t *)&pSrc[i+8]);
+	}
+	if (i+8 <= iBytes)
+	{
+		a = _mm_crc32_u64(a, *(const uint64_t *)&pSrc[i]);
+		i += 8;
+	}
+	for (; i<iBytes; i+=2)
+		b = _mm_crc32_u16((uint32_t)b, *(const uint16_t *)&pSrc[i]);
+	return (a << 32) | b;
+} /* TileHashSSE42() */
+#endif // __x86_64__
+
+#if defined( __aarch64__ )
+#include <arm_acle.h>
+__attribute__((target("+crc")))
+static uint64_t TileHashCRC(uint64_t u64Hash, const unsigned char *pSrc, int iBytes)
+{
+uint32_t a = (uint32_t)(u64Hash >> 32), b = (uint32_t)u64Hash;
+int i;
+
+	for (i=0; i+16<=iBytes; i+=16)
+	{
+		a = __crc32cd(a, *(const uint64_t *)&pSrc[i]);
+		b = __crc32cd(b, *(const uint64_t *)&pSrc[i+8]);
+	}
+	if (i+8 <= iBytes)
+	{
+		a = __crc32cd(a, *(const uint64_t *)&pSrc[i]);
+		i += 8;
+	}
+	for (; i<iBytes; i+=2)
+		b = __crc32ch(b, *(const uint16_t *)&pSrc[i]);
+	return ((uint64_t)a << 32) | b;
+} /* TileHashCRC() */
+#endif // __aarch64__
+
+#if defined( __arm__ )
+// 32-bit ARM only has the 32-bit wide CRC32C instruction; two of them on
+// consecutive words give the same result as one 64-bit one on aarch64.
+// An ARMv8 CPU (Pi 3 and up) running a 32-bit OS has it, older ones don't
+#ifndef AT_HWCAP2
+#define AT_HWCAP2 26
+#endif
+#ifndef HWCAP2_CRC32
+#define HWCAP2_CRC32 (1 << 4)
+#endif
+__attribute__((target("arch=armv8-a+crc")))
+static uint64_t TileHashCRC(uint64_t u64Hash, const unsigned char *pSrc, int iBytes)
+{
+uint32_t a = (uint32_t)(u64Hash >> 32), b = (uint32_t)u64Hash;
+int i;
+
+	for (i=0; i+16<=iBytes; i+=16)
+	{
+		a = __builtin_arm_crc32cw(a, *(const uint32_t *)&pSrc[i]);
+		a = __builtin_arm_crc32cw(a, *(const uint32_t *)&pSrc[i+4]);
+		b = __builtin_arm_crc32cw(b, *(const uint32_t *)&pSrc[i+8]);
+		b = __builtin_arm_crc32cw(b, *(const uint32_t *)&pSrc[i+12]);
+	}
+	if (i+8 <= iBytes)
+	{
+		a = __builtin_arm_crc32cw(a, *(const uint32_t *)&pSrc[i]);
+		a = __builtin_arm_crc32cw(a, *(const uint32_t *)&pSrc[i+4]);
+		i += 8;
+	}
+	for (; i<iBytes; i+=2)
+		b = __builtin_arm_crc32ch(b, *(const uint16_t *)&pSrc[i]);
+	return ((uint64_t)a << 32) | b;
+} /* TileHashCRC() */
+#endif // __arm__
+
+typedef struct tag_HASHKERNEL
+{
+	const char *szName;
+	TILEHASH pfnHash;
+	int bSupported;
+} HASHKERNEL;
+
+static HASHKERNEL HashKernels[] = {
+	{"mul", TileHashC, 1},
+#if defined( __x86_64__ )
+	{"crc32c", TileHashSSE42, 0},
+#endif
+#if defined( __aarch64__ ) || defined( __arm__ )
+	{"crc32c", TileHashCRC, 0},
+#endif
+	{NULL, NULL, 0}
+};
+static TILEHASH pfnTileHash = TileHashC;
+
+//
+// Check which SIMD kernels the CPU we're running on can execute
+// and pick the fastest one (or the one the user asked for)
+//
+static void InitKernels(void)
+{
+int i, j;
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+	__builtin_cpu_init();
+#endif
+	for (i=1; CompareKernels[i].szName != NULL; i++)
+	{
+#if defined( __x86_64__ ) || defined( __i386__ )
+		if (strcmp(CompareKernels[i].szName, "sse2") == 0)
+			CompareKernels[i].bSupported = __builtin_cpu_supports("sse2");
+		else if (strcmp(CompareKernels[i].szName, "avx2") == 0)
+			CompareKernels[i].bSupported = __builtin_cpu_supports("avx2");
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+		if (strcmp(CompareKernels[i].szName, "neon") == 0)
+		{
+#if defined( __aarch64__ )
+			CompareKernels[i].bSupported = 1; // always present on ARMv8
+#else
+			CompareKernels[i].bSupported = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+		}
+#endif
+	}
+	// table is in order of increasing speed; use the last supported one
+	for (i=0, j=-1; CompareKernels[i].szName != NULL; i++)
+	{
+		if (!CompareKernels[i].bSupported)
+			continue;
+		if (szSIMD[0] == '\0' || strcmp(szSIMD, CompareKernels[i].szName) == 0)
+			j = i;
+	}
+	if (j < 0) // the one asked for isn't built in or this CPU can't run it
+	{
+		for (i=0; CompareKernels[i].szName != NULL; i++)
+		{
+			if (CompareKernels[i].bSupported)
+				j = i;
+		}
+		fprintf(stderr, "--simd %s isn't supported here; using %s\n", szSIMD, CompareKernels[j].szName);
+	}
+	pfnTileCompare = CompareKernels[j].pfnCompare;
+#if defined( __x86_64__ )
+	HashKernels[1].bSupported = __builtin_cpu_supports("sse4.2");
+#endif
+#if defined( __aarch64__ )
+	HashKernels[1].bSupported = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+#if defined( __arm__ )
+	HashKernels[1].bSupported = (getauxval(AT_HWCAP2) & HWCAP2_CRC32) != 0;
+#endif
+	// --simd c means no special instructions at all
+	for (i=0; HashKernels[i].szName != NULL; i++)
+	{
+		if (HashKernels[i].bSupported && strcmp(szSIMD, "c") != 0)
+			pfnTileHash = HashKernels[i].pfnHash;
+	}
+} /* InitKernels() */
+
+//
+// Compare the current frame with the previous and mark changed tiles
+// as a set bit in the dirty tile map (one row of 64-bit words per row of tiles)
+//
+static int FindChangedRegion(unsigned char *pSrc, unsigned char *pDst, int iWidth,
+ int iHeight, int iPitch, int iTileWidth, int iTileHeight, uint64_t *pRegions)
+{
+int xc, yc, dx, dy, iOffset;
+int xCount, yCount, iWords;
+int iTotalChanged = 0;
+//
+// Divide the image into tiles; each tile on a row is 1 bit in the changed bit field
+// This makes managing the changes easier for display on a normal monitor and on LCDs with
+// slow connections (e.g. SPI/I2C)
+// The compare kernels have an "early exit" for each tile. In essence, the more the bitmaps are alike
+// the harder this code will work and the less of the screen will need to be repainted
+// In other words, the performance is balanced such that it should maintain a constant output rate
+// no matter what the bitmap conditions are
+//
+   yCount = (iHeight+iTileHeight-1) / iTileHeight; // divide it into NxN tiles
+   xCount = (iWidth+iTileWidth-1) / iTileWidth;
+   iWords = (xCount + 63) >> 6;
+   memset(pRegions, 0, yCount * iWords * sizeof(uint64_t));
+
+  // Loop through all of the tiles
+   for (yc=0; yc<yCount; yc++)
+   {
+      if ((yc+1)*iTileHeight > iHeight)
+         dy = iHeight - (yc*iTileHeight);
+      else
+         dy = iTileHeight;
+      for (xc=0; xc<xCount; xc++)
+      {
+         if ((xc+1)*iTileWidth > iWidth)
+            dx = iWidth - (xc*iTileWidth);
+         else
+            dx = iTileWidth;
+         //point to the current tile
+         iOffset = (yc*iTileHeight*iPitch) + (xc*iTileWidth*2);
+         if ((*pfnTileCompare)(&pSrc[iOffset], &pDst[iOffset], dx*2, dy, iPitch))
+         {
+            pRegions[xc >> 6] |= (1ULL << (xc & 63));
+            iTotalChanged++;
+         }
+      } // for xc
+      pRegions += iWords;
+   } // for yc
+   return iTotalChanged;
+} /* FindChangedRegion() */
+
+//
+// Widen the changed area of a tile to include the pixels
+// of this line segment which differ
+//
+static void ExtendTileRect(TILERECT *pRect, const uint16_t *s, const uint16_t *d, int iCount)
+{
+int i;
+
+	for (i=0; i<pRect->x0; i++)
+	{
+		if (s[i] != d[i])
+		{
+			pRect->x0 = i;
+			break;
+		}
+	}
+	for (i=iCount-1; i>=pRect->x1; i--)
+	{
+		if (s[i] != d[i])
+		{
+			pRect->x1 = i+1;
+			break;
+		}
+	}
+} /* ExtendTileRect() */
+
+//
+// Count the pixels of a line segment which differ (for the statistics)
+//
+static int CountChangedPixels(const uint16_t *s, const uint16_t *d, int iCount)
+{
+int i, iChanged = 0;
+
+	for (i=0; i<iCount; i++)
+		iChanged += (s[i] != d[i]);
+	return iChanged;
+} /* CountChangedPixels() */
+
+//
+// Find the bounding rectangle of the changes inside each dirty tile
+// of one row of tiles (pRow is that row of the dirty map)
+// The first and last changed lines are found with the compare kernel,
+// then only the lines in between are scanned from both ends
+// Returns the number of bytes which changed (only counted for --showfps)
+//
+static int FindBandBounds(unsigned char *pSrc, unsigned char *pDst, uint64_t *pRow, int yc, TILERECT *pRects)
+{
+uint64_t u64Flags;
+TILERECT *pRect;
+unsigned char *s, *d;
+int x, y, w, xc, dx, dy, y0, y1, iChanged = 0;
+
+	y = yc * iTileHeight;
+	dy = (y + iTileHeight > iLCDHeight) ? iLCDHeight - y : iTileHeight;
+	for (w=0; w<iTileWords; w++)
+	{
+		u64Flags = pRow[w];
+		while (u64Flags)
+		{
+			xc = (w << 6) + __builtin_ctzll(u64Flags);
+			u64Flags &= (u64Flags - 1);
+			x = xc * iTileWidth;
+			dx = (x + iTileWidth > iLCDWidth) ? iLCDWidth - x : iTileWidth;
+			s = &pSrc[(y * iLCDPitch) + x*2];
+			d = &pDst[(y * iLCDPitch) + x*2];
+			for (y0=0; y0<dy-1; y0++) // top
+			{
+				if ((*pfnTileCompare)(&s[y0*iLCDPitch], &d[y0*iLCDPitch], dx*2, 1, 0))
+					break;
+			}
+			for (y1=dy; y1>y0+1; y1--) // bottom
+			{
+				if ((*pfnTileCompare)(&s[(y1-1)*iLCDPitch], &d[(y1-1)*iLCDPitch], dx*2, 1, 0))
+					break;
+			}
+			pRect = &pRects[yc * iTilesX + xc];
+			pRect->x0 = dx; pRect->x1 = 0;
+			pRect->y0 = y0; pRect->y1 = y1;
+			for (; y0<y1; y0++)
+			{
+				ExtendTileRect(pRect, (uint16_t *)&s[y0*iLCDPitch], (uint16_t *)&d[y0*iLCDPitch], dx);
+				if (bShowFPS)
+					iChanged += 2 * CountChangedPixels((uint16_t *)&s[y0*iLCDPitch], (uint16_t *)&d[y0*iLCDPitch], dx);
+			}
+		}
+	}
+	return iChanged;
+} /* FindBandBounds() */
+
+//
+// Find the bounding rectangle of the changes inside each dirty tile
+//
+static void FindTileBounds(unsigned char *pSrc, unsigned char *pDst, uint64_t *pRegions, TILERECT *pRects)
+{
+int yc;
+
+	for (yc=0; yc<iTilesY; yc++)
+		llBytesChanged += FindBandBounds(pSrc, pDst, &pRegions[yc * iTileWords], yc, pRects);
+} /* FindTileBounds() */
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+//
+// Line converters
+// Each one produces line y of the LCD image (RGB565) from /dev/fb0
+// The one matching the framebuffer format is selected in InitDisplay()
+//
+typedef void (*LINECONVERT)(unsigned char *pDest, int y);
+static LINECONVERT pfnConvertLine;
+
+static void ConvertLine16(unsigned char *pDest, int y)
+{
+	memcpy(pDest, &pFB[iFBPitch * y], iLCDPitch);
+} /* ConvertLine16() */
+
+static void ConvertLine32(unsigned char *pDest, int y)
+{
+uint32_t u32, *pSrc;
+uint16_t u16, *pus;
+int x;
+
+	pSrc = (uint32_t *)&pFB[iFBPitch * y];
+	pus = (uint16_t *)pDest;
+	for (x=0; x<iLCDWidth; x++)
+	{
+		u32 = *pSrc++;
+		u16 = ((u32 >> 3) & 0x1f) | ((u32 >> 5) & 0x7e0) |
+		((u32 >> 8) & 0xf800);
+		*pus++ = u16;
+	}
+} /* ConvertLine32() */
+
+//
+// 2:1 shrink kernels
+// Each output pixel is the average of a 2x2 block of source pixels, rounded
+// to nearest per color channel: (a+b+c+d+2)/4. 32-bpp sources are averaged
+// with 8-bit precision before being reduced to RGB565.
+//
+typedef void (*SHRINK)(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount);
+static SHRINK pfnShrink16, pfnShrink32;
+
+static void Shrink16C(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+const uint16_t *s0 = (const uint16_t *)pRow0, *s1 = (const uint16_t *)pRow1;
+uint32_t u32;
+int x;
+
+	for (x=0; x<iCount; x++)
+	{
+		// spread G into the upper half so each channel has 2 spare bits to sum into
+		u32 = ((s0[0] | (s0[0] << 16)) & 0x07e0f81f) + ((s0[1] | (s0[1] << 16)) & 0x07e0f81f) +
+		      ((s1[0] | (s1[0] << 16)) & 0x07e0f81f) + ((s1[1] | (s1[1] << 16)) & 0x07e0f81f);
+		u32 = ((u32 + 0x00401002) >> 2) & 0x07e0f81f; // round and divide by 4
+		*pDest++ = (uint16_t)(u32 | (u32 >> 16));
+		s0 += 2; s1 += 2;
+	}
+} /* Shrink16C() */
+
+static void Shrink32C(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+const uint32_t *s0 = (const uint32_t *)pRow0, *s1 = (const uint32_t *)pRow1;
+uint32_t u32RB, u32G;
+int x;
+
+	for (x=0; x<iCount; x++)
+	{
+		// R and B sum in separate 16-bit halves, G on its own
+		u32RB = (s0[0] & 0xff00ff) + (s0[1] & 0xff00ff) + (s1[0] & 0xff00ff) + (s1[1] & 0xff00ff);
+		u32G = (s0[0] & 0xff00) + (s0[1] & 0xff00) + (s1[0] & 0xff00) + (s1[1] & 0xff00);
+		u32RB = ((u32RB + 0x20002) >> 2) & 0xff00ff;
+		u32G = ((u32G + 0x200) >> 2) & 0xff00;
+		*pDest++ = (uint16_t)(((u32RB >> 3) & 0x1f) | ((u32G >> 5) & 0x7e0) | ((u32RB >> 8) & 0xf800));
+		s0 += 2; s1 += 2;
+	}
+} /* Shrink32C() */
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+//
+// Pack 2 vectors of 32-bit values (0-65535) into 16-bit unsigned values
+// SSE2 only has a signed pack, so bias the values into the signed range and back
+//
+__attribute__((target("sse2")))
+static inline __m128i PackUS32SSE2(__m128i xmmLo, __m128i xmmHi)
+{
+__m128i xmmBias = _mm_set1_epi32(0x8000);
+
+	return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(xmmLo, xmmBias), _mm_sub_epi32(xmmHi, xmmBias)), _mm_set1_epi16((short)0x8000));
+} /* PackUS32SSE2() */
+
+__attribute__((target("sse2")))
+static void Shrink16SSE2(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+__m128i xmm0, xmm1, xmmR, xmmG, xmmB, xmmOut[2];
+__m128i xmmOnes = _mm_set1_epi16(1), xmmRound = _mm_set1_epi32(2);
+__m128i xmm3f = _mm_set1_epi16(0x3f), xmm1f = _mm_set1_epi16(0x1f);
+int x, i;
+
+	for (x=0; x+8<=iCount; x+=8) // 16 source pixels -> 8 output pixels
+	{
+		for (i=0; i<2; i++)
+		{
+			xmm0 = _mm_loadu_si128((__m128i *)&pRow0[x*4 + i*16]);
+			xmm1 = _mm_loadu_si128((__m128i *)&pRow1[x*4 + i*16]);
+			// vertical sum of each channel in 16-bit lanes
+			xmmR = _mm_add_epi16(_mm_srli_epi16(xmm0, 11), _mm_srli_epi16(xmm1, 11));
+			xmmG = _mm_add_epi16(_mm_and_si128(_mm_srli_epi16(xmm0, 5), xmm3f), _mm_and_si128(_mm_srli_epi16(xmm1, 5), xmm3f));
+			xmmB = _mm_add_epi16(_mm_and_si128(xmm0, xmm1f), _mm_and_si128(xmm1, xmm1f));
+			// horizontal sum of pixel pairs into 32-bit lanes, then round + divide by 4
+			xmmR = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(xmmR, xmmOnes), xmmRound), 2);
+			xmmG = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(xmmG, xmmOnes), xmmRound), 2);
+			xmmB = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(xmmB, xmmOnes), xmmRound), 2);
+			xmmOut[i] = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(xmmR, 11), _mm_slli_epi32(xmmG, 5)), xmmB);
+		}
+		_mm_storeu_si128((__m128i *)&pDest[x], PackUS32SSE2(xmmOut[0], xmmOut[1]));
+	}
+	if (x < iCount)
+		Shrink16C(&pRow0[x*4], &pRow1[x*4], &pDest[x], iCount - x);
+} /* Shrink16SSE2() */
+
+__attribute__((target("sse2")))
+static void Shrink32SSE2(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+__m128i xmmA, xmmB, xmmEven, xmmOdd, xmmRB, xmmG, xmmOut[2];
+__m128i xmmMaskRB = _mm_set1_epi32(0xff00ff), xmmMaskG = _mm_set1_epi32(0xff00);
+int x, i, j;
+const unsigned char *pRow;
+
+	for (x=0; x+8<=iCount; x+=8) // 16 source pixels -> 8 output pixels
+	{
+		for (j=0; j<2; j++) // 4 output pixels at a time
+		{
+			xmmRB = _mm_set1_epi32(0x20002); // rounding
+			xmmG = _mm_set1_epi32(0x200);
+			for (i=0; i<2; i++)
+			{
+				pRow = (i == 0) ? pRow0 : pRow1;
+				xmmA = _mm_loadu_si128((__m128i *)&pRow[x*8 + j*32]);
+				xmmB = _mm_loadu_si128((__m128i *)&pRow[x*8 + j*32 + 16]);
+				// separate the even and odd pixels
+				xmmEven = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(xmmA), _mm_castsi128_ps(xmmB), _MM_SHUFFLE(2,0,2,0)));
+				xmmOdd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(xmmA), _mm_castsi128_ps(xmmB), _MM_SHUFFLE(3,1,3,1)));
+				// same trick as the C code; R+B sum in separate 16-bit halves, G by itself
+				xmmRB = _mm_add_epi32(xmmRB, _mm_add_epi32(_mm_and_si128(xmmEven, xmmMaskRB), _mm_and_si128(xmmOdd, xmmMaskRB)));
+				xmmG = _mm_add_epi32(xmmG, _mm_add_epi32(_mm_and_si128(xmmEven, xmmMaskG), _mm_and_si128(xmmOdd, xmmMaskG)));
+			}
+			xmmRB = _mm_srli_epi32(xmmRB, 2);
+			xmmG = _mm_srli_epi32(xmmG, 2);
+			xmmOut[j] = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(xmmRB, 3), _mm_set1_epi32(0x1f)),
+				_mm_and_si128(_mm_srli_epi32(xmmG, 5), _mm_set1_epi32(0x7e0))),
+				_mm_and_si128(_mm_srli_epi32(xmmRB, 8), _mm_set1_epi32(0xf800)));
+		}
+		_mm_storeu_si128((__m128i *)&pDest[x], PackUS32SSE2(xmmOut[0], xmmOut[1]));
+	}
+	if (x < iCount)
+		Shrink32C(&pRow0[x*8], &pRow1[x*8], &pDest[x], iCount - x);
+} /* Shrink32SSE2() */
+#endif // x86
+
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+static void Shrink16NEON(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+uint16x8x2_t v0, v1; // even/odd pixels
+uint16x8_t vR, vG, vB, v3f = vdupq_n_u16(0x3f), v1f = vdupq_n_u16(0x1f);
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		v0 = vld2q_u16((const uint16_t *)&pRow0[x*4]);
+		v1 = vld2q_u16((const uint16_t *)&pRow1[x*4]);
+		vR = vaddq_u16(vaddq_u16(vshrq_n_u16(v0.val[0], 11), vshrq_n_u16(v0.val[1], 11)),
+			vaddq_u16(vshrq_n_u16(v1.val[0], 11), vshrq_n_u16(v1.val[1], 11)));
+		vG = vaddq_u16(vaddq_u16(vandq_u16(vshrq_n_u16(v0.val[0], 5), v3f), vandq_u16(vshrq_n_u16(v0.val[1], 5), v3f)),
+			vaddq_u16(vandq_u16(vshrq_n_u16(v1.val[0], 5), v3f), vandq_u16(vshrq_n_u16(v1.val[1], 5), v3f)));
+		vB = vaddq_u16(vaddq_u16(vandq_u16(v0.val[0], v1f), vandq_u16(v0.val[1], v1f)),
+			vaddq_u16(vandq_u16(v1.val[0], v1f), vandq_u16(v1.val[1], v1f)));
+		// rounding shift does the (sum+2)/4
+		vR = vrshrq_n_u16(vR, 2); vG = vrshrq_n_u16(vG, 2); vB = vrshrq_n_u16(vB, 2);
+		vst1q_u16(&pDest[x], vorrq_u16(vorrq_u16(vshlq_n_u16(vR, 11), vshlq_n_u16(vG, 5)), vB));
+	}
+	if (x < iCount)
+		Shrink16C(&pRow0[x*4], &pRow1[x*4], &pDest[x], iCount - x);
+} /* Shrink16NEON() */
+
+static void Shrink32NEON(const unsigned char *pRow0, const unsigned char *pRow1, uint16_t *pDest, int iCount)
+{
+uint8x16x4_t v0, v1; // B,G,R,X planes of 16 pixels
+uint16x8_t vR, vG, vB;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		v0 = vld4q_u8(&pRow0[x*8]);
+		v1 = vld4q_u8(&pRow1[x*8]);
+		// pairwise add of neighbors, then accumulate the second row
+		vB = vpadalq_u8(vpaddlq_u8(v0.val[0]), v1.val[0]);
+		vG = vpadalq_u8(vpaddlq_u8(v0.val[1]), v1.val[1]);
+		vR = vpadalq_u8(vpaddlq_u8(v0.val[2]), v1.val[2]);
+		vB = vrshrq_n_u16(vB, 2); vG = vrshrq_n_u16(vG, 2); vR = vrshrq_n_u16(vR, 2);
+		vst1q_u16(&pDest[x], vorrq_u16(vorrq_u16(vshlq_n_u16(vshrq_n_u16(vR, 3), 11), vshlq_n_u16(vshrq_n_u16(vG, 2), 5)), vshrq_n_u16(vB, 3)));
+	}
+	if (x < iCount)
+		Shrink32C(&pRow0[x*8], &pRow1[x*8], &pDest[x], iCount - x);
+} /* Shrink32NEON() */
+#endif // __ARM_NEON
+
+static void ConvertLine16Shrink(unsigned char *pDest, int y)
+{
+	(*pfnShrink16)(&pFB[y*2*iFBPitch], &pFB[(y*2+1)*iFBPitch], (uint16_t *)pDest, iLCDWidth);
+} /* ConvertLine16Shrink() */
+
+static void ConvertLine32Shrink(unsigned char *pDest, int y)
+{
+	(*pfnShrink32)(&pFB[y*2*iFBPitch], &pFB[(y*2+1)*iFBPitch], (uint16_t *)pDest, iLCDWidth);
+} /* ConvertLine32Shrink() */
+
+//
+// General scaler
+// Any fb0 size is scaled to the LCD (or to the largest rectangle with the
+// same aspect ratio as fb0 when letterboxing). Each LCD line is made in
+// 2 steps:
+// 1) vertical - the source lines which contribute to it are unpacked into
+//    separate R,G,B planes of 16-bit values and summed (box) or blended (bilinear)
+//    These loops run over whole lines and use SIMD where available
+// 2) horizontal - each output pixel is made from the planes with fixed point
+//    coefficients which were calculated once in InitScaler()
+//
+enum {
+	SCALE_AUTO = 0, // 1:1 or 2:1 when possible, otherwise box
+	SCALE_BOX,
+	SCALE_BILINEAR
+};
+static int iScaleFilter, bLetterbox;
+static int iScaleX, iScaleY, iScaleCX, iScaleCY; // destination rectangle inside the LCD
+static int *pScaleX, *pScaleY; // first source column/row of each destination pixel
+static int *pScaleXW, *pScaleYW; // box: number of source pixels, bilinear: 8-bit weight of the next pixel
+static uint32_t *pBoxRecip[2]; // box: 16.16 reciprocal of the area for the 2 possible heights
+static int iBoxMinRows; // box: smallest number of source rows per destination row
+static uint16_t *pPlanes[MAX_WORKERS]; // R,G,B planes for one line of the source (per worker)
+// vertical step kernels
+typedef void (*VACCUM)(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount);
+typedef void (*VBLEND)(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount);
+static VACCUM pfnVAccum;
+static VBLEND pfnVBlend;
+
+static void VAccum16C(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+const uint16_t *pus = (const uint16_t *)pSrc;
+int x;
+
+	for (x=0; x<iCount; x++)
+	{
+		pR[x] += pus[x] >> 11;
+		pG[x] += (pus[x] >> 5) & 0x3f;
+		pB[x] += pus[x] & 0x1f;
+	}
+} /* VAccum16C() */
+
+static void VAccum32C(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+const uint32_t *pul = (const uint32_t *)pSrc;
+int x;
+
+	for (x=0; x<iCount; x++)
+	{
+		pR[x] += (pul[x] >> 16) & 0xff;
+		pG[x] += (pul[x] >> 8) & 0xff;
+		pB[x] += pul[x] & 0xff;
+	}
+} /* VAccum32C() */
+
+static void VBlend16C(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+const uint16_t *s0 = (const uint16_t *)pSrc0, *s1 = (const uint16_t *)pSrc1;
+int x, iInv = 256 - iWeight;
+
+	for (x=0; x<iCount; x++)
+	{
+		pR[x] = ((s0[x] >> 11) * iInv + (s1[x] >> 11) * iWeight) >> 8;
+		pG[x] = (((s0[x] >> 5) & 0x3f) * iInv + ((s1[x] >> 5) & 0x3f) * iWeight) >> 8;
+		pB[x] = ((s0[x] & 0x1f) * iInv + (s1[x] & 0x1f) * iWeight) >> 8;
+	}
+} /* VBlend16C() */
+
+static void VBlend32C(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+const uint32_t *s0 = (const uint32_t *)pSrc0, *s1 = (const uint32_t *)pSrc1;
+int x, iInv = 256 - iWeight;
+
+	for (x=0; x<iCount; x++)
+	{
+		pR[x] = (((s0[x] >> 16) & 0xff) * iInv + ((s1[x] >> 16) & 0xff) * iWeight) >> 8;
+		pG[x] = (((s0[x] >> 8) & 0xff) * iInv + ((s1[x] >> 8) & 0xff) * iWeight) >> 8;
+		pB[x] = ((s0[x] & 0xff) * iInv + (s1[x] & 0xff) * iWeight) >> 8;
+	}
+} /* VBlend32C() */
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+__attribute__((target("sse2")))
+static void VAccum16SSE2(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+__m128i xmmPix, xmm3f = _mm_set1_epi16(0x3f), xmm1f = _mm_set1_epi16(0x1f);
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		xmmPix = _mm_loadu_si128((__m128i *)&pSrc[x*2]);
+		_mm_storeu_si128((__m128i *)&pR[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pR[x]), _mm_srli_epi16(xmmPix, 11)));
+		_mm_storeu_si128((__m128i *)&pG[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pG[x]), _mm_and_si128(_mm_srli_epi16(xmmPix, 5), xmm3f)));
+		_mm_storeu_si128((__m128i *)&pB[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pB[x]), _mm_and_si128(xmmPix, xmm1f)));
+	}
+	if (x < iCount) // odd pixels at the end
+		VAccum16C(&pSrc[x*2], &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VAccum16SSE2() */
+
+//
+// Unpack 8 XRGB8888 pixels into 3 vectors of 16-bit R, G and B values
+//
+__attribute__((target("sse2")))
+static inline void Unpack32SSE2(const unsigned char *pSrc, __m128i *pR, __m128i *pG, __m128i *pB)
+{
+__m128i xmmLo, xmmHi, xmmMask = _mm_set1_epi32(0xff);
+
+	xmmLo = _mm_loadu_si128((__m128i *)pSrc);
+	xmmHi = _mm_loadu_si128((__m128i *)&pSrc[16]);
+	// each value is < 256, so the signed pack is safe
+	*pB = _mm_packs_epi32(_mm_and_si128(xmmLo, xmmMask), _mm_and_si128(xmmHi, xmmMask));
+	*pG = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(xmmLo, 8), xmmMask), _mm_and_si128(_mm_srli_epi32(xmmHi, 8), xmmMask));
+	*pR = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(xmmLo, 16), xmmMask), _mm_and_si128(_mm_srli_epi32(xmmHi, 16), xmmMask));
+} /* Unpack32SSE2() */
+
+__attribute__((target("sse2")))
+static void VAccum32SSE2(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+__m128i xmmR, xmmG, xmmB;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		Unpack32SSE2(&pSrc[x*4], &xmmR, &xmmG, &xmmB);
+		_mm_storeu_si128((__m128i *)&pR[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pR[x]), xmmR));
+		_mm_storeu_si128((__m128i *)&pG[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pG[x]), xmmG));
+		_mm_storeu_si128((__m128i *)&pB[x], _mm_add_epi16(_mm_loadu_si128((__m128i *)&pB[x]), xmmB));
+	}
+	if (x < iCount)
+		VAccum32C(&pSrc[x*4], &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VAccum32SSE2() */
+
+__attribute__((target("sse2")))
+static void VBlend16SSE2(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+__m128i xmm0, xmm1, xmmW, xmmInv, xmm3f = _mm_set1_epi16(0x3f), xmm1f = _mm_set1_epi16(0x1f);
+int x;
+
+	xmmW = _mm_set1_epi16(iWeight);
+	xmmInv = _mm_set1_epi16(256 - iWeight);
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		xmm0 = _mm_loadu_si128((__m128i *)&pSrc0[x*2]);
+		xmm1 = _mm_loadu_si128((__m128i *)&pSrc1[x*2]);
+		// a*(256-w) + b*w fits in 16 bits unsigned for 8-bit (or smaller) values
+		_mm_storeu_si128((__m128i *)&pR[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(xmm0, 11), xmmInv), _mm_mullo_epi16(_mm_srli_epi16(xmm1, 11), xmmW)), 8));
+		_mm_storeu_si128((__m128i *)&pG[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(xmm0, 5), xmm3f), xmmInv), _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(xmm1, 5), xmm3f), xmmW)), 8));
+		_mm_storeu_si128((__m128i *)&pB[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(xmm0, xmm1f), xmmInv), _mm_mullo_epi16(_mm_and_si128(xmm1, xmm1f), xmmW)), 8));
+	}
+	if (x < iCount)
+		VBlend16C(&pSrc0[x*2], &pSrc1[x*2], iWeight, &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VBlend16SSE2() */
+
+__attribute__((target("sse2")))
+static void VBlend32SSE2(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+__m128i xmmR0, xmmG0, xmmB0, xmmR1, xmmG1, xmmB1, xmmW, xmmInv;
+int x;
+
+	xmmW = _mm_set1_epi16(iWeight);
+	xmmInv = _mm_set1_epi16(256 - iWeight);
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		Unpack32SSE2(&pSrc0[x*4], &xmmR0, &xmmG0, &xmmB0);
+		Unpack32SSE2(&pSrc1[x*4], &xmmR1, &xmmG1, &xmmB1);
+		_mm_storeu_si128((__m128i *)&pR[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(xmmR0, xmmInv), _mm_mullo_epi16(xmmR1, xmmW)), 8));
+		_mm_storeu_si128((__m128i *)&pG[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(xmmG0, xmmInv), _mm_mullo_epi16(xmmG1, xmmW)), 8));
+		_mm_storeu_si128((__m128i *)&pB[x], _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(xmmB0, xmmInv), _mm_mullo_epi16(xmmB1, xmmW)), 8));
+	}
+	if (x < iCount)
+		VBlend32C(&pSrc0[x*4], &pSrc1[x*4], iWeight, &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VBlend32SSE2() */
+#endif // x86
+
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+static void VAccum16NEON(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+uint16x8_t vPix;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		vPix = vld1q_u16((const uint16_t *)&pSrc[x*2]);
+		vst1q_u16(&pR[x], vaddq_u16(vld1q_u16(&pR[x]), vshrq_n_u16(vPix, 11)));
+		vst1q_u16(&pG[x], vaddq_u16(vld1q_u16(&pG[x]), vandq_u16(vshrq_n_u16(vPix, 5), vdupq_n_u16(0x3f))));
+		vst1q_u16(&pB[x], vaddq_u16(vld1q_u16(&pB[x]), vandq_u16(vPix, vdupq_n_u16(0x1f))));
+	}
+	if (x < iCount)
+		VAccum16C(&pSrc[x*2], &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VAccum16NEON() */
+
+static void VAccum32NEON(const unsigned char *pSrc, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+uint8x8x4_t vPix;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		vPix = vld4_u8(&pSrc[x*4]); // de-interleave B,G,R,X
+		vst1q_u16(&pR[x], vaddw_u8(vld1q_u16(&pR[x]), vPix.val[2]));
+		vst1q_u16(&pG[x], vaddw_u8(vld1q_u16(&pG[x]), vPix.val[1]));
+		vst1q_u16(&pB[x], vaddw_u8(vld1q_u16(&pB[x]), vPix.val[0]));
+	}
+	if (x < iCount)
+		VAccum32C(&pSrc[x*4], &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VAccum32NEON() */
+
+static void VBlend16NEON(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+uint16x8_t v0, v1;
+uint16_t usInv = 256 - iWeight, usW = iWeight;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		v0 = vld1q_u16((const uint16_t *)&pSrc0[x*2]);
+		v1 = vld1q_u16((const uint16_t *)&pSrc1[x*2]);
+		vst1q_u16(&pR[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vshrq_n_u16(v0, 11), usInv), vshrq_n_u16(v1, 11), usW), 8));
+		vst1q_u16(&pG[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vandq_u16(vshrq_n_u16(v0, 5), vdupq_n_u16(0x3f)), usInv), vandq_u16(vshrq_n_u16(v1, 5), vdupq_n_u16(0x3f)), usW), 8));
+		vst1q_u16(&pB[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vandq_u16(v0, vdupq_n_u16(0x1f)), usInv), vandq_u16(v1, vdupq_n_u16(0x1f)), usW), 8));
+	}
+	if (x < iCount)
+		VBlend16C(&pSrc0[x*2], &pSrc1[x*2], iWeight, &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VBlend16NEON() */
+
+static void VBlend32NEON(const unsigned char *pSrc0, const unsigned char *pSrc1, int iWeight, uint16_t *pR, uint16_t *pG, uint16_t *pB, int iCount)
+{
+uint8x8x4_t v0, v1;
+uint16_t usInv = 256 - iWeight, usW = iWeight;
+int x;
+
+	for (x=0; x+8<=iCount; x+=8)
+	{
+		v0 = vld4_u8(&pSrc0[x*4]);
+		v1 = vld4_u8(&pSrc1[x*4]);
+		vst1q_u16(&pR[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vmovl_u8(v0.val[2]), usInv), vmovl_u8(v1.val[2]), usW), 8));
+		vst1q_u16(&pG[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vmovl_u8(v0.val[1]), usInv), vmovl_u8(v1.val[1]), usW), 8));
+		vst1q_u16(&pB[x], vshrq_n_u16(vmlaq_n_u16(vmulq_n_u16(vmovl_u8(v0.val[0]), usInv), vmovl_u8(v1.val[0]), usW), 8));
+	}
+	if (x < iCount)
+		VBlend32C(&pSrc0[x*4], &pSrc1[x*4], iWeight, &pR[x], &pG[x], &pB[x], iCount - x);
+} /* VBlend32NEON() */
+#endif // __ARM_NEON
+
+//
+// Returns true if the named SIMD kernel set can run on this CPU and
+// hasn't been ruled out by --simd
+//
+static int KernelSupported(const char *szName)
+{
+int i;
+
+	if (szSIMD[0] && strcmp(szSIMD, szName) != 0 && strcmp(szSIMD, "avx2") != 0)
+		return 0; // the user wants something else (AVX2 implies SSE2)
+	for (i=0; CompareKernels[i].szName != NULL; i++)
+	{
+		if (strcmp(CompareKernels[i].szName, szName) == 0)
+			return CompareKernels[i].bSupported;
+	}
+	return 0;
+} /* KernelSupported() */
+
+//
+// Make an LCD line with the general scaler
+//
+static void ConvertLineScaled(unsigned char *pDest, int y)
+{
+uint16_t *pR, *pG, *pB, *pus;
+uint32_t u32R, u32G, u32B, *pRecip;
+int x, i, sy, sx, iCount, iWeight, iInv, iSrcCX, iBpp;
+
+	if (y < iScaleY || y >= iScaleY + iScaleCY) // letterbox bar
+	{
+		memset(pDest, 0, iLCDPitch);
+		return;
+	}
+	y -= iScaleY;
+	iSrcCX = vinfo.xres;
+	iBpp = vinfo.bits_per_pixel / 8;
+	pR = pPlanes[iWorkerIndex]; pG = &pR[iSrcCX]; pB = &pR[iSrcCX*2];
+	sy = pScaleY[y];
+	// vertical step
+	if (iScaleFilter == SCALE_BILINEAR)
+	{
+		(*pfnVBlend)(&pFB[sy * iFBPitch], &pFB[(sy+1) * iFBPitch], pScaleYW[y], pR, pG, pB, iSrcCX);
+	}
+	else
+	{
+		memset(pR, 0, iSrcCX * 3 * sizeof(uint16_t));
+		for (i=0; i<pScaleYW[y]; i++)
+			(*pfnVAccum)(&pFB[(sy+i) * iFBPitch], pR, pG, pB, iSrcCX);
+	}
+	// horizontal step
+	pus = (uint16_t *)pDest;
+	if (iLCDWidth - iScaleX - iScaleCX > 0) // right letterbox bar
+		memset(&pus[iScaleX + iScaleCX], 0, (iLCDWidth - iScaleX - iScaleCX) * 2);
+	if (iScaleX > 0) // left letterbox bar
+	{
+		memset(pus, 0, iScaleX * 2);
+		pus += iScaleX;
+	}
+	if (iScaleFilter == SCALE_BILINEAR)
+	{
+		for (x=0; x<iScaleCX; x++)
+		{
+			sx = pScaleX[x];
+			iWeight = pScaleXW[x];
+			iInv = 256 - iWeight;
+			u32R = (pR[sx] * iInv + pR[sx+1] * iWeight) >> 8;
+			u32G = (pG[sx] * iInv + pG[sx+1] * iWeight) >> 8;
+			u32B = (pB[sx] * iInv + pB[sx+1] * iWeight) >> 8;
+			if (iBpp == 4) // 8-bit channels
+				pus[x] = ((u32R >> 3) << 11) | ((u32G >> 2) << 5) | (u32B >> 3);
+			else
+				pus[x] = (u32R << 11) | (u32G << 5) | u32B;
+		}
+	}
+	else
+	{
+		pRecip = pBoxRecip[pScaleYW[y] - iBoxMinRows];
+		for (x=0; x<iScaleCX; x++)
+		{
+			sx = pScaleX[x];
+			u32R = u32G = u32B = 0;
+			for (iCount = pScaleXW[x]; iCount > 0; iCount--, sx++)
+			{
+				u32R += pR[sx];
+				u32G += pG[sx];
+				u32B += pB[sx];
+			}
+			// multiply by 1/area to get the average
+			u32R = (u32R * pRecip[x]) >> 16;
+			u32G = (u32G * pRecip[x]) >> 16;
+			u32B = (u32B * pRecip[x]) >> 16;
+			if (iBpp == 4)
+				pus[x] = ((u32R >> 3) << 11) | ((u32G >> 2) << 5) | (u32B >> 3);
+			else
+				pus[x] = (u32R << 11) | (u32G << 5) | u32B;
+		}
+	}
+} /* ConvertLineScaled() */
+
+//
+// Calculate the coefficient tables for scaling fb0 to the LCD
+// Return 0 for success, 1 for failure
+//
+static int InitScaler(void)
+{
+int i, j, iSrcCX, iSrcCY, iStart, iEnd, iPos;
+
+	iSrcCX = vinfo.xres;
+	iSrcCY = vinfo.yres;
+	if (iScaleFilter == SCALE_AUTO)
+		iScaleFilter = SCALE_BOX;
+	// destination rectangle
+	iScaleX = iScaleY = 0;
+	iScaleCX = iLCDWidth;
+	iScaleCY = iLCDHeight;
+	if (bLetterbox)
+	{
+		if (iSrcCX * iLCDHeight > iSrcCY * iLCDWidth) // source is wider; bars on top + bottom
+			iScaleCY = (iSrcCY * iLCDWidth) / iSrcCX;
+		else
+			iScaleCX = (iSrcCX * iLCDHeight) / iSrcCY;
+		iScaleX = (iLCDWidth - iScaleCX) / 2;
+		iScaleY = (iLCDHeight - iScaleCY) / 2;
+	}
+	free(pScaleX); free(pScaleY); free(pScaleXW); free(pScaleYW);
+	free(pBoxRecip[0]); free(pBoxRecip[1]);
+	pScaleX = malloc(iScaleCX * sizeof(int));
+	pScaleXW = malloc(iScaleCX * sizeof(int));
+	pScaleY = malloc(iScaleCY * sizeof(int));
+	pScaleYW = malloc(iScaleCY * sizeof(int));
+	pBoxRecip[0] = malloc(iScaleCX * sizeof(uint32_t));
+	pBoxRecip[1] = malloc(iScaleCX * sizeof(uint32_t));
+	for (i=0; i<MAX_WORKERS; i++)
+	{
+		free(pPlanes[i]);
+		pPlanes[i] = malloc((iSrcCX + 8) * 3 * sizeof(uint16_t));
+		if (!pPlanes[i])
+			return 1;
+	}
+	if (!pScaleX || !pScaleXW || !pScaleY || !pScaleYW || !pBoxRecip[0] || !pBoxRecip[1])
+		return 1;
+	if (iScaleFilter == SCALE_BILINEAR)
+	{
+		// sample at the pixel centers; positions are 8.8 fixed point
+		for (i=0; i<iScaleCX; i++)
+		{
+			iPos = (((2*i + 1) * iSrcCX * 128) / iScaleCX) - 128;
+			if (iPos < 0) iPos = 0;
+			if (iPos >= (iSrcCX - 1) * 256) iPos = (iSrcCX - 1) * 256 - 1;
+			pScaleX[i] = iPos >> 8;
+			pScaleXW[i] = iPos & 0xff;
+		}
+		for (i=0; i<iScaleCY; i++)
+		{
+			iPos = (((2*i + 1) * iSrcCY * 128) / iScaleCY) - 128;
+			if (iPos < 0) iPos = 0;
+			if (iPos >= (iSrcCY - 1) * 256) iPos = (iSrcCY - 1) * 256 - 1;
+			pScaleY[i] = iPos >> 8;
+			pScaleYW[i] = iPos & 0xff;
+		}
+	}
+	else // box; each destination pixel averages the source pixels it covers
+	{
+		for (i=0; i<iScaleCX; i++)
+		{
+			iStart = (i * iSrcCX) / iScaleCX;
+			iEnd = ((i+1) * iSrcCX) / iScaleCX;
+			pScaleX[i] = iStart;
+			pScaleXW[i] = (iEnd > iStart) ? iEnd - iStart : 1;
+		}
+		iBoxMinRows = iSrcCY;
+		for (i=0; i<iScaleCY; i++)
+		{
+			iStart = (i * iSrcCY) / iScaleCY;
+			iEnd = ((i+1) * iSrcCY) / iScaleCY;
+			pScaleY[i] = iStart;
+			pScaleYW[i] = (iEnd > iStart) ? iEnd - iStart : 1;
+			if (pScaleYW[i] < iBoxMinRows) iBoxMinRows = pScaleYW[i];
+		}
+		// the row count is either the minimum or 1 more
+		for (j=0; j<2; j++)
+			for (i=0; i<iScaleCX; i++)
+				pBoxRecip[j][i] = (65536 + pScaleXW[i] * (iBoxMinRows + j) - 1) / (pScaleXW[i] * (iBoxMinRows + j)); // round up so 255 stays 255
+		if (((iSrcCY / iScaleCY) + 1) * 255 > 65535) // 16-bit plane sums would overflow
+			return 1;
+	}
+	pfnVAccum = (vinfo.bits_per_pixel == 16) ? VAccum16C : VAccum32C;
+	pfnVBlend = (vinfo.bits_per_pixel == 16) ? VBlend16C : VBlend32C;
+#if defined( __x86_64__ ) || defined( __i386__ )
+	if (KernelSupported("sse2"))
+	{
+		pfnVAccum = (vinfo.bits_per_pixel == 16) ? VAccum16SSE2 : VAccum32SSE2;
+		pfnVBlend = (vinfo.bits_per_pixel == 16) ? VBlend16SSE2 : VBlend32SSE2;
+	}
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	if (KernelSupported("neon"))
+	{
+		pfnVAccum = (vinfo.bits_per_pixel == 16) ? VAccum16NEON : VAccum32NEON;
+		pfnVBlend = (vinfo.bits_per_pixel == 16) ? VBlend16NEON : VBlend32NEON;
+	}
+#endif
+	return 0;
+} /* InitScaler() */
+
+//
+// Pick the line converter for the current framebuffer format
+//
+static void SelectConverter(void)
+{
+	pfnShrink16 = Shrink16C;
+	pfnShrink32 = Shrink32C;
+#if defined( __x86_64__ ) || defined( __i386__ )
+	if (KernelSupported("sse2"))
+	{
+		pfnShrink16 = Shrink16SSE2;
+		pfnShrink32 = Shrink32SSE2;
+	}
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	if (KernelSupported("neon"))
+	{
+		pfnShrink16 = Shrink16NEON;
+		pfnShrink32 = Shrink32NEON;
+	}
+#endif
+	if (iScaleFilter == SCALE_AUTO && !bLetterbox && vinfo.xres == iLCDWidth * 2 && vinfo.yres == iLCDHeight * 2) // need to shrink by 1/4
+		pfnConvertLine = (vinfo.bits_per_pixel == 16) ? ConvertLine16Shrink : ConvertLine32Shrink;
+	else if (iScaleFilter == SCALE_AUTO && vinfo.xres == iLCDWidth && (vinfo.yres == iLCDHeight || (!bLetterbox && vinfo.yres > iLCDHeight))) // 1:1
+		pfnConvertLine = (vinfo.bits_per_pixel == 16) ? ConvertLine16 : ConvertLine32;
+	else if (InitScaler() == 0) // anything else goes through the general scaler
+		pfnConvertLine = ConvertLineScaled;
+	else
+	{
+		fprintf(stderr, "Unable to scale the %dx%d framebuffer; copying it 1:1\n", vinfo.xres, vinfo.yres);
+		pfnConvertLine = (vinfo.bits_per_pixel == 16) ? ConvertLine16 : ConvertLine32;
+	}
+} /* SelectConverter() */
+#endif // !_RPIZERO_
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ ) && defined( HAVE_DRM )
+//
+// KMS capture (make DRM=1, --drm)
+// On newer kernels fb0 is only an emulation which doesn't show what a KMS
+// client (a compositor, kmscube, an emulator drawing through DRM) puts on
+// the screen, or it isn't there at all. Instead we find the primary plane
+// of an active CRTC and map the framebuffer it scans out, as a dumb buffer
+// or else as a dma-buf. The line converters read it through pFB the same
+// way they read fb0. Producers flip between several framebuffers, so the
+// plane's FB_ID is read before each capture and the last few framebuffers
+// stay mapped.
+// When the producer tells the kernel which areas it changed (FB_DAMAGE_CLIPS
+// on its atomic commits, or DIRTYFB), only the rows of tiles inside them
+// are converted and compared; if the plane is in the same state as at the
+// last capture there was no commit and nothing is read at all. The clips
+// only describe the latest commit, so one which came and went between two
+// captures would be missed; the whole frame is compared every
+// DRM_FULL_FRAMES captures to catch up with it.
+// Reading another client's framebuffer needs root (CAP_SYS_ADMIN).
+//
+#define MAX_DRMFB 4 // framebuffers kept mapped
+#define DRM_FULL_FRAMES 30
+enum {
+	DRMPROP_FB_ID = 0,
+	DRMPROP_SRC_X, // 16.16 fixed point viewport inside the framebuffer
+	DRMPROP_SRC_Y,
+	DRMPROP_SRC_W,
+	DRMPROP_SRC_H,
+	DRMPROP_DAMAGE, // blob of drm_mode_rect, 0 = not given
+	DRMPROP_COUNT
+};
+static const char *szDRMProps[DRMPROP_COUNT] = {"FB_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "FB_DAMAGE_CLIPS"};
+typedef struct tag_DRMFB
+{
+	uint32_t u32Id; // KMS framebuffer object, 0 = unused entry
+	int fdBuf; // dma-buf it's mapped through, -1 = mapped through the card
+	unsigned char *pMap, *pPixels; // the mapping, the first pixel
+	int iMapSize, iPitch, iBpp, iWidth, iHeight;
+} DRMFB;
+static char szDRMCard[64] = "auto"; // --drm
+static int fdDRM = -1;
+static uint32_t u32DRMPlane, u32DRMProps[DRMPROP_COUNT]; // plane and property ids
+static uint64_t u64DRMState[DRMPROP_COUNT]; // property values at the last capture
+static DRMFB drmFB[MAX_DRMFB];
+static int iDRMNext, iDRMFrames;
+
+static void DRMUnmapFB(DRMFB *pBuf)
+{
+	if (pBuf->u32Id)
+	{
+		munmap(pBuf->pMap, pBuf->iMapSize);
+		if (pBuf->fdBuf >= 0)
+			close(pBuf->fdBuf);
+		pBuf->u32Id = 0;
+	}
+} /* DRMUnmapFB() */
+
+//
+// Find or create the mapping of a KMS framebuffer
+// Returns NULL if it can't be read (format, tiling, permissions)
+//
+static DRMFB *DRMMapFB(uint32_t u32FB)
+{
+drmModeFB2 *pFB2;
+struct drm_mode_map_dumb mreq;
+struct drm_gem_close gclose;
+DRMFB *pBuf;
+void *p = MAP_FAILED;
+int i, j, iBpp, iSize, fdBuf = -1;
+static uint32_t u32Failed; // don't repeat the same complaint every frame
+
+	for (i=0; i<MAX_DRMFB; i++)
+	{
+		if (drmFB[i].u32Id == u32FB)
+			return &drmFB[i];
+	}
+	pFB2 = drmModeGetFB2(fdDRM, u32FB);
+	if (pFB2 == NULL)
+		return NULL;
+	switch (pFB2->pixel_format)
+	{
+		case DRM_FORMAT_RGB565:
+			iBpp = 16;
+			break;
+		case DRM_FORMAT_XRGB8888: // the same layout as a 32-bpp fb0
+		case DRM_FORMAT_ARGB8888:
+			iBpp = 32;
+			break;
+		default:
+			iBpp = 0;
+			break;
+	}
+	if ((pFB2->flags & DRM_MODE_FB_MODIFIERS) && pFB2->modifier != DRM_FORMAT_MOD_LINEAR)
+		iBpp = 0; // tiled or compressed
+	iSize = pFB2->offsets[0] + pFB2->pitches[0] * pFB2->height;
+	if (iBpp && pFB2->handles[0]) // the handle is only given to root
+	{
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.handle = pFB2->handles[0];
+		if (drmIoctl(fdDRM, DRM_IOCTL_MODE_MAP_DUMB, &mreq) == 0)
+			p = mmap(NULL, iSize, PROT_READ, MAP_SHARED, fdDRM, mreq.offset);
+		if (p == MAP_FAILED && drmPrimeHandleToFD(fdDRM, pFB2->handles[0], DRM_CLOEXEC, &fdBuf) == 0)
+		{
+			p = mmap(NULL, iSize, PROT_READ, MAP_SHARED, fdBuf, 0);
+			if (p == MAP_FAILED)
+			{
+				close(fdBuf);
+				fdBuf = -1;
+			}
+		}
+	}
+	for (i=0; i<4; i++) // the mapping keeps the buffer; let go of the handles
+	{
+		for (j=0; j<i && pFB2->handles[j] != pFB2->handles[i]; j++) {};
+		if (pFB2->handles[i] && j == i)
+		{
+			memset(&gclose, 0, sizeof(gclose));
+			gclose.handle = pFB2->handles[i];
+			drmIoctl(fdDRM, DRM_IOCTL_GEM_CLOSE, &gclose);
+		}
+	}
+	if (p == MAP_FAILED)
+	{
+		if (u32Failed != u32FB)
+			fprintf(stderr, "Unable to map KMS framebuffer %u (%s)\n", u32FB,
+				iBpp == 0 ? "unsupported format or tiling" : (pFB2->handles[0] ? "mmap failed" : "needs root"));
+		u32Failed = u32FB;
+		drmModeFreeFB2(pFB2);
+		return NULL;
+	}
+	pBuf = &drmFB[iDRMNext]; // replaces the oldest one
+	iDRMNext = (iDRMNext + 1) % MAX_DRMFB;
+	DRMUnmapFB(pBuf);
+	pBuf->u32Id = u32FB;
+	pBuf->fdBuf = fdBuf;
+	pBuf->pMap = (unsigned char *)p;
+	pBuf->pPixels = pBuf->pMap + pFB2->offsets[0];
+	pBuf->iMapSize = iSize;
+	pBuf->iPitch = pFB2->pitches[0];
+	pBuf->iBpp = iBpp;
+	pBuf->iWidth = pFB2->width;
+	pBuf->iHeight = pFB2->height;
+	drmModeFreeFB2(pFB2);
+	return pBuf;
+} /* DRMMapFB() */
+
+//
+// Mark the rows of tiles covered by the damage clips of the latest commit
+// Returns 1 if pDamageRows was filled in, 0 if the whole frame has to be compared
+//
+static int DRMDamage(uint32_t u32Blob, int iSrcX, int iSrcY)
+{
+drmModePropertyBlobRes *pBlob;
+struct drm_mode_rect *pClip;
+int i, y0, y1, iClips;
+
+	pBlob = drmModeGetPropertyBlob(fdDRM, u32Blob);
+	if (pBlob == NULL)
+		return 0;
+	memset(pDamageRows, 0, iTilesY);
+	pClip = (struct drm_mode_rect *)pBlob->data;
+	iClips = pBlob->length / sizeof(struct drm_mode_rect);
+	for (i=0; i<iClips; i++)
+	{
+		// framebuffer coordinates to lines of the source image
+		if (pClip[i].x2 <= iSrcX || pClip[i].x1 >= iSrcX + (int)vinfo.xres)
+			continue;
+		y0 = pClip[i].y1 - iSrcY;
+		y1 = pClip[i].y2 - iSrcY;
+		if (y0 < 0) y0 = 0;
+		if (y1 > (int)vinfo.yres) y1 = vinfo.yres;
+		if (y0 >= y1)
+			continue;
+		// to lines of the LCD
+		if (pfnConvertLine == ConvertLineScaled) // the filters also reach 1 line past each end
+		{
+			y0 = iScaleY + (y0 * iScaleCY) / (int)vinfo.yres - 1;
+			y1 = iScaleY + (y1 * iScaleCY + vinfo.yres - 1) / vinfo.yres + 1;
+		}
+		else if (pfnConvertLine == ConvertLine16Shrink || pfnConvertLine == ConvertLine32Shrink)
+		{
+			y0 >>= 1;
+			y1 = (y1 + 1) >> 1;
+		}
+		if (y0 < 0) y0 = 0;
+		if (y1 > iLCDHeight) y1 = iLCDHeight;
+		if (y0 < y1)
+			memset(&pDamageRows[y0 / iTileHeight], 1, (y1 - 1) / iTileHeight - y0 / iTileHeight + 1);
+	}
+	drmModeFreePropertyBlob(pBlob);
+	return 1;
+} /* DRMDamage() */
+
+//
+// Point pFB at the framebuffer the plane shows now and find what changed
+// since the last capture
+// Returns 1 if only the rows marked in pDamageRows need to be captured,
+// 0 to capture all of them
+//
+static int DRMCapture(void)
+{
+drmModeObjectProperties *pProps;
+uint64_t u64State[DRMPROP_COUNT];
+DRMFB *pBuf;
+int i, j, iSrcX, iSrcY, iSrcW, iSrcH, bMoved;
+
+	memset(u64State, 0, sizeof(u64State));
+	pProps = drmModeObjectGetProperties(fdDRM, u32DRMPlane, DRM_MODE_OBJECT_PLANE);
+	if (pProps == NULL)
+		return 0;
+	for (i=0; i<(int)pProps->count_props; i++)
+	{
+		for (j=0; j<DRMPROP_COUNT; j++)
+		{
+			if (u32DRMProps[j] && pProps->props[i] == u32DRMProps[j])
+				u64State[j] = pProps->prop_values[i];
+		}
+	}
+	drmModeFreeObjectProperties(pProps);
+	pBuf = u64State[DRMPROP_FB_ID] ? DRMMapFB((uint32_t)u64State[DRMPROP_FB_ID]) : NULL;
+	if (pBuf == NULL) // turned off or unreadable; keep the last image
+	{
+		if (pDamageRows == NULL || pFB == NULL)
+			return 0;
+		memset(pDamageRows, 0, iTilesY);
+		return 1;
+	}
+	iSrcX = (int)(u64State[DRMPROP_SRC_X] >> 16);
+	iSrcY = (int)(u64State[DRMPROP_SRC_Y] >> 16);
+	iSrcW = (int)(u64State[DRMPROP_SRC_W] >> 16);
+	iSrcH = (int)(u64State[DRMPROP_SRC_H] >> 16);
+	if (iSrcW <= 0 || iSrcH <= 0 || iSrcX + iSrcW > pBuf->iWidth || iSrcY + iSrcH > pBuf->iHeight)
+	{
+		iSrcX = iSrcY = 0; // shouldn't happen; show the whole framebuffer
+		iSrcW = pBuf->iWidth;
+		iSrcH = pBuf->iHeight;
+	}
+	pFB = pBuf->pPixels + iSrcY * pBuf->iPitch + iSrcX * (pBuf->iBpp / 8);
+	iFBPitch = pBuf->iPitch;
+	iScreenSize = pBuf->iMapSize;
+	if ((int)vinfo.xres != iSrcW || (int)vinfo.yres != iSrcH || (int)vinfo.bits_per_pixel != pBuf->iBpp)
+	{
+		memset(&vinfo, 0, sizeof(vinfo));
+		vinfo.xres = vinfo.xres_virtual = iSrcW;
+		vinfo.yres = vinfo.yres_virtual = iSrcH;
+		vinfo.bits_per_pixel = pBuf->iBpp;
+		SelectConverter();
+		bDRMFull = 1;
+		if (!bBackground)
+			printf("KMS framebuffer: %dx%d, %d bpp\n", iSrcW, iSrcH, pBuf->iBpp);
+	}
+	bMoved = memcmp(&u64State[DRMPROP_SRC_X], &u64DRMState[DRMPROP_SRC_X], 4 * sizeof(uint64_t));
+	if (bDRMFull || pDamageRows == NULL || ++iDRMFrames >= DRM_FULL_FRAMES)
+	{
+		for (i=0; i<MAX_DRMFB; i++) // their ids may have been reused by now
+		{
+			if (&drmFB[i] != pBuf)
+				DRMUnmapFB(&drmFB[i]);
+		}
+		memcpy(u64DRMState, u64State, sizeof(u64State));
+		bDRMFull = 0;
+		iDRMFrames = 0;
+		return 0;
+	}
+	if (u64State[DRMPROP_DAMAGE] == 0 || bMoved) // the producer didn't say, or the viewport moved
+	{
+		memcpy(u64DRMState, u64State, sizeof(u64State));
+		return 0;
+	}
+	if (memcmp(u64State, u64DRMState, sizeof(u64State)) == 0) // no commit since the last capture
+	{
+		memset(pDamageRows, 0, iTilesY);
+		return 1;
+	}
+	memcpy(u64DRMState, u64State, sizeof(u64State));
+	return DRMDamage((uint32_t)u64State[DRMPROP_DAMAGE], iSrcX, iSrcY);
+} /* DRMCapture() */
+
+//
+// Find the primary plane of an active CRTC on fdDRM and its property ids
+// Returns the plane id or 0 if nothing is being shown
+//
+static uint32_t DRMFindPlane(void)
+{
+drmModePlaneRes *pRes;
+drmModePlane *pPlane;
+drmModeObjectProperties *pProps;
+drmModePropertyRes *pProp;
+uint32_t u32Plane = 0;
+int i, j, k, bPrimary;
+
+	pRes = drmModeGetPlaneResources(fdDRM);
+	if (pRes == NULL)
+		return 0;
+	for (i=0; i<(int)pRes->count_planes && u32Plane == 0; i++)
+	{
+		pPlane = drmModeGetPlane(fdDRM, pRes->planes[i]);
+		if (pPlane == NULL)
+			continue;
+		if (pPlane->fb_id && pPlane->crtc_id)
+		{
+			bPrimary = 0;
+			memset(u32DRMProps, 0, sizeof(u32DRMProps));
+			pProps = drmModeObjectGetProperties(fdDRM, pPlane->plane_id, DRM_MODE_OBJECT_PLANE);
+			for (j=0; pProps && j<(int)pProps->count_props; j++)
+			{
+				pProp = drmModeGetProperty(fdDRM, pProps->props[j]);
+				if (pProp == NULL)
+					continue;
+				if (strcmp(pProp->name, "type") == 0 && pProps->prop_values[j] == DRM_PLANE_TYPE_PRIMARY)
+					bPrimary = 1;
+				for (k=0; k<DRMPROP_COUNT; k++)
+				{
+					if (strcmp(pProp->name, szDRMProps[k]) == 0)
+						u32DRMProps[k] = pProp->prop_id;
+				}
+				drmModeFreeProperty(pProp);
+			}
+			drmModeFreeObjectProperties(pProps);
+			if (bPrimary && u32DRMProps[DRMPROP_FB_ID]) // FB_ID is only there for atomic drivers
+				u32Plane = pPlane->plane_id;
+		}
+		drmModeFreePlane(pPlane);
+	}
+	drmModeFreePlaneResources(pRes);
+	return u32Plane;
+} /* DRMFindPlane() */
+
+static void CloseDRM(void)
+{
+int i;
+
+	for (i=0; i<MAX_DRMFB; i++)
+		DRMUnmapFB(&drmFB[i]);
+	if (fdDRM >= 0)
+		close(fdDRM);
+	fdDRM = -1;
+} /* CloseDRM() */
+
+//
+// Open the KMS device (--drm, or the first card which shows something)
+// and map the framebuffer on screen
+// Return 0 for success, 1 to use fb0 instead
+//
+static int InitDRM(void)
+{
+char szDev[64];
+int iCard;
+
+	if (strcmp(szDRMCard, "off") == 0)
+		return 1;
+	for (iCard=0; iCard<8 && u32DRMPlane == 0; iCard++)
+	{
+		if (strcmp(szDRMCard, "auto") == 0)
+			snprintf(szDev, sizeof(szDev), "/dev/dri/card%d", iCard);
+		else if (iCard == 0)
+			snprintf(szDev, sizeof(szDev), "%s", szDRMCard);
+		else
+			break;
+		fdDRM = open(szDev, O_RDWR | O_CLOEXEC);
+		if (fdDRM < 0)
+			continue;
+		drmSetClientCap(fdDRM, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		drmSetClientCap(fdDRM, DRM_CLIENT_CAP_ATOMIC, 1); // shows the plane properties
+		u32DRMPlane = DRMFindPlane();
+		if (u32DRMPlane == 0)
+			CloseDRM();
+	}
+	if (u32DRMPlane == 0)
+	{
+		if (strcmp(szDRMCard, "auto") != 0)
+			fprintf(stderr, "Nothing is being shown on %s\n", szDRMCard);
+		return 1;
+	}
+	pFB = NULL;
+	DRMCapture();
+	if (pFB == NULL)
+	{
+		CloseDRM();
+		u32DRMPlane = 0;
+		return 1;
+	}
+	if (!bBackground)
+		printf("Capturing KMS plane %u of %s%s\n", u32DRMPlane, szDev,
+			u32DRMProps[DRMPROP_DAMAGE] ? " (with damage clips)" : "");
+	return 0;
+} /* InitDRM() */
+#endif // HAVE_DRM
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+//
+// Page flipping on fb0
+// Programs and SDL builds which double-buffer on fb0 draw into a page
+// below the visible one and flip by panning to it (FBIOPAN_DISPLAY).
+// Reading from the start of fb0 would catch the back buffer half drawn,
+// so the pan offset is read again before each capture (one ioctl) and pFB
+// pointed at the page being shown. Once the source is seen flipping, the
+// page on screen can't change until the next flip, so there's nothing new
+// to capture or compare in between. A source which hasn't flipped for a
+// second is read every frame again, in case something else draws on fb0.
+//
+static uint64_t llLastFlip; // when the last flip was seen, 0 = not flipping
+static int iFlips, iFlipSkips; // flips seen, captures skipped waiting for one
+
+//
+// Point pFB at the page being shown
+// Returns 1 if it may have changed since the last capture, 0 if not
+//
+static int FBPage(void)
+{
+struct fb_var_screeninfo var;
+unsigned int uOffset;
+
+	if (fbfd < 0 || ioctl(fbfd, FBIOGET_VSCREENINFO, &var) < 0)
+		return 1;
+	if (var.xoffset == u32PanX && var.yoffset == u32PanY)
+	{
+		if (llLastFlip == 0) // not flipping; read every frame
+			return 1;
+		if (NanoClock() - llLastFlip < 1000000000LL)
+		{
+			iFlipSkips++;
+			return 0;
+		}
+		llLastFlip = 0; // it stopped flipping
+		return 1;
+	}
+	uOffset = var.yoffset * iFBPitch + var.xoffset * (vinfo.bits_per_pixel / 8);
+	if (var.xres != vinfo.xres || var.yres != vinfo.yres || uOffset + (vinfo.yres - 1) * iFBPitch + (vinfo.xres * vinfo.bits_per_pixel) / 8 > (unsigned int)iScreenSize)
+		return 1; // the mode changed under us; keep reading the old page
+	if (u32PanY != ~0U) // the first read is where we start, not a flip
+	{
+		llLastFlip = NanoClock();
+		iFlips++;
+	}
+	u32PanX = var.xoffset;
+	u32PanY = var.yoffset;
+	pFB = pFBMap + uOffset;
+	return 1;
+} /* FBPage() */
+
+static void ShowFlipStats(void)
+{
+	if (!bBackground && (iFlips || iFlipSkips))
+		printf("  fb0 flips: %d, %d captures skipped waiting for one\n", iFlips, iFlipSkips);
+	iFlips = iFlipSkips = 0;
+} /* ShowFlipStats() */
+#endif // !_RPIZERO_
+
+//
+// Take a snapshot of the current FrameBuffer
+// Converts the pixels from RGB8888 to RGB565  if needed
+//
+static void FBCapture(unsigned char *pOut)
+{
+#if defined( _RPIZERO_ ) || defined( _RPI3_ )
+	vc_dispmanx_snapshot(display, screen_resource, 0);
+	vc_dispmanx_resource_read_data(screen_resource, &rect1, pOut, iLCDPitch);
+#else
+int y;
+
+	for (y=0; y<iLCDHeight; y++)
+	{
+		(*pfnConvertLine)(&pOut[y*iLCDPitch], y);
+	}
+#endif // _RPIZERO_
+} /* FBCapture() */
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+//
+// Fused capture (--fused)
+// Reads /dev/fb0 once, converts each line to RGB565 in a small buffer which
+// stays in the L1 cache, compares it against the shadow copy (pAltScreen) and
+// writes only the tile segments which changed, marking their tiles as dirty.
+// This replaces FBCapture() + FindChangedRegion() + the shadow memcpy
+// (3 passes over the frame) with a single one. 16-bpp 1:1 sources are
+// compared in place without the intermediate copy.
+//
+static uint64_t llFusedWrites; // bytes written to the shadow copy by FusedCapture()
+static int FusedCapture(unsigned char *pShadow, uint64_t *pRegions)
+{
+unsigned char *pLine, *pOld;
+TILERECT *pRect;
+int i, x, y, yc, xc, dx, dy, iTotalChanged = 0;
+
+	memset(pRegions, 0, iTilesY * iTileWords * sizeof(uint64_t));
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		dy = iTileHeight;
+		if ((yc+1)*iTileHeight > iLCDHeight)
+			dy = iLCDHeight - (yc*iTileHeight);
+		for (y=yc*iTileHeight; y<yc*iTileHeight+dy; y++)
+		{
+			if (pfnConvertLine == ConvertLine16)
+				pLine = &pFB[iFBPitch * y]; // no conversion needed
+			else
+			{
+				(*pfnConvertLine)(pLineBuf, y);
+				pLine = pLineBuf;
+			}
+			pOld = &pShadow[y * iLCDPitch];
+			if ((*pfnTileCompare)(pLine, pOld, iLCDPitch, 1, 0) == 0)
+				continue; // the whole line is unchanged (the usual case)
+			for (xc=0; xc<iTilesX; xc++)
+			{
+				x = xc * iTileWidth * 2;
+				dx = iTileWidth;
+				if ((xc+1)*iTileWidth > iLCDWidth)
+					dx = iLCDWidth - (xc*iTileWidth);
+				if ((*pfnTileCompare)(&pLine[x], &pOld[x], dx*2, 1, 0))
+				{
+					if (bTightRects)
+					{
+						pRect = &pTileRects[yc * iTilesX + xc];
+						if (!(pRegions[xc >> 6] & (1ULL << (xc & 63)))) // first change in this tile
+						{
+							pRect->x0 = dx; pRect->x1 = 0;
+							pRect->y0 = y - yc*iTileHeight;
+						}
+						pRect->y1 = y - yc*iTileHeight + 1;
+						ExtendTileRect(pRect, (uint16_t *)&pLine[x], (uint16_t *)&pOld[x], dx);
+					}
+					if (bShowFPS)
+						llBytesChanged += 2 * CountChangedPixels((uint16_t *)&pLine[x], (uint16_t *)&pOld[x], dx);
+					memcpy(&pOld[x], &pLine[x], dx*2);
+					llFusedWrites += dx*2;
+					pRegions[xc >> 6] |= (1ULL << (xc & 63));
+				}
+			} // for xc
+		} // for y
+		for (i=0; i<iTileWords; i++)
+			iTotalChanged += __builtin_popcountll(pRegions[i]);
+		pRegions += iTileWords;
+	} // for yc
+	return iTotalChanged;
+} /* FusedCapture() */
+#endif // !_RPIZERO_
+
+//
+// Hashed capture (--hash)
+// Instead of comparing the new frame against a shadow copy, keep a 64-bit
+// signature of each tile as it was last sent. The signatures are computed
+// as each line is captured (while it's still in the cache), so finding the
+// dirty tiles is a compare of iTilesX * iTilesY words and pAltScreen is
+// never read or written. The frame to send is the one just captured.
+// A collision (a changed tile with an unchanged signature) would leave the
+// tile stale until it changes again; --bench hash measures how likely that is.
+// HashBand() does one row of tiles of pScreen/pDirtyMap, so the rows can
+// be split across the worker pool.
+//
+static int HashBand(int yc)
+{
+uint64_t *pOld, *pNew, *pRegions;
+unsigned char *pLine;
+int i, x, y, xc, dx, dy, iChanged = 0;
+
+	dy = iTileHeight;
+	if ((yc+1)*iTileHeight > iLCDHeight)
+		dy = iLCDHeight - (yc*iTileHeight);
+	pNew = &pRowHash[yc * iTilesX];
+	for (xc=0; xc<iTilesX; xc++)
+		pNew[xc] = TILE_HASH_SEED;
+	for (y=yc*iTileHeight; y<yc*iTileHeight+dy; y++)
+	{
+		pLine = &pScreen[y * iLCDPitch];
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+		(*pfnConvertLine)(pLine, y);
+#endif
+		for (xc=0, x=0; xc<iTilesX; xc++, x+=iTileWidth)
+		{
+			dx = (x + iTileWidth > iLCDWidth) ? iLCDWidth - x : iTileWidth;
+			pNew[xc] = (*pfnTileHash)(pNew[xc], &pLine[x*2], dx*2);
+		}
+	}
+	pOld = &pTileHash[yc * iTilesX];
+	pRegions = &pDirtyMap[yc * iTileWords];
+	memset(pRegions, 0, iTileWords * sizeof(uint64_t));
+	for (xc=0; xc<iTilesX; xc++)
+	{
+		if (pNew[xc] != pOld[xc])
+		{
+			pOld[xc] = pNew[xc];
+			pRegions[xc >> 6] |= (1ULL << (xc & 63));
+		}
+	}
+	for (i=0; i<iTileWords; i++)
+		iChanged += __builtin_popcountll(pRegions[i]);
+	return iChanged;
+} /* HashBand() */
+
+//
+// Capture a frame into pScreen and mark its changed tiles in pDirtyMap
+//
+static int HashCapture(void)
+{
+int yc, iTotalChanged = 0;
+
+#if defined( _RPIZERO_ ) || defined( _RPI3_ )
+	FBCapture(pScreen); // dispmanx gives us the whole frame at once
+#endif
+	for (yc=0; yc<iTilesY; yc++)
+		iTotalChanged += HashBand(yc);
+	return iTotalChanged;
+} /* HashCapture() */
+
+//
+// Turn GPIO button presses into keyboard events
+// This would be more efficient to do as interrupt driven events
+// but reading the keys every frame takes an insignificant amount
+// of time. This allows for simpler GPIO access which will work
+// on more platforms. With --gpiochip the keys are interrupt driven
+// instead (see KeyThread) and this does nothing.
+//
+void ProcessKeys(void)
+{
+int i, rc, iState;
+struct input_event ie;
+
+	if (szGPIOChip[0]) // the key thread sends them as they happen
+		return;
+	memset(&ie, 0, sizeof(ie));
+
+	// Loop through all of the defined keys
+	for (i=0; i<iKeyDefs; i++)
+	{
+		iState = spilcdReadPin(iGPIOList[i]);
+		if (iState != iKeyState[i]) // need to send an event
+		{
+			iKeyState[i] = iState;
+			if (iState) // if state is off, send release
+				ie.value = 0;
+			else
+				ie.value = 1; // send press
+			ie.type = EV_KEY; // key event
+			ie.code = iKeyList[i];
+			rc = write(fdui, &ie, sizeof(ie)); // send the event
+			ie.type = EV_SYN;
+			ie.code = SYN_REPORT;
+			ie.value = 0;
+			rc = write(fdui, &ie, sizeof(ie)); // send a report			
+			if (rc < 0) {}; // suppress compiler warning
+			if (!iState)
+				KeyPressed(NanoClock()); // start the latency clock
+		}
+	} // for each key
+} /* ProcessKeys() */
+
+//
+// Interrupt driven keys (--gpiochip)
+// Instead of polling the pins every frame, a thread asks the GPIO character
+// device for an event on both edges of every key's line and sleeps in
+// epoll until one arrives, so a key is sent to uinput as soon as it changes
+// no matter how long the current frame takes. Debouncing is done on the
+// leading edge: the first edge is sent right away and the line's edges are
+// ignored for the next --debounce ms; if any arrived in that time, the line
+// is read again when it ends in case it settled in the other state.
+// The kernel's timestamp of each edge is used for the latency metrics.
+//
+static int fdKeyLines = -1, fdKeyWake = -1, fdKeyEpoll = -1; // line request, eventfd to stop the thread, and what it sleeps in
+static uint64_t llKeyEdge[MAX_GPIO]; // when each key last changed state
+static int bKeyRecheck[MAX_GPIO]; // edges were ignored; read it after the debounce
+static pthread_t tinfoKeys;
+
+#ifdef GPIO_V2_LINES_MAX
+static void SendKey(int iKey, int iState, uint64_t llEdge)
+{
+struct input_event ie[2];
+int rc;
+
+	memset(ie, 0, sizeof(ie));
+	ie[0].type = EV_KEY;
+	ie[0].code = iKeyList[iKey];
+	ie[0].value = !iState; // low = pressed
+	ie[1].type = EV_SYN;
+	ie[1].code = SYN_REPORT;
+	rc = write(fdui, ie, sizeof(ie));
+	if (rc < 0) {}; // suppress compiler warning
+	iKeyState[iKey] = iState;
+	llKeyEdge[iKey] = llEdge;
+	if (!iState)
+		KeyPressed(llEdge);
+} /* SendKey() */
+
+//
+// Read the current level of every key; returns a bit mask (1 = high, released)
+//
+static uint64_t ReadKeyLines(void)
+{
+struct gpio_v2_line_values lv;
+
+	lv.mask = (iKeyDefs < 64) ? (1ULL << iKeyDefs) - 1 : ~0ULL;
+	lv.bits = lv.mask; // if it fails, everything is released
+	ioctl(fdKeyLines, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv);
+	return lv.bits;
+} /* ReadKeyLines() */
+
+void *KeyThread(void *pArg)
+{
+struct epoll_event ev[2];
+struct gpio_v2_line_event le[16];
+uint64_t llNow, llWake, llDebounce = iDebounce * 1000000ULL, u64Bits = 0;
+int i, n, iKey, iTimeout, bRead;
+
+	while (1)
+	{
+		// sleep until an edge, the end of a debounce window or Shutdown()
+		iTimeout = -1;
+		llNow = NanoClock();
+		for (iKey=0; iKey<iKeyDefs; iKey++)
+		{
+			if (!bKeyRecheck[iKey])
+				continue;
+			llWake = llKeyEdge[iKey] + llDebounce;
+			i = (llWake > llNow) ? (int)((llWake - llNow + 999999) / 1000000) : 0;
+			if (iTimeout < 0 || i < iTimeout)
+				iTimeout = i;
+		}
+		n = epoll_wait(fdKeyEpoll, ev, 2, iTimeout);
+		for (i=0; i<n; i++)
+		{
+			if (ev[i].data.fd == fdKeyWake)
+				return NULL;
+		}
+		if (n > 0) // edges
+		{
+			i = read(fdKeyLines, le, sizeof(le));
+			n = (i > 0) ? i / (int)sizeof(le[0]) : 0;
+			for (i=0; i<n; i++)
+			{
+				for (iKey=0; iKey<iKeyDefs && iLineList[iKey] != (int)le[i].offset; iKey++) {};
+				if (iKey == iKeyDefs)
+					continue;
+				if ((int64_t)(le[i].timestamp_ns - llKeyEdge[iKey]) < (int64_t)llDebounce)
+					bKeyRecheck[iKey] = 1; // bouncing
+				else if ((le[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE) != iKeyState[iKey])
+				{
+					SendKey(iKey, !iKeyState[iKey], le[i].timestamp_ns);
+					llNow = NanoClock();
+					if (bMetrics && llNow > le[i].timestamp_ns)
+						HistAdd(&Histograms[STAGE_GPIO], llNow - le[i].timestamp_ns);
+				}
+			}
+		}
+		// read the lines whose debounce time is over, in case they settled
+		llNow = NanoClock();
+		bRead = 0;
+		for (iKey=0; iKey<iKeyDefs; iKey++)
+		{
+			if (!bKeyRecheck[iKey] || llNow - llKeyEdge[iKey] < llDebounce)
+				continue;
+			if (!bRead)
+			{
+				u64Bits = ReadKeyLines();
+				bRead = 1;
+			}
+			bKeyRecheck[iKey] = 0;
+			if ((int)((u64Bits >> iKey) & 1) != iKeyState[iKey])
+				SendKey(iKey, !iKeyState[iKey], llNow);
+		}
+	}
+	return NULL;
+} /* KeyThread() */
+#endif // GPIO_V2_LINES_MAX
+
+//
+// Request both edges of every key's line and start the thread
+// Returns 0 for success, 1 for failure
+//
+static int InitKeyThread(void)
+{
+#ifdef GPIO_V2_LINES_MAX
+struct gpio_v2_line_request req;
+struct epoll_event ev;
+uint64_t u64Bits;
+int i, fd;
+
+	fd = open(szGPIOChip, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error opening %s\n", szGPIOChip);
+		return 1;
+	}
+	memset(&req, 0, sizeof(req));
+	for (i=0; i<iKeyDefs; i++)
+	{
+		if (iLineList[i] < 0)
+		{
+			fprintf(stderr, "Header pin %d is not a GPIO\n", iGPIOList[i]);
+			close(fd);
+			return 1;
+		}
+		req.offsets[i] = iLineList[i];
+	}
+	req.num_lines = iKeyDefs;
+	strcpy(req.consumer, "bbcp keys");
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+	i = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(fd);
+	if (i < 0)
+	{
+		fprintf(stderr, "Error requesting the key lines from %s (in use, or not that many lines?)\n", szGPIOChip);
+		return 1;
+	}
+	fdKeyLines = req.fd;
+	u64Bits = ReadKeyLines(); // start from the keys' current state
+	for (i=0; i<iKeyDefs; i++)
+	{
+		iKeyState[i] = (int)((u64Bits >> i) & 1);
+		llKeyEdge[i] = 0;
+		bKeyRecheck[i] = 0;
+	}
+	fdKeyWake = eventfd(0, EFD_CLOEXEC);
+	fdKeyEpoll = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = fdKeyLines;
+	epoll_ctl(fdKeyEpoll, EPOLL_CTL_ADD, fdKeyLines, &ev);
+	ev.data.fd = fdKeyWake;
+	epoll_ctl(fdKeyEpoll, EPOLL_CTL_ADD, fdKeyWake, &ev);
+	if (pthread_create(&tinfoKeys, NULL, KeyThread, NULL) != 0)
+	{
+		close(fdKeyWake);
+		fdKeyWake = -1;
+		return 1;
+	}
+	return 0;
+#else
+	fprintf(stderr, "--gpiochip needs the GPIO v2 character device API (kernel headers 5.10+)\n");
+	return 1;
+#endif // GPIO_V2_LINES_MAX
+} /* InitKeyThread() */
+
+static void StopKeyThread(void)
+{
+uint64_t u64 = 1;
+
+	if (fdKeyWake < 0)
+		return;
+	if (write(fdKeyWake, &u64, sizeof(u64)) == sizeof(u64))
+		pthread_join(tinfoKeys, NULL);
+	close(fdKeyWake);
+	close(fdKeyEpoll);
+	close(fdKeyLines);
+	fdKeyWake = fdKeyEpoll = fdKeyLines = -1;
+} /* StopKeyThread() */
+
+//
+// Returns the color of a rectangle of pixels if they're all the same,
+// otherwise -1. The first line is checked here (most rectangles which
+// aren't solid fail in the first few pixels); after that pFillLine holds
+// the color and the other lines are compared against it with the kernel.
+//
+static int SolidColor(unsigned char *pSrc, int iWidth, int iHeight)
+{
+uint16_t *pus = (uint16_t *)pSrc;
+int x, y;
+
+	for (x=1; x<iWidth; x++)
+	{
+		if (pus[x] != pus[0])
+			return -1;
+	}
+	if (pus[0] != iFillColor)
+	{
+		iFillColor = pus[0];
+		for (x=0; x<iLCDWidth; x++)
+			pFillLine[x] = (uint16_t)iFillColor;
+	}
+	for (y=1; y<iHeight; y++)
+	{
+		if ((*pfnTileCompare)(&pSrc[y * iLCDPitch], (unsigned char *)pFillLine, iWidth*2, 1, 0))
+			return -1;
+	}
+	return iFillColor;
+} /* SolidColor() */
+
+//
+// Send one rectangle of pFrame to the LCD
+// With --fill, a rectangle of one color is sent from pFillLine (pitch 0)
+// instead of being streamed out of the frame
+//
+static void SendRect(unsigned char *pFrame, int x, int y, int iWidth, int iHeight)
+{
+	if (bFillTiles && SolidColor(&pFrame[(y * iLCDPitch) + x*2], iWidth, iHeight) >= 0)
+	{
+		LCDDrawTile(x, y, iWidth, iHeight, (unsigned char *)pFillLine, 0);
+		iFillRects++;
+		llFillBytes += iWidth * iHeight * 2;
+	}
+	else
+	{
+		LCDDrawTile(x, y, iWidth, iHeight, &pFrame[(y * iLCDPitch) + x*2], iLCDPitch);
+		iPixelRects++;
+	}
+	llBytesSent += iWidth * iHeight * 2;
+} /* SendRect() */
+
+//
+// Print and reset the fill statistics (called once a second with --showfps)
+//
+static void ShowFillStats(void)
+{
+	if (!bBackground && (iFillRects || iPixelRects))
+		printf("  fill: %d solid and %d pixel rectangles, %d KB sent from the fill line\n", iFillRects, iPixelRects, (int)(llFillBytes >> 10));
+	iFillRects = iPixelRects = 0;
+	llFillBytes = 0;
+} /* ShowFillStats() */
+
+//
+// Send the tiles marked in pRegions from pFrame to the LCD
+// If pRects is given, only the changed part of each tile is sent
+//
+static void DrawChangedTiles(unsigned char *pFrame, uint64_t *pRegions, TILERECT *pRects, int iChanged)
+{
+uint64_t u64Flags;
+TILERECT *pRect;
+int x, y, w, xc, dx, dy, yc, iCount;
+
+	iCount = 0; // number we've drawn
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		y = yc * iTileHeight;
+		dy = (y + iTileHeight > iLCDHeight) ? iLCDHeight - y : iTileHeight;
+		for (w=0; w<iTileWords; w++)
+		{
+			u64Flags = *pRegions++; // next set of row tile flags
+			while (u64Flags) // visit only the dirty tiles
+			{
+				xc = (w << 6) + __builtin_ctzll(u64Flags);
+				u64Flags &= (u64Flags - 1); // clear the lowest set bit
+				x = xc * iTileWidth;
+				dx = (x + iTileWidth > iLCDWidth) ? iLCDWidth - x : iTileWidth;
+				if (pRects)
+				{
+					pRect = &pRects[yc * iTilesX + xc];
+					SendRect(pFrame, x + pRect->x0, y + pRect->y0, pRect->x1 - pRect->x0, pRect->y1 - pRect->y0);
+				}
+				else
+				{
+					SendRect(pFrame, x, y, dx, dy);
+				}
+				iCount++;
+				if (iCount == iChanged/2) // yield thread
+					NanoSleep(4000LL);
+			}
+		}
+	}
+} /* DrawChangedTiles() */
+
+//
+// Find the next dirty (or clean) tile at or after xc in a row of the dirty map
+// Returns iTilesX if there isn't one
+//
+static int NextTile(uint64_t *pRow, int xc, int bDirty)
+{
+uint64_t u64, u64Invert = bDirty ? 0 : ~0ULL;
+int w = xc >> 6;
+
+	if (xc >= iTilesX)
+		return iTilesX;
+	u64 = (pRow[w] ^ u64Invert) & (~0ULL << (xc & 63));
+	while (u64 == 0)
+	{
+		if (++w >= iTileWords)
+			return iTilesX;
+		u64 = pRow[w] ^ u64Invert;
+	}
+	xc = (w << 6) + __builtin_ctzll(u64);
+	return (xc < iTilesX) ? xc : iTilesX;
+} /* NextTile() */
+
+//
+// Merge the dirty tiles into as few rectangles as possible
+// Runs of dirty tiles on a row of tiles become 1 rectangle and consecutive
+// rows which are dirty across the full width are stacked into 1 rectangle.
+// With pRects, each rectangle is the union of the changed areas of its tiles.
+// Returns the number of rectangles
+//
+static int BuildRects(uint64_t *pRegions, TILERECT *pRects, BBRECT *pList)
+{
+TILERECT *pRect;
+BBRECT *pOut;
+int i, xc, xEnd, yc, iCount, x0, x1, y0, y1, y, dy, bFullRow, bPrevFull;
+
+	iCount = 0;
+	bPrevFull = 0;
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		y = yc * iTileHeight;
+		dy = (y + iTileHeight > iLCDHeight) ? iLCDHeight - y : iTileHeight;
+		bFullRow = 0;
+		for (xc = NextTile(pRegions, 0, 1); xc < iTilesX; xc = NextTile(pRegions, xEnd, 1))
+		{
+			xEnd = NextTile(pRegions, xc, 0); // end of this run of dirty tiles
+			bFullRow = (xc == 0 && xEnd == iTilesX);
+			if (pRects) // union of the changed areas of the tiles in the run
+			{
+				x0 = iLCDWidth; x1 = 0; y0 = dy; y1 = 0;
+				for (i=xc; i<xEnd; i++)
+				{
+					pRect = &pRects[yc * iTilesX + i];
+					if (i * iTileWidth + pRect->x0 < x0) x0 = i * iTileWidth + pRect->x0;
+					if (i * iTileWidth + pRect->x1 > x1) x1 = i * iTileWidth + pRect->x1;
+					if (pRect->y0 < y0) y0 = pRect->y0;
+					if (pRect->y1 > y1) y1 = pRect->y1;
+				}
+				y0 += y; y1 += y;
+			}
+			else
+			{
+				x0 = xc * iTileWidth;
+				x1 = xEnd * iTileWidth;
+				if (x1 > iLCDWidth) x1 = iLCDWidth;
+				y0 = y; y1 = y + dy;
+			}
+			if (bFullRow && bPrevFull) // stack it onto the full width rectangle above
+			{
+				pOut = &pList[iCount-1];
+				if (x0 < pOut->x) { pOut->w += pOut->x - x0; pOut->x = x0; }
+				if (x1 > pOut->x + pOut->w) pOut->w = x1 - pOut->x;
+				pOut->h = y1 - pOut->y;
+			}
+			else
+			{
+				pOut = &pList[iCount++];
+				pOut->x = x0; pOut->w = x1 - x0;
+				pOut->y = y0; pOut->h = y1 - y0;
+			}
+		}
+		bPrevFull = bFullRow;
+		pRegions += iTileWords;
+	}
+	return iCount;
+} /* BuildRects() */
+
+//
+// Send a list of rectangles from pFrame to the LCD
+//
+static void DrawRects(unsigned char *pFrame, BBRECT *pList, int iCount)
+{
+int i;
+
+	for (i=0; i<iCount; i++)
+	{
+		SendRect(pFrame, pList[i].x, pList[i].y, pList[i].w, pList[i].h);
+		if (i == iCount/2 && iCount > 1) // yield thread
+			NanoSleep(4000LL);
+	}
+} /* DrawRects() */
+
+//
+// Frame trace recorder (--record <file>)
+// Every frame sent to the LCD is appended to the trace as its dirty tiles
+// (RGB565) plus a timestamp. The first frame stores all of the tiles; a
+// replay starts from a black screen and applies each frame in order.
+// Records are padded to 8 bytes so the file can be mmap'd and walked
+// in place. All values are little endian.
+//
+#define TRACE_MAGIC "BBTR"
+#define TRACE_VERSION 1
+typedef struct tag_TRACEHDR
+{
+	char szMagic[4];
+	uint16_t u16Version, u16Width, u16Height; // LCD size
+	uint16_t u16TileWidth, u16TileHeight; // tile size used when recording
+	uint16_t u16Reserved;
+	uint32_t u32Frames; // filled in when the trace is closed
+	uint32_t u32Reserved;
+} TRACEHDR;
+typedef struct tag_TRACEFRAME
+{
+	uint64_t llTime; // ns since the start of the recording
+	uint32_t u32Tiles; // number of TRACETILEs which follow
+	uint32_t u32Size; // size of the tile data in bytes (multiple of 8)
+} TRACEFRAME;
+typedef struct tag_TRACETILE
+{
+	uint16_t x, y, w, h; // followed by w*h RGB565 pixels
+} TRACETILE;
+
+static FILE *pfRecord;
+static TRACEHDR RecordHdr;
+static uint64_t llRecordStart;
+
+static int OpenRecording(char *szName)
+{
+	pfRecord = fopen(szName, "wb");
+	if (pfRecord == NULL)
+		return 1;
+	memset(&RecordHdr, 0, sizeof(RecordHdr));
+	memcpy(RecordHdr.szMagic, TRACE_MAGIC, 4);
+	RecordHdr.u16Version = TRACE_VERSION;
+	RecordHdr.u16Width = iLCDWidth;
+	RecordHdr.u16Height = iLCDHeight;
+	RecordHdr.u16TileWidth = iTileWidth;
+	RecordHdr.u16TileHeight = iTileHeight;
+	fwrite(&RecordHdr, 1, sizeof(RecordHdr), pfRecord);
+	llRecordStart = NanoClock();
+	return 0;
+} /* OpenRecording() */
+
+static void CloseRecording(void)
+{
+	if (pfRecord == NULL)
+		return;
+	fseek(pfRecord, 0, SEEK_SET); // update the frame count
+	fwrite(&RecordHdr, 1, sizeof(RecordHdr), pfRecord);
+	fclose(pfRecord);
+	pfRecord = NULL;
+} /* CloseRecording() */
+
+//
+// Append the dirty tiles of a frame to the trace
+//
+static void RecordFrame(unsigned char *pFrame, uint64_t *pRegions)
+{
+static const uint64_t llZero = 0;
+TRACEFRAME tf;
+TRACETILE tt;
+int xc, yc, y, bAll;
+uint64_t *pRow;
+
+	bAll = (RecordHdr.u32Frames == 0);
+	tf.llTime = NanoClock() - llRecordStart;
+	tf.u32Tiles = tf.u32Size = 0;
+	for (yc=0; yc<iTilesY; yc++) // count the tiles and bytes first
+	{
+		pRow = &pRegions[yc * iTileWords];
+		for (xc=0; xc<iTilesX; xc++)
+		{
+			if (bAll || (pRow[xc >> 6] & (1ULL << (xc & 63))))
+			{
+				tt.w = ((xc+1)*iTileWidth > iLCDWidth) ? iLCDWidth - xc*iTileWidth : iTileWidth;
+				tt.h = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - yc*iTileHeight : iTileHeight;
+				tf.u32Tiles++;
+				tf.u32Size += (sizeof(tt) + tt.w * tt.h * 2 + 7) & ~7;
+			}
+		}
+	}
+	fwrite(&tf, 1, sizeof(tf), pfRecord);
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		pRow = &pRegions[yc * iTileWords];
+		for (xc=0; xc<iTilesX; xc++)
+		{
+			if (bAll || (pRow[xc >> 6] & (1ULL << (xc & 63))))
+			{
+				tt.x = xc * iTileWidth;
+				tt.y = yc * iTileHeight;
+				tt.w = ((xc+1)*iTileWidth > iLCDWidth) ? iLCDWidth - tt.x : iTileWidth;
+				tt.h = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - tt.y : iTileHeight;
+				fwrite(&tt, 1, sizeof(tt), pfRecord);
+				for (y=0; y<tt.h; y++)
+					fwrite(&pFrame[(tt.y + y) * iLCDPitch + tt.x * 2], 1, tt.w * 2, pfRecord);
+				y = (tt.w * tt.h * 2) & 7; // pad to 8 bytes
+				if (y)
+					fwrite(&llZero, 1, 8 - y, pfRecord);
+			}
+		}
+	}
+	RecordHdr.u32Frames++;
+} /* RecordFrame() */
+
+//
+// Set a tile rectangle to cover the whole tile (clipped to the LCD)
+//
+static void FullTileRect(int xc, int yc, TILERECT *pRect)
+{
+	pRect->x0 = pRect->y0 = 0;
+	pRect->x1 = ((xc+1)*iTileWidth > iLCDWidth) ? iLCDWidth - xc*iTileWidth : iTileWidth;
+	pRect->y1 = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - yc*iTileHeight : iTileHeight;
+} /* FullTileRect() */
+
+//
+// Deadline scheduler (--budget)
+// Merge the new changes into the pending tiles, then choose which ones to
+// send this frame: the oldest first, then the ones with the most changed
+// area, as long as their modeled SPI time fits in one frame. Tiles which
+// have waited --max_stale frames are sent regardless of the budget.
+// The chosen tiles are moved to pSendMap; returns how many there are.
+//
+static int ScheduleTiles(uint64_t *pRegions, TILERECT *pRects)
+{
+uint64_t u64Flags, llBudget, llCost, llTime;
+TILERECT r, *pR;
+int w, xc, yc, i, iTile, iArea, iAge, iCount, iSent;
+
+	// add the new changes to the pending set
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		for (w=0; w<iTileWords; w++)
+		{
+			u64Flags = pRegions[yc * iTileWords + w];
+			while (u64Flags)
+			{
+				xc = (w << 6) + __builtin_ctzll(u64Flags);
+				u64Flags &= (u64Flags - 1);
+				iTile = yc * iTilesX + xc;
+				if (pRects)
+					r = pRects[iTile];
+				else
+					FullTileRect(xc, yc, &r);
+				pR = &pPendRects[iTile];
+				if (pPending[yc * iTileWords + w] & (1ULL << (xc & 63))) // still waiting; grow its area
+				{
+					if (r.x0 < pR->x0) pR->x0 = r.x0;
+					if (r.y0 < pR->y0) pR->y0 = r.y0;
+					if (r.x1 > pR->x1) pR->x1 = r.x1;
+					if (r.y1 > pR->y1) pR->y1 = r.y1;
+				}
+				else
+				{
+					pPending[yc * iTileWords + w] |= (1ULL << (xc & 63));
+					*pR = r;
+					pTileAge[iTile] = 0;
+				}
+			}
+		}
+	}
+	// Sort the pending tiles by age, then area, then raster order
+	iCount = 0;
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		for (w=0; w<iTileWords; w++)
+		{
+			u64Flags = pPending[yc * iTileWords + w];
+			while (u64Flags)
+			{
+				xc = (w << 6) + __builtin_ctzll(u64Flags);
+				u64Flags &= (u64Flags - 1);
+				iTile = yc * iTilesX + xc;
+				pR = &pPendRects[iTile];
+				iArea = (pR->x1 - pR->x0) * (pR->y1 - pR->y0);
+				pTileKeys[iCount++] = ((uint64_t)pTileAge[iTile] << 48) | ((uint64_t)iArea << 20) | (0xfffff - iTile);
+			}
+		}
+	}
+	qsort(pTileKeys, iCount, sizeof(uint64_t), CompareU64);
+	memset(pSendMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+	llBudget = 1000000000LL / iTargetFPS;
+	llCost = 0;
+	iSent = 0;
+	for (i=iCount-1; i>=0; i--) // highest priority first
+	{
+		iTile = 0xfffff - (int)(pTileKeys[i] & 0xfffff);
+		iArea = (int)((pTileKeys[i] >> 20) & 0xfffffff);
+		iAge = (int)(pTileKeys[i] >> 48);
+		llTime = SPITransferTime(1, iArea * 2);
+		if (iAge < iMaxStale && iSent && llCost + llTime > llBudget)
+			continue; // doesn't fit; a smaller one might
+		llCost += llTime;
+		xc = iTile % iTilesX; yc = iTile / iTilesX;
+		pSendMap[yc * iTileWords + (xc >> 6)] |= (1ULL << (xc & 63));
+		pPending[yc * iTileWords + (xc >> 6)] &= ~(1ULL << (xc & 63));
+		llStaleSum += iAge;
+		llStaleTiles++;
+		if (iAge > iStaleMax) iStaleMax = iAge;
+		iSent++;
+	}
+	// the rest wait another frame
+	for (i=0; i<iCount; i++)
+	{
+		iTile = 0xfffff - (int)(pTileKeys[i] & 0xfffff);
+		xc = iTile % iTilesX; yc = iTile / iTilesX;
+		if ((pPending[yc * iTileWords + (xc >> 6)] & (1ULL << (xc & 63))) && pTileAge[iTile] < 255)
+			pTileAge[iTile]++;
+	}
+	iDeferred += iCount - iSent;
+	iPendingTiles = iCount - iSent;
+	return iSent;
+} /* ScheduleTiles() */
+
+//
+// Print and reset the scheduler statistics (called once a second with --showfps)
+//
+static void ShowScheduleStats(void)
+{
+	if (!bBackground && llStaleTiles)
+		printf("  budget: %d tiles deferred, wait avg %.2f max %d frames, %d pending\n", iDeferred,
+			(double)llStaleSum / (double)llStaleTiles, iStaleMax, iPendingTiles);
+	iDeferred = iStaleMax = 0;
+	llStaleSum = llStaleTiles = 0;
+} /* ShowScheduleStats() */
+
+//
+// Draw one field (the even or odd lines) of the tiles in pMap
+// Runs of neighboring tiles are sent as one line
+//
+static void DrawField(unsigned char *pFrame, uint64_t *pMap, int iParity)
+{
+int x, y, y1, w, xc, xe, yc;
+uint64_t *pRow;
+
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		pRow = &pMap[yc * iTileWords];
+		y1 = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight : (yc+1)*iTileHeight;
+		xc = NextTile(pRow, 0, 1);
+		while (xc < iTilesX)
+		{
+			xe = NextTile(pRow, xc, 0); // end of this run
+			x = xc * iTileWidth;
+			w = ((xe * iTileWidth > iLCDWidth) ? iLCDWidth : xe * iTileWidth) - x;
+			y = yc * iTileHeight;
+			if ((y & 1) != iParity)
+				y++;
+			for (; y<y1; y+=2)
+			{
+				LCDDrawTile(x, y, w, 1, &pFrame[(y*iLCDPitch)+x*2], iLCDPitch);
+				llBytesSent += w * 2;
+			}
+			xc = NextTile(pRow, xe, 1);
+		}
+	}
+} /* DrawField() */
+
+//
+// Decide whether this frame is sent as a field and draw it if so
+// Returns 1 if the frame was sent as a field; otherwise pRegions is
+// updated to include the tiles owed from the last field (and their
+// rectangles in pRects, if given, cover the whole tile)
+//
+static int SendField(unsigned char *pFrame, uint64_t *pRegions, TILERECT *pRects)
+{
+uint64_t llBudget, llTime, llBytes;
+int i, xc, yc, iTiles;
+TILERECT r;
+
+	// the tiles to send = new changes + the ones waiting for their other field
+	iTiles = 0;
+	llBytes = 0;
+	for (yc=0; yc<iTilesY; yc++)
+	{
+		for (i=0; i<iTileWords; i++)
+			pSendMap[yc * iTileWords + i] = pRegions[yc * iTileWords + i] | pOwedMap[yc * iTileWords + i];
+		xc = NextTile(&pSendMap[yc * iTileWords], 0, 1);
+		while (xc < iTilesX)
+		{
+			FullTileRect(xc, yc, &r);
+			llBytes += r.x1 * r.y1 * 2;
+			iTiles++;
+			xc = NextTile(&pSendMap[yc * iTileWords], xc+1, 1);
+		}
+	}
+	// compare the progressive cost with the frame budget (hysteresis)
+	llBudget = 1000000000LL / iTargetFPS;
+	llTime = SPITransferTime(iTiles, llBytes);
+	if (!bInterlaced && llTime * 100 > llBudget * iInterlaceOn)
+		bInterlaced = 1;
+	else if (bInterlaced && llTime * 100 < llBudget * iInterlaceOff)
+		bInterlaced = 0;
+	if (!bInterlaced)
+	{
+		// finish the tiles which only got one field
+		for (yc=0; yc<iTilesY && pRects; yc++)
+		{
+			xc = NextTile(&pOwedMap[yc * iTileWords], 0, 1);
+			while (xc < iTilesX)
+			{
+				FullTileRect(xc, yc, &pRects[yc * iTilesX + xc]);
+				xc = NextTile(&pOwedMap[yc * iTileWords], xc+1, 1);
+			}
+		}
+		memcpy(pRegions, pSendMap, iTilesY * iTileWords * sizeof(uint64_t));
+		memset(pOwedMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+		iPendingTiles = 0;
+		iProgressiveFrames++;
+		return 0;
+	}
+	DrawField(pFrame, pSendMap, iField);
+	// the tiles which changed now still need the other field
+	memcpy(pOwedMap, pRegions, iTilesY * iTileWords * sizeof(uint64_t));
+	for (i=0, iTiles=0; i<iTilesY * iTileWords; i++)
+		iTiles += __builtin_popcountll(pOwedMap[i]);
+	iPendingTiles = iTiles;
+	iField ^= 1;
+	iFieldFrames++;
+	return 1;
+} /* SendField() */
+
+//
+// Print and reset the interlace statistics (called once a second with --showfps)
+//
+static void ShowInterlaceStats(void)
+{
+	if (!bBackground && iFieldFrames)
+		printf("  interlace: %d fields, %d progressive frames\n", iFieldFrames, iProgressiveFrames);
+	iFieldFrames = iProgressiveFrames = 0;
+} /* ShowInterlaceStats() */
+
+//
+// Send the changes of a frame to the LCD as tiles or merged rectangles
+//
+static void SendChanges(unsigned char *pFrame, uint64_t *pRegions, TILERECT *pRects, int iChanged)
+{
+	if (pfRecord)
+		RecordFrame(pFrame, pRegions);
+	if (bInterlace && SendField(pFrame, pRegions, pRects))
+	{
+		(*pSink->pfnFlush)();
+		return;
+	}
+	if (bBudget) // send only what fits in this frame
+	{
+		iChanged = ScheduleTiles(pRegions, pRects);
+		pRegions = pSendMap;
+		if (pRects)
+			pRects = pPendRects;
+	}
+	if (bCoalesce)
+		DrawRects(pFrame, pRectList, BuildRects(pRegions, pRects, pRectList));
+	else
+		DrawChangedTiles(pFrame, pRegions, pRects, iChanged);
+	(*pSink->pfnFlush)();
+} /* SendChanges() */
+
+//
+// Copy the rows of tiles which changed to our backup framebuffer
+// Returns the number of bytes copied
+//
+static int CopyChangedBands(unsigned char *pSrc, unsigned char *pDst, uint64_t *pRegions)
+{
+int i, j, iBytes = 0;
+
+	for (i=0; i<iLCDHeight; i+= iTileHeight)
+	{
+		if (RowIsDirty(pRegions))
+		{
+			j = iTileHeight;
+			if (i+j > iLCDHeight) j = iLCDHeight - i;
+			memcpy(&pDst[i*iLCDPitch], (void *)&pSrc[i*iLCDPitch], j * iLCDPitch); // copy regions which changed
+			iBytes += j * iLCDPitch;
+		}
+		pRegions += iTileWords;
+	}
+	return iBytes;
+} /* CopyChangedBands() */
+
+//
+// Scroll detection (--hwscroll)
+// Each line along the panel's scroll axis gets a 64-bit hash. If the lines
+// of the new frame match the lines of the LCD image (our shadow copy)
+// shifted by k, the panel is scrolled by k and the shadow copy is rotated
+// to match what the panel now shows. The normal compare then only finds
+// the newly exposed lines, bands which didn't scroll (e.g. a status bar)
+// and anything else which moved.
+//
+static uint64_t *pLineHash[2]; // lines of the shadow copy, lines of the new frame
+static uint64_t *pMaskHash[2]; // the same, leaving out the static parts
+static uint8_t *pStatic; // across the scroll axis: 1 = (nearly) the same in both frames
+static uint16_t *pDiffCount; // changed pixels in each column
+static unsigned char *pScrollTemp; // the lines RotateShadow() wraps around
+static int bShadowHashed; // pLineHash[0] is valid
+static int iScrollHits, iScrollFrames; // statistics
+static uint64_t llScrollSaved;
+
+static int AllocScroll(void)
+{
+	iScrollAxis = (pLCDType->iOrientation == LCD_ORIENTATION_NATIVE) ? SCROLL_ROWS : SCROLL_COLUMNS;
+	iScrollLines = (iScrollAxis == SCROLL_ROWS) ? iLCDHeight : iLCDWidth;
+	iScrollOffset = 0;
+	bShadowHashed = 0;
+	free(pLineHash[0]);
+	free(pLineHash[1]);
+	free(pMaskHash[0]);
+	free(pMaskHash[1]);
+	free(pStatic);
+	free(pDiffCount);
+	free(pScrollTemp);
+	pLineHash[0] = malloc(iScrollLines * sizeof(uint64_t));
+	pLineHash[1] = malloc(iScrollLines * sizeof(uint64_t));
+	pMaskHash[0] = malloc(iScrollLines * sizeof(uint64_t));
+	pMaskHash[1] = malloc(iScrollLines * sizeof(uint64_t));
+	pStatic = malloc((iScrollAxis == SCROLL_ROWS) ? iLCDWidth : iLCDHeight);
+	pDiffCount = malloc(iLCDWidth * sizeof(uint16_t));
+	pScrollTemp = malloc((iScrollAxis == SCROLL_ROWS) ? iScrollLines * iLCDPitch : iScrollLines * 2); // a shift is less than iScrollLines
+	return (pLineHash[0] == NULL || pLineHash[1] == NULL || pMaskHash[0] == NULL || pMaskHash[1] == NULL || pStatic == NULL || pDiffCount == NULL || pScrollTemp == NULL);
+} /* AllocScroll() */
+
+//
+// Hash each line (row or column) of a frame
+// If pSkip is given, the pixels across the axis with pSkip[i] set are left out
+//
+static void HashLines(unsigned char *pFrame, uint64_t *pHash, uint8_t *pSkip)
+{
+int x, y;
+uint64_t h, *pSrc;
+uint16_t *pPixels;
+
+	if (pSkip && iScrollAxis == SCROLL_ROWS)
+	{
+		for (y=0; y<iLCDHeight; y++)
+		{
+			pPixels = (uint16_t *)&pFrame[y * iLCDPitch];
+			h = 0xcbf29ce484222325ULL;
+			for (x=0; x<iLCDWidth; x++)
+			{
+				if (!pSkip[x])
+					h = (h ^ pPixels[x]) * 0x100000001b3ULL;
+			}
+			pHash[y] = h;
+		}
+	}
+	else if (iScrollAxis == SCROLL_ROWS)
+	{
+		for (y=0; y<iLCDHeight; y++)
+		{
+			pSrc = (uint64_t *)&pFrame[y * iLCDPitch];
+			h = 0xcbf29ce484222325ULL;
+			for (x=0; x<(iLCDWidth >> 2); x++) // 4 pixels at a time
+				h = (h ^ pSrc[x]) * 0x100000001b3ULL;
+			pPixels = (uint16_t *)pSrc;
+			for (x <<= 2; x<iLCDWidth; x++)
+				h = (h ^ pPixels[x]) * 0x100000001b3ULL;
+			pHash[y] = h;
+		}
+	}
+	else // columns; walk the rows in memory order
+	{
+		for (x=0; x<iLCDWidth; x++)
+			pHash[x] = 0xcbf29ce484222325ULL;
+		for (y=0; y<iLCDHeight; y++)
+		{
+			if (pSkip && pSkip[y])
+				continue;
+			pPixels = (uint16_t *)&pFrame[y * iLCDPitch];
+			for (x=0; x<iLCDWidth; x++)
+				pHash[x] = (pHash[x] ^ pPixels[x]) * 0x100000001b3ULL;
+		}
+	}
+} /* HashLines() */
+
+//
+// Mark the rows (column scrolling) or columns (row scrolling) which are
+// (nearly) the same in both frames, like a status bar with a counter
+// ticking in it; returns how many there are
+//
+static int FindStatic(unsigned char *pOld, unsigned char *pNew)
+{
+int x, y, iDiff, iCount = 0;
+uint16_t *s, *d;
+
+	if (iScrollAxis == SCROLL_COLUMNS)
+	{
+		for (y=0; y<iLCDHeight; y++)
+		{
+			s = (uint16_t *)&pOld[y * iLCDPitch];
+			d = (uint16_t *)&pNew[y * iLCDPitch];
+			for (x=0, iDiff=0; x<iLCDWidth; x++)
+				iDiff += (s[x] != d[x]);
+			pStatic[y] = (iDiff < iLCDWidth/8);
+			iCount += pStatic[y];
+		}
+	}
+	else
+	{
+		memset(pDiffCount, 0, iLCDWidth * sizeof(uint16_t));
+		for (y=0; y<iLCDHeight; y++)
+		{
+			s = (uint16_t *)&pOld[y * iLCDPitch];
+			d = (uint16_t *)&pNew[y * iLCDPitch];
+			for (x=0; x<iLCDWidth; x++)
+				pDiffCount[x] += (s[x] != d[x]);
+		}
+		for (x=0; x<iLCDWidth; x++)
+		{
+			pStatic[x] = (pDiffCount[x] < iLCDHeight/8);
+			iCount += pStatic[x];
+		}
+	}
+	return iCount;
+} /* FindStatic() */
+
+//
+// Find the shift k such that line i of the new frame is line i+k of the
+// shadow copy (wrapping around like the panel does)
+// Returns k, or 0 if scrolling wouldn't help
+//
+static int FindScroll(uint64_t *pOld, uint64_t *pNew, int *pMatched, int *pSame)
+{
+int i, j, k, iSame, iBest, iBestCount, iCount, iVotes[SCROLL_PROBES], iVoteK[SCROLL_PROBES], iCandidates;
+int N = iScrollLines, iStep;
+
+	for (i=0, iSame=0; i<N; i++)
+		iSame += (pOld[i] == pNew[i]);
+	*pSame = iSame;
+	if (iSame >= N - N/8) // (nearly) nothing moved
+		return 0;
+	// Probe some lines of the new frame; where their hash is found in the
+	// old frame (once), that's a vote for a shift
+	iCandidates = 0;
+	iStep = (N >= SCROLL_PROBES) ? N / SCROLL_PROBES : 1;
+	for (i=N/(2*SCROLL_PROBES); i<N; i+=iStep)
+	{
+		if (i > 0 && pNew[i] == pNew[i-1]) // flat areas match anywhere
+			continue;
+		for (j=0, k=-1, iCount=0; j<N; j++)
+		{
+			if (pOld[j] == pNew[i])
+			{
+				k = j - i;
+				iCount++;
+			}
+		}
+		if (iCount != 1 || k == 0)
+			continue;
+		k = (k + N) % N;
+		for (j=0; j<iCandidates && iVoteK[j] != k; j++) {};
+		if (j == iCandidates)
+		{
+			if (iCandidates == SCROLL_PROBES) // N isn't a multiple of SCROLL_PROBES; one probe too many
+				continue;
+			iVoteK[iCandidates] = k;
+			iVotes[iCandidates++] = 0;
+		}
+		iVotes[j]++;
+	}
+	// check the candidates against every line
+	iBest = 0; iBestCount = iSame;
+	for (j=0; j<iCandidates; j++)
+	{
+		if (iVotes[j] < 2)
+			continue;
+		k = iVoteK[j];
+		for (i=0, iCount=0; i<N; i++)
+			iCount += (pOld[(i + k) % N] == pNew[i]);
+		if (iCount > iBestCount)
+		{
+			iBestCount = iCount;
+			iBest = k;
+		}
+	}
+	// worth it if at least a quarter of the screen is saved
+	if (iBestCount - iSame < N/4)
+		return 0;
+	*pMatched = iBestCount - iSame;
+	return iBest;
+} /* FindScroll() */
+
+//
+// Rotate the shadow copy by k lines so it matches the scrolled panel
+//
+static void RotateShadow(unsigned char *pShadow, int k)
+{
+unsigned char *pTemp = pScrollTemp;
+int y, iLineBytes;
+
+	if (iScrollAxis == SCROLL_ROWS)
+	{
+		iLineBytes = iLCDPitch;
+		memcpy(pTemp, pShadow, k * iLineBytes);
+		memmove(pShadow, &pShadow[k * iLineBytes], (iScrollLines - k) * iLineBytes);
+		memcpy(&pShadow[(iScrollLines - k) * iLineBytes], pTemp, k * iLineBytes);
+	}
+	else
+	{
+		for (y=0; y<iLCDHeight; y++)
+		{
+			unsigned char *pRow = &pShadow[y * iLCDPitch];
+			memcpy(pTemp, pRow, k * 2);
+			memmove(pRow, &pRow[k * 2], (iScrollLines - k) * 2);
+			memcpy(&pRow[(iScrollLines - k) * 2], pTemp, k * 2);
+		}
+	}
+} /* RotateShadow() */
+
+//
+// Scroll the panel if the new frame is the LCD image shifted
+// Called after the capture, before the compare
+//
+static void ScrollFrame(unsigned char *pNew, unsigned char *pShadow)
+{
+uint64_t *pTemp;
+int k, iStatic, iSame, iMatched = 0;
+
+	HashLines(pNew, pLineHash[1], NULL);
+	// tiles still waiting for --budget/--interlace aren't in the panel
+	// the way the shadow copy says, so don't move them around
+	if (bShadowHashed && iPendingTiles == 0)
+	{
+		k = FindScroll(pLineHash[0], pLineHash[1], &iMatched, &iSame);
+		if (k == 0 && iSame < iScrollLines - iScrollLines/8)
+		{
+			// A lot changed but it's not a plain shift; maybe a band across
+			// the scroll axis stayed put. Try again without it.
+			iStatic = FindStatic(pShadow, pNew);
+			if (iStatic && iStatic < ((iScrollAxis == SCROLL_ROWS) ? iLCDWidth : iLCDHeight) / 2)
+			{
+				HashLines(pShadow, pMaskHash[0], pStatic);
+				HashLines(pNew, pMaskHash[1], pStatic);
+				k = FindScroll(pMaskHash[0], pMaskHash[1], &iMatched, &iSame);
+			}
+		}
+		if (k)
+		{
+			iScrollOffset = (iScrollOffset + k) % iScrollLines;
+			(*pSink->pfnScroll)(iScrollOffset);
+			RotateShadow(pShadow, k);
+			iScrollHits++;
+			llScrollSaved += (uint64_t)iMatched * ((iScrollAxis == SCROLL_ROWS) ? iLCDPitch : iLCDHeight * 2);
+		}
+		iScrollFrames++;
+	}
+	// after this frame is sent, the shadow copy is the new frame
+	pTemp = pLineHash[0]; pLineHash[0] = pLineHash[1]; pLineHash[1] = pTemp;
+	bShadowHashed = 1;
+} /* ScrollFrame() */
+
+//
+// Print and reset the scroll statistics (called once a second with --showfps)
+//
+static void ShowScrollStats(void)
+{
+	if (!bBackground && iScrollFrames)
+		printf("  hwscroll: %d of %d frames scrolled, ~%d KB saved\n", iScrollHits, iScrollFrames, (int)(llScrollSaved >> 10));
+	iScrollHits = iScrollFrames = 0;
+	llScrollSaved = 0;
+} /* ShowScrollStats() */
+
+//
+// Worker pool (--workers)
+// The capture of a frame is split by rows of tiles. Each row is converted
+// from fb0 and compared (or hashed) on its own, so the rows can be done
+// on any core in any order; the dirty map, tile rectangles and the shadow
+// copy of one row don't overlap any other. The worker threads are started
+// once and sleep between frames. For each frame the copy thread publishes
+// the job, wakes them up and works along with them; rows are handed out
+// by an atomic counter, so no locks are taken while the rows are done.
+//
+typedef int (*BANDJOB)(int yc); // returns the number of changed tiles
+static pthread_t tWorkers[MAX_WORKERS];
+static int iPoolThreads, iPoolActive; // helper threads started, workers used per frame (incl. the copy thread)
+static BANDJOB pfnBandJob;
+static int iPoolGeneration, bPoolQuit; // protected by pool_mutex
+static int iNextBand, iPoolChanged, iPoolDone, iPoolBytes; // atomic (32-bit; ARMv6 has no 64-bit atomics)
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+//
+// Pin the calling thread to the CPU given for this worker with --affinity
+//
+static void SetAffinity(int iIndex)
+{
+unsigned long ulMask[4]; // up to 256 CPUs
+int iCPU, iBits = 8 * sizeof(unsigned long);
+
+	if (iIndex >= MAX_WORKERS || iWorkerCPU[iIndex] < 0 || iWorkerCPU[iIndex] >= 4 * iBits)
+		return;
+	iCPU = iWorkerCPU[iIndex];
+	memset(ulMask, 0, sizeof(ulMask));
+	ulMask[iCPU / iBits] = 1UL << (iCPU % iBits);
+	if (syscall(SYS_sched_setaffinity, 0, sizeof(ulMask), ulMask) != 0)
+		fprintf(stderr, "Unable to pin worker %d to CPU %d\n", iIndex, iCPU);
+} /* SetAffinity() */
+
+//
+// Convert one row of tiles from fb0 to pScreen
+//
+static int ConvertBand(int yc)
+{
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+int y, dy;
+
+	if (bDamageFrame && !pDamageRows[yc]) // the KMS producer didn't touch it
+		return 0;
+	dy = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - yc*iTileHeight : iTileHeight;
+	for (y=yc*iTileHeight; y<yc*iTileHeight+dy; y++)
+		(*pfnConvertLine)(&pScreen[y*iLCDPitch], y);
+#endif // !_RPIZERO_
+	return 0;
+} /* ConvertBand() */
+
+//
+// Compare one row of tiles of pScreen against the shadow copy, then find
+// the changed rectangles and update the shadow copy of the row if it changed
+// The same as FindChangedRegion() + FindTileBounds() + CopyChangedBands()
+//
+static int DiffBand(int yc)
+{
+uint64_t *pRow = &pDirtyMap[yc * iTileWords];
+int i, x, xc, dx, dy, iOffset, iChanged = 0;
+
+	dy = ((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - yc*iTileHeight : iTileHeight;
+	memset(pRow, 0, iTileWords * sizeof(uint64_t));
+	if (bDamageFrame && !pDamageRows[yc]) // not converted; still the same as the shadow copy
+		return 0;
+	for (xc=0, x=0; xc<iTilesX; xc++, x+=iTileWidth)
+	{
+		dx = (x + iTileWidth > iLCDWidth) ? iLCDWidth - x : iTileWidth;
+		iOffset = (yc*iTileHeight*iLCDPitch) + x*2;
+		if ((*pfnTileCompare)(&pScreen[iOffset], &pAltScreen[iOffset], dx*2, dy, iLCDPitch))
+		{
+			pRow[xc >> 6] |= (1ULL << (xc & 63));
+			iChanged++;
+		}
+	}
+	if (iChanged)
+	{
+		if (bTightRects || bShowFPS)
+		{
+			i = FindBandBounds(pScreen, pAltScreen, pRow, yc, pTileRects);
+			if (i)
+				__atomic_fetch_add(&iPoolBytes, i, __ATOMIC_RELAXED);
+		}
+		iOffset = yc*iTileHeight*iLCDPitch;
+		memcpy(&pAltScreen[iOffset], &pScreen[iOffset], dy * iLCDPitch);
+	}
+	return iChanged;
+} /* DiffBand() */
+
+static int CaptureBand(int yc)
+{
+	ConvertBand(yc);
+	return DiffBand(yc);
+} /* CaptureBand() */
+
+//
+// Do the rows of tiles handed out by the band counter
+// Returns the number of changed tiles in them
+//
+static int RunBands(BANDJOB pfnJob)
+{
+int yc, iChanged = 0;
+
+	while ((yc = __atomic_fetch_add(&iNextBand, 1, __ATOMIC_RELAXED)) < iTilesY)
+		iChanged += (*pfnJob)(yc);
+	return iChanged;
+} /* RunBands() */
+
+void *WorkerThread(void *pArg)
+{
+int iChanged, iGeneration = 0;
+BANDJOB pfnJob;
+
+	iWorkerIndex = (int)(intptr_t)pArg;
+	SetAffinity(iWorkerIndex);
+	while (1)
+	{
+		pthread_mutex_lock(&pool_mutex);
+		while (iPoolGeneration == iGeneration && !bPoolQuit)
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+		iGeneration = iPoolGeneration;
+		pfnJob = pfnBandJob;
+		pthread_mutex_unlock(&pool_mutex);
+		if (bPoolQuit)
+			break;
+		iChanged = (iWorkerIndex < iPoolActive) ? RunBands(pfnJob) : 0;
+		__atomic_fetch_add(&iPoolChanged, iChanged, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&iPoolDone, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+} /* WorkerThread() */
+
+//
+// Run a job on every row of tiles using the pool; returns when all are done
+//
+static int PoolRun(BANDJOB pfnJob)
+{
+int iChanged;
+
+	if (iPoolThreads == 0 || iPoolActive < 2)
+	{
+		iNextBand = iPoolBytes = 0;
+		iChanged = RunBands(pfnJob);
+	}
+	else
+	{
+		pthread_mutex_lock(&pool_mutex);
+		pfnBandJob = pfnJob;
+		iNextBand = iPoolChanged = iPoolDone = iPoolBytes = 0;
+		iPoolGeneration++;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_mutex);
+		iChanged = RunBands(pfnJob);
+		while (__atomic_load_n(&iPoolDone, __ATOMIC_ACQUIRE) < iPoolThreads)
+			sched_yield(); // the last rows are being finished
+		iChanged += iPoolChanged;
+	}
+	llBytesChanged += iPoolBytes;
+	return iChanged;
+} /* PoolRun() */
+
+//
+// Start the worker threads (iCount includes the copy thread)
+// Return 0 for success, 1 for failure
+//
+static int InitWorkers(int iCount)
+{
+	if (iCount > MAX_WORKERS)
+		iCount = MAX_WORKERS;
+	bPoolQuit = 0;
+	iPoolActive = iCount;
+	for (iPoolThreads=0; iPoolThreads<iCount-1; iPoolThreads++)
+	{
+		if (pthread_create(&tWorkers[iPoolThreads], NULL, WorkerThread, (void *)(intptr_t)(iPoolThreads+1)) != 0)
+			return 1;
+	}
+	return 0;
+} /* InitWorkers() */
+
+static void StopWorkers(void)
+{
+int i;
+
+	pthread_mutex_lock(&pool_mutex);
+	bPoolQuit = 1;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	for (i=0; i<iPoolThreads; i++)
+		pthread_join(tWorkers[i], NULL);
+	iPoolThreads = 0;
+} /* StopWorkers() */
+
+//
+// Capture a frame into pScreen with the worker pool and mark the changed
+// tiles in pDirtyMap; the shadow copy is updated like CopyLoop() does
+//
+static int ParallelCapture(void)
+{
+#if defined( _RPIZERO_ ) || defined( _RPI3_ )
+	FBCapture(pScreen); // dispmanx does the whole frame at once; split the diff
+	if (bHashTiles)
+		return PoolRun(HashBand);
+	if (bHWScroll)
+		ScrollFrame(pScreen, pAltScreen);
+	return PoolRun(DiffBand);
+#else
+	if (bHashTiles)
+		return PoolRun(HashBand);
+	if (bHWScroll) // needs the whole new frame before anything is compared
+	{
+		PoolRun(ConvertBand);
+		ScrollFrame(pScreen, pAltScreen);
+		return PoolRun(DiffBand);
+	}
+	return PoolRun(CaptureBand);
+#endif // _RPIZERO_
+} /* ParallelCapture() */
+
+//
+// Frames submitted by a client (--shm)
+// A client which draws the display itself (see bbcp_client.h) can hand us
+// finished frames in a ring of buffers in shared memory, along with the
+// rectangles which changed. While one is connected fb0 isn't read at all:
+// only the submitted rectangles are compared against the LCD image (pScreen)
+// and copied into it, so there's no capture, no conversion and no compare of
+// the areas which didn't change. If several frames are queued they're all
+// merged and sent as one. The main thread accepts the client and sets up the
+// ring; only the copy thread uses it and tears it down.
+//
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+static char szShmSock[108]; // socket to accept a client on (--shm)
+static int iShmSock = -1, iShmClient = -1; // listening socket, the attached client
+static BBCP_RING *pShm; // ring of the attached client, NULL = use fb0
+static int fdShmFrame = -1, fdShmFree = -1, iShmSize;
+static int iShmHeader, iShmSlotSize; // our own ring layout; the client can scribble on its copy
+static volatile int bShmDetach; // the client went away; the copy thread cleans up
+static uint32_t u32ShmFrames; // frames taken, to be marked as shown
+static uint32_t u32ShmTail, u32ShmShown; // private copies of the ring's tail and shown counters
+
+static int OpenShmSocket(char *szPath)
+{
+struct sockaddr_un addr;
+
+	iShmSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (iShmSock < 0)
+		return 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", szPath);
+	unlink(szPath);
+	if (bind(iShmSock, (struct sockaddr *)&addr, sizeof(addr)) || listen(iShmSock, 1))
+	{
+		close(iShmSock);
+		iShmSock = -1;
+		return 1;
+	}
+	chmod(szPath, 0600); // only our user can draw on the LCD
+	return 0;
+} /* OpenShmSocket() */
+
+//
+// Create a frame ring for a new client and send it the memfd + eventfds
+// Called by the main thread; returns 0 for success, 1 for failure
+//
+static int ShmAttach(int iSock)
+{
+BBCP_RING *pRing;
+BBCP_HELLO hello;
+struct msghdr msg;
+struct iovec iov;
+struct cmsghdr *cmsg;
+char cBuf[CMSG_SPACE(3 * sizeof(int))];
+int fd[3], iSlotSize, iHeader;
+
+	iSlotSize = (iLCDPitch * iLCDHeight + 4095) & ~4095;
+	iHeader = (sizeof(BBCP_RING) + 4095) & ~4095;
+	iShmSize = iHeader + BBCP_SLOTS * iSlotSize;
+	fd[0] = syscall(SYS_memfd_create, "bbcp-frames", MFD_CLOEXEC);
+	if (fd[0] < 0)
+		return 1;
+	pRing = MAP_FAILED;
+	if (ftruncate(fd[0], iShmSize) == 0)
+		pRing = (BBCP_RING *)mmap(NULL, iShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd[0], 0);
+	fd[1] = eventfd(0, EFD_CLOEXEC); // frame submitted
+	fd[2] = eventfd(0, EFD_CLOEXEC); // buffer free
+	if (pRing == MAP_FAILED || fd[1] < 0 || fd[2] < 0)
+		goto attach_error;
+	memset(pRing, 0, sizeof(BBCP_RING));
+	pRing->u32Magic = BBCP_MAGIC;
+	pRing->u32Version = BBCP_VERSION;
+	pRing->u32Width = iLCDWidth;
+	pRing->u32Height = iLCDHeight;
+	pRing->u32Pitch = iLCDPitch;
+	pRing->u32Slots = BBCP_SLOTS;
+	pRing->u32SlotSize = iSlotSize;
+	pRing->u32PixelOffset = iHeader;
+
+	hello.u32Magic = BBCP_MAGIC;
+	hello.u32Version = BBCP_VERSION;
+	hello.u32Size = iShmSize;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cBuf;
+	msg.msg_controllen = sizeof(cBuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), fd, sizeof(fd));
+	if (sendmsg(iSock, &msg, MSG_NOSIGNAL) != sizeof(hello))
+		goto attach_error;
+	close(fd[0]); // the client has its own copy
+	fdShmFrame = fd[1];
+	fdShmFree = fd[2];
+	iShmHeader = iHeader;
+	iShmSlotSize = iSlotSize;
+	u32ShmFrames = u32ShmTail = u32ShmShown = 0;
+	__atomic_store_n(&pShm, pRing, __ATOMIC_RELEASE); // the copy thread takes it from here
+	return 0;
+
+attach_error:
+	if (pRing != MAP_FAILED)
+		munmap(pRing, iShmSize);
+	close(fd[0]);
+	if (fd[1] >= 0) close(fd[1]);
+	if (fd[2] >= 0) close(fd[2]);
+	return 1;
+} /* ShmAttach() */
+
+//
+// Release the ring of a client which went away; fb0 takes over again and
+// all of it is sent, since the LCD shows what the client drew
+// Called by the copy thread (or by Shutdown once it has stopped)
+//
+static void ShmDetach(void)
+{
+	if (pShm)
+	{
+		munmap(pShm, iShmSize);
+		close(fdShmFrame);
+		close(fdShmFree);
+		fdShmFrame = fdShmFree = -1;
+		pShm = NULL;
+		memset(pAltScreen, 0xff, iLCDPitch * iLCDHeight);
+		memset(pTileHash, 0xff, iTilesX * iTilesY * sizeof(uint64_t));
+		bDRMFull = 1;
+		if (!bBackground)
+			printf("Frame client disconnected; reading fb0\n");
+	}
+	bShmDetach = 0;
+} /* ShmDetach() */
+
+//
+// Compare one submitted rectangle with the LCD image tile by tile and
+// copy the tiles' parts which differ (or belong to an already dirty tile)
+// Returns the number of tiles which became dirty
+//
+static int ShmDamage(unsigned char *pPixels, int x, int y, int w, int h)
+{
+TILERECT *pRect;
+unsigned char *s, *d;
+int i, xc, yc, tx, ty, x0, x1, y0, y1, iChanged = 0;
+
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (x + w > iLCDWidth) w = iLCDWidth - x;
+	if (y + h > iLCDHeight) h = iLCDHeight - y;
+	if (w <= 0 || h <= 0)
+		return 0;
+	for (yc = y / iTileHeight; yc * iTileHeight < y + h; yc++)
+	{
+		ty = yc * iTileHeight;
+		y0 = (y > ty) ? y : ty;
+		y1 = (y + h < ty + iTileHeight) ? y + h : ty + iTileHeight;
+		for (xc = x / iTileWidth; xc * iTileWidth < x + w; xc++)
+		{
+			tx = xc * iTileWidth;
+			x0 = (x > tx) ? x : tx;
+			x1 = (x + w < tx + iTileWidth) ? x + w : tx + iTileWidth;
+			s = &pPixels[y0 * iLCDPitch + x0 * 2];
+			d = &pScreen[y0 * iLCDPitch + x0 * 2];
+			pRect = &pTileRects[yc * iTilesX + xc];
+			if (pDirtyMap[yc * iTileWords + (xc >> 6)] & (1ULL << (xc & 63)))
+			{ // already dirty; widen its changed area
+				if (x0 - tx < pRect->x0) pRect->x0 = x0 - tx;
+				if (x1 - tx > pRect->x1) pRect->x1 = x1 - tx;
+				if (y0 - ty < pRect->y0) pRect->y0 = y0 - ty;
+				if (y1 - ty > pRect->y1) pRect->y1 = y1 - ty;
+			}
+			else if ((*pfnTileCompare)(s, d, (x1 - x0) * 2, y1 - y0, iLCDPitch))
+			{
+				pDirtyMap[yc * iTileWords + (xc >> 6)] |= (1ULL << (xc & 63));
+				pRect->x0 = x0 - tx; pRect->x1 = x1 - tx;
+				pRect->y0 = y0 - ty; pRect->y1 = y1 - ty;
+				iChanged++;
+			}
+			else
+				continue; // the client redrew it the same
+			for (i=y0; i<y1; i++, s += iLCDPitch, d += iLCDPitch)
+				memcpy(d, s, (x1 - x0) * 2);
+		}
+	}
+	return iChanged;
+} /* ShmDamage() */
+
+//
+// Take all of the frames the client has queued into pScreen and mark the
+// tiles which changed; returns the number of changed tiles
+//
+static int ShmCapture(void)
+{
+BBCP_SLOT *pSlot;
+BBCP_RECT rect;
+unsigned char *pPixels;
+uint32_t u32Head, u32Rects, i;
+uint64_t u64 = 1;
+int iChanged = 0;
+
+	// Everything in the ring header can be changed by the client at any
+	// time, so each value is read once and checked; the layout and the
+	// tail are our own copies
+	memset(pDirtyMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+	u32Head = __atomic_load_n(&pShm->u32Head, __ATOMIC_ACQUIRE);
+	if (u32Head - u32ShmTail > BBCP_SLOTS)
+		u32Head = u32ShmTail + BBCP_SLOTS;
+	for (; u32ShmTail != u32Head; u32ShmTail++)
+	{
+		pSlot = &pShm->slot[u32ShmTail % BBCP_SLOTS];
+		pPixels = (unsigned char *)pShm + iShmHeader + (u32ShmTail % BBCP_SLOTS) * iShmSlotSize;
+		u32Rects = __atomic_load_n(&pSlot->u32Rects, __ATOMIC_RELAXED);
+		if (u32Rects == 0 || u32Rects > BBCP_MAX_RECTS)
+			iChanged += ShmDamage(pPixels, 0, 0, iLCDWidth, iLCDHeight);
+		else
+		{
+			for (i=0; i<u32Rects; i++)
+			{
+				memcpy(&rect, &pSlot->rects[i], sizeof(rect)); // ShmDamage clips it to the LCD
+				iChanged += ShmDamage(pPixels, rect.x, rect.y, rect.w, rect.h);
+			}
+		}
+		__atomic_store_n(&pShm->u32Tail, u32ShmTail + 1, __ATOMIC_RELEASE); // the client can have the buffer back
+		if (write(fdShmFree, &u64, sizeof(u64)) < 0) {};
+	}
+	u32ShmFrames = u32Head;
+	return iChanged;
+} /* ShmCapture() */
+
+//
+// Tell the client which frames have reached the LCD
+//
+static void ShmShown(void)
+{
+uint32_t u32;
+uint64_t llTime = NanoClock();
+
+	for (u32 = u32ShmShown; u32 != u32ShmFrames; u32++)
+		pShm->llShownTime[u32 % BBCP_SLOTS] = llTime;
+	u32ShmShown = u32ShmFrames;
+	__atomic_store_n(&pShm->u32Shown, u32ShmShown, __ATOMIC_RELEASE);
+} /* ShmShown() */
+
+//
+// Sleep until the client submits a frame (instead of pacing to --fps)
+//
+static void ShmWait(void)
+{
+struct pollfd pfd;
+uint64_t u64;
+
+	if (__atomic_load_n(&pShm->u32Head, __ATOMIC_ACQUIRE) != u32ShmTail || bShmDetach)
+		return; // one is waiting already
+	pfd.fd = fdShmFrame;
+	pfd.events = POLLIN;
+	// wake up now and then to see if we should quit, or each frame if we poll the keys
+	if (poll(&pfd, 1, (iKeyDefs && !szGPIOChip[0]) ? 1000 / iTargetFPS : 100) > 0)
+	{
+		if (read(fdShmFrame, &u64, sizeof(u64)) < 0) {};
+	}
+} /* ShmWait() */
+
+//
+// Copy the framebuffer changes to the LCD
+// checks for key events too
+// Returns the number of changed tiles
+//
+static int CopyLoop(void)
+{
+unsigned char *pFrame = pAltScreen; // what gets sent
+uint64_t t, llBytes, llPress;
+int iChanged, bNewPage = 1;
+
+	t = StageStart();
+	// Manage GPIO keys
+	ProcessKeys();
+	t = StageNext(STAGE_KEYS, t);
+
+#ifdef HAVE_DRM
+	bDamageFrame = 0;
+	if (fdDRM >= 0 && !__atomic_load_n(&pShm, __ATOMIC_ACQUIRE)) // follow the KMS page flips
+		bDamageFrame = DRMCapture() && !bHashTiles && !bHWScroll;
+#endif // HAVE_DRM
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+	if (!__atomic_load_n(&pShm, __ATOMIC_ACQUIRE))
+		bNewPage = FBPage();
+#endif // !_RPIZERO_
+	if (__atomic_load_n(&pShm, __ATOMIC_ACQUIRE)) // a client draws the frames (--shm)
+	{
+		if (bShmDetach)
+		{
+			ShmDetach();
+			iChanged = 0;
+		}
+		else
+			iChanged = ShmCapture();
+		pFrame = pScreen;
+		t = StageNext(STAGE_CAPTURE, t);
+	}
+	else if (!bNewPage) // double-buffered fb0 hasn't flipped since the last capture
+	{
+		memset(pDirtyMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+		iChanged = 0;
+		if (bHashTiles)
+			pFrame = pScreen;
+		t = StageNext(STAGE_CAPTURE, t);
+	}
+	else if (iPoolThreads || bDamageFrame) // split the capture across the worker pool (or only do the damaged rows)
+	{
+		iChanged = ParallelCapture();
+		if (bHashTiles)
+			pFrame = pScreen;
+		t = StageNext(STAGE_CAPTURE, t);
+	}
+	else if (bHashTiles) // compare tile signatures instead of pixels
+	{
+		iChanged = HashCapture();
+		pFrame = pScreen;
+		t = StageNext(STAGE_CAPTURE, t);
+	}
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+	else if (bFused) // single pass capture + compare
+	{
+		iChanged = FusedCapture(pAltScreen, pDirtyMap);
+		t = StageNext(STAGE_CAPTURE, t);
+	}
+#endif // !_RPIZERO_
+	else
+	{
+		// Capture the current framebuffer
+		FBCapture(pScreen);
+		if (bHWScroll)
+			ScrollFrame(pScreen, pAltScreen);
+		t = StageNext(STAGE_CAPTURE, t);
+
+		// Divide display into tiles (64x30 pixels each by default)
+		iChanged = FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pDirtyMap);
+		if (iChanged) // some area of the image changed
+		{
+			if (bTightRects || bShowFPS) // needs both frames, so before the copy
+				FindTileBounds(pScreen, pAltScreen, pDirtyMap, pTileRects);
+			t = StageNext(STAGE_DIFF, t);
+			// Copy the changed areas to our backup framebuffer
+			CopyChangedBands(pScreen, pAltScreen, pDirtyMap);
+			t = StageNext(STAGE_SHADOW, t);
+		}
+		else
+			t = StageNext(STAGE_DIFF, t);
+	}
+	llPress = KeyFrame(iChanged);
+	if (iChanged || iPendingTiles) // draw the changed (and still waiting) tiles
+	{
+		llBytes = llBytesSent;
+		SendChanges(pFrame, pDirtyMap, bTightRects ? pTileRects : NULL, iChanged);
+		if (t)
+		{
+			StageNext(STAGE_SEND, t);
+			StageValue(STAGE_TILES, iChanged);
+			StageValue(STAGE_BYTES, llBytesSent - llBytes);
+		}
+		KeyAnswered(llPress);
+	}
+	if (pShm)
+		ShmShown();
+	return iChanged;
+} /* CopyLoop() */
+
+//
+// Pipelined mode (--pipeline)
+// The copy thread captures and compares frame N+1 while a second thread
+// sends the dirty tiles of frame N to the LCD. Frames live in a small ring
+// of buffers instead of pScreen/pAltScreen; each frame is compared against
+// the one captured before it, so no shadow copy needs to be maintained.
+// A frame's buffer can only be reused once the transmit thread is done with it.
+//
+#define MAX_RING 8
+typedef struct tag_PIPEFRAME
+{
+	unsigned char *pPixels;
+	uint64_t *pRegions; // dirty tile map
+	TILERECT *pRects; // changed area of each dirty tile (--tight)
+	uint64_t llKeyPress; // the key press this frame answers, if any
+	int iChanged;
+} PIPEFRAME;
+
+static PIPEFRAME PipeRing[MAX_RING];
+static int bPipeline, iRingSize;
+static int iFramesQueued, iFramesSent; // running frame counts (producer/consumer)
+static int iCaptureStalls, iSendStalls, iMaxQueue; // pipeline statistics
+static uint64_t llCaptureStallTime, llSendStallTime, llQueueSum;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tinfoSend;
+
+//
+// Allocate the frame ring
+// Return 0 for success, 1 for failure
+//
+static int InitPipeline(void)
+{
+int i;
+
+	if (iRingSize < 3) iRingSize = 3; // capture + transmit + reference
+	if (iRingSize > MAX_RING) iRingSize = MAX_RING;
+	for (i=0; i<iRingSize; i++)
+	{
+		PipeRing[i].pPixels = malloc(iLCDPitch * iLCDHeight);
+		PipeRing[i].pRegions = AllocDirtyMap();
+		PipeRing[i].pRects = malloc(iTilesX * iTilesY * sizeof(TILERECT));
+		if (PipeRing[i].pPixels == NULL || PipeRing[i].pRegions == NULL || PipeRing[i].pRects == NULL)
+			return 1;
+	}
+	// The "previous" frame of the first capture is garbage; force all tiles to be sent
+	memset(PipeRing[iRingSize-1].pPixels, 0xff, iLCDPitch * iLCDHeight);
+	iFramesQueued = iFramesSent = 0;
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2 && !bBackground)
+		printf("Warning: pipelined mode needs more than 1 CPU core to be of any benefit\n");
+	return 0;
+} /* InitPipeline() */
+
+//
+// Transmit stage; drains the queued frames in order
+//
+void *SendThread(void *pArg)
+{
+PIPEFRAME *pFrame;
+uint64_t llTime, llBytes, t;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pipe_mutex);
+		if (iFramesSent == iFramesQueued && bRunning) // nothing to send; stall
+		{
+			iSendStalls++;
+			llTime = NanoClock();
+			while (iFramesSent == iFramesQueued && bRunning)
+				pthread_cond_wait(&pipe_cond, &pipe_mutex);
+			llSendStallTime += NanoClock() - llTime;
+		}
+		if (!bRunning)
+		{
+			pthread_mutex_unlock(&pipe_mutex);
+			break;
+		}
+		pFrame = &PipeRing[iFramesSent % iRingSize];
+		pthread_mutex_unlock(&pipe_mutex);
+
+		t = StageStart();
+		llBytes = llBytesSent;
+		SendChanges(pFrame->pPixels, pFrame->pRegions, bTightRects ? pFrame->pRects : NULL, pFrame->iChanged);
+		if (t)
+		{
+			StageNext(STAGE_SEND, t);
+			StageValue(STAGE_TILES, pFrame->iChanged);
+			StageValue(STAGE_BYTES, (llBytesSent >= llBytes) ? llBytesSent - llBytes : llBytesSent); // --showfps may have reset it
+		}
+		KeyAnswered(pFrame->llKeyPress);
+
+		pthread_mutex_lock(&pipe_mutex);
+		iFramesSent++;
+		pthread_cond_broadcast(&pipe_cond); // a buffer may be free now
+		pthread_mutex_unlock(&pipe_mutex);
+	}
+	return NULL;
+} /* SendThread() */
+
+//
+// Capture + compare stage of the pipeline
+// Frames with no changes aren't queued; their buffer is reused for the next capture
+// Returns the number of changed tiles
+//
+static int PipelineLoop(void)
+{
+PIPEFRAME *pFrame, *pPrev;
+uint64_t llTime, t;
+int iFrame, iDepth;
+
+	t = StageStart();
+	ProcessKeys();
+	t = StageNext(STAGE_KEYS, t);
+
+	iFrame = iFramesQueued; // only this thread changes the queued count
+	pthread_mutex_lock(&pipe_mutex);
+	// the buffer we want was last used by frame N-iRingSize; wait for it to be sent
+	if (iFrame - iFramesSent >= iRingSize && bRunning)
+	{
+		iCaptureStalls++;
+		llTime = NanoClock();
+		while (iFrame - iFramesSent >= iRingSize && bRunning)
+			pthread_cond_wait(&pipe_cond, &pipe_mutex);
+		llCaptureStallTime += NanoClock() - llTime;
+	}
+	pthread_mutex_unlock(&pipe_mutex);
+	if (!bRunning)
+		return 0;
+
+	pFrame = &PipeRing[iFrame % iRingSize];
+	pPrev = &PipeRing[(iFrame + iRingSize - 1) % iRingSize];
+	if (t) // don't count the wait for a free buffer
+		t = NanoClock();
+#ifdef HAVE_DRM
+	if (fdDRM >= 0) // the damage clips aren't used; each frame is compared with the one before
+		DRMCapture();
+#endif // HAVE_DRM
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+	FBPage(); // read the page being shown; every frame is captured since the ring needs one
+#endif // !_RPIZERO_
+	FBCapture(pFrame->pPixels);
+	t = StageNext(STAGE_CAPTURE, t);
+	pFrame->iChanged = FindChangedRegion(pFrame->pPixels, pPrev->pPixels, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pFrame->pRegions);
+	pFrame->llKeyPress = KeyFrame(pFrame->iChanged);
+	if (pFrame->iChanged == 0 && iPendingTiles == 0)
+	{
+		StageNext(STAGE_DIFF, t);
+		return 0;
+	}
+	if (bTightRects || bShowFPS)
+		FindTileBounds(pFrame->pPixels, pPrev->pPixels, pFrame->pRegions, pFrame->pRects);
+	StageNext(STAGE_DIFF, t);
+
+	pthread_mutex_lock(&pipe_mutex);
+	iFramesQueued++;
+	iDepth = iFramesQueued - iFramesSent;
+	llQueueSum += iDepth;
+	if (iDepth > iMaxQueue) iMaxQueue = iDepth;
+	pthread_cond_broadcast(&pipe_cond);
+	pthread_mutex_unlock(&pipe_mutex);
+	return pFrame->iChanged;
+} /* PipelineLoop() */
+
+//
+// Print and reset the pipeline counters (called once a second with --showfps)
+//
+static void ShowPipelineStats(void)
+{
+int iQueued;
+
+	pthread_mutex_lock(&pipe_mutex);
+	iQueued = iFramesQueued;
+	if (!bBackground)
+		printf("  pipeline: sent %d/%d, queue avg %.2f max %d, capture stalls %d (%.1fms), send stalls %d (%.1fms)\n",
+			iFramesSent, iQueued, iQueued ? (float)llQueueSum / (float)iQueued : 0.0f, iMaxQueue,
+			iCaptureStalls, (float)llCaptureStallTime / 1000000.0f,
+			iSendStalls, (float)llSendStallTime / 1000000.0f);
+	iCaptureStalls = iSendStalls = iMaxQueue = 0;
+	llCaptureStallTime = llSendStallTime = 0;
+	pthread_mutex_unlock(&pipe_mutex);
+} /* ShowPipelineStats() */
+
+//
+// Parse the command  line options
+//
+static int ParseOpts(int argc, char *argv[])
+{
+    int i = 1;
+
+    while (i < argc)
+    {
+        /* if it isn't a cmdline option, we're done */
+        if (0 != strncmp("--", argv[i], 2))
+            break;
+        /* GNU-style separator to support files with -- prefix
+         * example for a file named "--baz": ./foo --bar -- --baz
+         */
+        if (0 == strcmp("--", argv[i]))
+        {
+            i += 1;
+            break;
+        }
+        /* test for each specific flag */
+        if (0 == strcmp("--spi_bus", argv[i])) {
+            iSPIChan = atoi(argv[i+1]);
+            i += 2;
+	} else if (0 == strcmp("--background", argv[i])) {
+	    bBackground = 1;
+	    i++;
+        } else if (0 == strcmp("--spi_freq", argv[i])) {
+            iSPIFreq = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--flip", argv[i])) {
+            i++; 
+            bLCDFlip = 1;
+        } else if (0 == strcmp("--lcd_dc", argv[i])) {
+            iDC = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--lcd_rst", argv[i])) {
+            iReset = atoi(argv[i+1]); 
+            i += 2;
+        } else if (0 == strcmp("--lcd_led", argv[i])) {
+            iLED = atoi(argv[i+1]);
+            i += 2; 
+	} else if (0 == strcmp("--simd", argv[i])) {
+	    strncpy(szSIMD, argv[i+1], sizeof(szSIMD)-1);
+	    i += 2;
+	} else if (0 == strcmp("--bench", argv[i])) {
+	    strncpy(szBench, argv[i+1], sizeof(szBench)-1);
+	    i += 2;
+	} else if (0 == strcmp("--fps", argv[i])) {
+	    iTargetFPS = atoi(argv[i+1]);
+	    if (iTargetFPS < 1) iTargetFPS = 1;
+	    i += 2;
+	} else if (0 == strcmp("--budget", argv[i])) {
+	    bBudget = 1;
+	    i++;
+	} else if (0 == strcmp("--max_stale", argv[i])) {
+	    iMaxStale = atoi(argv[i+1]);
+	    if (iMaxStale < 0) iMaxStale = 0;
+	    if (iMaxStale > 255) iMaxStale = 255;
+	    i += 2;
+	} else if (0 == strcmp("--interlace", argv[i])) {
+	    bInterlace = 1;
+	    i++;
+	} else if (0 == strcmp("--interlace_on", argv[i])) {
+	    iInterlaceOn = atoi(argv[i+1]);
+	    i += 2;
+	} else if (0 == strcmp("--interlace_off", argv[i])) {
+	    iInterlaceOff = atoi(argv[i+1]);
+	    i += 2;
+	} else if (0 == strcmp("--hwscroll", argv[i])) {
+	    bHWScroll = 1;
+	    i++;
+	} else if (0 == strcmp("--sync", argv[i])) {
+	    if (strcmp(argv[i+1], "vsync") == 0)
+	        iSyncMode = SYNC_VSYNC;
+	    else if (strcmp(argv[i+1], "timer") == 0)
+	        iSyncMode = SYNC_TIMER;
+	    else
+	        iSyncMode = SYNC_AUTO;
+	    i += 2;
+	} else if (0 == strcmp("--idle_fps", argv[i])) {
+	    iIdleFPS = atoi(argv[i+1]);
+	    if (iIdleFPS < 1) iIdleFPS = 1;
+	    i += 2;
+	} else if (0 == strcmp("--control", argv[i])) {
+	    strncpy(szControl, argv[i+1], sizeof(szControl)-1);
+	    if (strcmp(szControl, "none") == 0)
+	        szControl[0] = 0;
+	    i += 2;
+	} else if (0 == strcmp("--record", argv[i])) {
+	    strncpy(szRecord, argv[i+1], sizeof(szRecord)-1);
+	    i += 2;
+	} else if (0 == strcmp("--replay", argv[i])) {
+	    strncpy(szTrace, argv[i+1], sizeof(szTrace)-1);
+	    strcpy(szBench, "replay");
+	    i += 2;
+	} else if (0 == strcmp("--gpiokeys", argv[i])) {
+	    strcpy(szKeyConfig, argv[i+1]);
+	    i += 2;
+        } else if (0 == strcmp("--gpiochip", argv[i])) {
+            strncpy(szGPIOChip, argv[i+1], sizeof(szGPIOChip)-1);
+            i += 2;
+        } else if (0 == strcmp("--debounce", argv[i])) {
+            iDebounce = atoi(argv[i+1]);
+            if (iDebounce < 0) iDebounce = 0;
+            i += 2;
+        } else if (0 == strcmp("--lcd_type", argv[i])) {
+            int j;
+            for (j=0; LCDTypes[j].szName != NULL; j++)
+            {
+                if (0 == strcmp(LCDTypes[j].szName, argv[i+1]))
+                    break;
+            }
+            if (LCDTypes[j].szName == NULL)
+            {
+                fprintf(stderr, "Unsupported LCD type '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            pLCDType = &LCDTypes[j];
+            i += 2;
+        } else if (0 == strcmp("--tile", argv[i])) {
+            if (sscanf(argv[i+1], "%dx%d", &iTileWidth, &iTileHeight) != 2 || iTileWidth < 1 || iTileHeight < 1)
+            {
+                fprintf(stderr, "Tile size must be given as WxH\n");
+                exit(1);
+            }
+            bAutoTile = 0;
+            i += 2;
+        } else if (0 == strcmp("--profile", argv[i])) {
+            strncpy(szProfile, argv[i+1], sizeof(szProfile)-1);
+            i += 2;
+        } else if (0 == strcmp("--tile_profiles", argv[i])) {
+            if (strcmp(argv[i+1], "none") == 0)
+                szTileProfiles[0] = 0;
+            else
+                strncpy(szTileProfiles, argv[i+1], sizeof(szTileProfiles)-1);
+            i += 2;
+        } else if (0 == strcmp("--lcd_size", argv[i])) {
+            if (sscanf(argv[i+1], "%dx%d", &iLCDWidth, &iLCDHeight) != 2)
+            {
+                fprintf(stderr, "LCD size must be given as WxH\n");
+                exit(1);
+            }
+            i += 2;
+        } else if (0 == strcmp("--pipeline", argv[i])) {
+            bPipeline = 1;
+            i++;
+        } else if (0 == strcmp("--scale", argv[i])) {
+            if (0 == strcmp("box", argv[i+1]))
+                iScaleFilter = SCALE_BOX;
+            else if (0 == strcmp("bilinear", argv[i+1]))
+                iScaleFilter = SCALE_BILINEAR;
+            else
+            {
+                fprintf(stderr, "Unknown scaling filter '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            i += 2;
+        } else if (0 == strcmp("--letterbox", argv[i])) {
+            bLetterbox = 1;
+            i++;
+        } else if (0 == strcmp("--coalesce", argv[i])) {
+            bCoalesce = 1;
+            i++;
+        } else if (0 == strcmp("--lcd", argv[i])) {
+            int j;
+            for (j=0; LCDSinks[j].szName != NULL; j++)
+            {
+                if (0 == strcmp(LCDSinks[j].szName, argv[i+1]))
+                    break;
+            }
+            if (LCDSinks[j].szName == NULL)
+            {
+                fprintf(stderr, "Unknown LCD backend: %s\n", argv[i+1]);
+                exit(1);
+            }
+            pSink = &LCDSinks[j];
+            i += 2;
+        } else if (0 == strcmp("--drm", argv[i])) {
+#ifdef HAVE_DRM
+            strncpy(szDRMCard, argv[i+1], sizeof(szDRMCard)-1);
+#else
+            fprintf(stderr, "Built without KMS capture (make DRM=1); --drm is ignored\n");
+#endif // HAVE_DRM
+            i += 2;
+        } else if (0 == strcmp("--shm", argv[i])) {
+            strncpy(szShmSock, argv[i+1], sizeof(szShmSock)-1);
+            i += 2;
+        } else if (0 == strcmp("--stats", argv[i])) {
+            strncpy(szStatsFile, argv[i+1], sizeof(szStatsFile)-1);
+            bMetrics = 1;
+            i += 2;
+        } else if (0 == strcmp("--latency", argv[i])) {
+            bLatency = 1;
+            bMetrics = 1;
+            i++;
+        } else if (0 == strcmp("--dump", argv[i])) {
+            strncpy(szDumpDir, argv[i+1], sizeof(szDumpDir)-1);
+            i += 2;
+        } else if (0 == strcmp("--virtual_realtime", argv[i])) {
+            bVirtualRealtime = 1;
+            i++;
+        } else if (0 == strcmp("--spi_overhead", argv[i])) {
+            iSPIOverhead = atoi(argv[i+1]) * 1000;
+            i += 2;
+        } else if (0 == strcmp("--tight", argv[i])) {
+            bTightRects = 1;
+            i++;
+        } else if (0 == strcmp("--fused", argv[i])) {
+            bFused = 1;
+            i++;
+        } else if (0 == strcmp("--workers", argv[i])) {
+            iWorkers = atoi(argv[i+1]);
+            if (iWorkers < 1) iWorkers = 1;
+            if (iWorkers > MAX_WORKERS) iWorkers = MAX_WORKERS;
+            i += 2;
+        } else if (0 == strcmp("--affinity", argv[i])) {
+            char *p = argv[i+1];
+            int j;
+            for (j=0; j<MAX_WORKERS && *p; j++)
+            {
+                iWorkerCPU[j] = (int)strtol(p, &p, 10);
+                if (*p == ',') p++;
+            }
+            i += 2;
+        } else if (0 == strcmp("--fill", argv[i])) {
+            bFillTiles = 1;
+            i++;
+        } else if (0 == strcmp("--hash", argv[i])) {
+            bHashTiles = 1;
+            i++;
+        } else if (0 == strcmp("--ring", argv[i])) {
+            iRingSize = atoi(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--showfps",argv[i])) {        
+            bShowFPS = 1;
+            i++;
+        }  else {
+            fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
+            exit(1);
+        }   
+    }       
+    return i;
+
+} /* ParseOpts() */
+
+static void ShowHelp(void)
+{
+    printf(
+        "BB-CP: copy framebuffer to SPI LCD\n"
+        "Copyright (c) 2017 BitBank Software, Inc.\n"
+        "Written by Larry Bank\n\n"
+        "Options:\n"
+        " --spi_bus <integer>      defaults to 0\n"
+        " --spi_freq <integer>     defaults to 31250000\n"
+        " --lcd_dc <pin number>    defaults to 18\n"
+        " --lcd_rst <pin number>   defaults to 22\n"
+        " --lcd_led <pin number>   defaults to 13\n"
+        " --lcd_type <name>        controller type, defaults to ili9341\n"
+        " --lcd_size <WxH>         override the controller's display size\n"
+        " --tile <WxH>             fixed tile size; by default each size is tried on\n"
+        "                          the running program and the cheapest one is used\n"
+        "                          (not with --hash, --pipeline, --budget or --interlace)\n"
+        " --profile <name>         save the tile size found under this name instead\n"
+        "                          of the name of the program using fb0\n"
+        " --tile_profiles <file|none> where the tile sizes found are kept, defaults\n"
+        "                          to /var/lib/bbcp/tiles.txt\n"
+	" --gpiokeys <config file> \n"
+	" --gpiochip <device>      read the keys from a GPIO character device (e.g.\n"
+	"                          /dev/gpiochip0) on their own thread as they change\n"
+	"                          instead of polling them each frame; pin_N is a\n"
+	"                          header pin, line_N a line of the chip (gpio-sim)\n"
+	" --debounce <ms>          ignore a key's edges this long after it changes\n"
+	"                          (--gpiochip), defaults to 5\n"
+        " --flip                   flips display 180 degrees\n"
+        " --showfps                Show framerate\n"
+        " --pipeline               capture and send on separate threads (multi-core)\n"
+        " --ring <integer>         frame buffers used by --pipeline, defaults to 3\n"
+        " --fused                  capture, compare and update in a single pass\n"
+        " --hash                   find changed tiles by their signatures instead of\n"
+        "                          a second copy of the frame\n"
+        " --tight                  only send the changed part of each dirty tile\n"
+        " --coalesce               merge neighboring dirty tiles into larger transfers\n"
+        " --fill                   send areas of a single color from a fill buffer\n"
+        " --workers <integer>      threads which share the capture and compare of\n"
+        "                          each frame (by rows of tiles), defaults to 1\n"
+        " --affinity <cpu,cpu,..>  pin the copy thread and each worker to a CPU\n"
+        " --lcd <spi|virtual>      output backend, defaults to spi; virtual keeps the\n"
+        "                          display in memory and models the SPI bus time\n"
+        " --dump <directory>       save each virtual LCD frame as a PPM file\n"
+        " --virtual_realtime       make the virtual LCD as slow as the modeled bus\n"
+        " --spi_overhead <us>      time each SPI transaction costs beyond its bytes,\n"
+        "                          used for estimates; defaults to 25\n"
+        " --scale <box|bilinear>   filter used to resize fb0 to the LCD; by default\n"
+        "                          1:1 and 2:1 are copied directly, others use box\n"
+        " --letterbox              keep the aspect ratio of fb0 (black bars)\n"
+        " --drm <device|auto|off>  capture the framebuffer a KMS device (e.g.\n"
+        "                          /dev/dri/card0) shows instead of fb0; auto tries\n"
+        "                          each card and falls back to fb0, off uses fb0\n"
+        "                          (builds made with DRM=1), defaults to auto\n"
+	" --background             suppress printf output if running as a bkgd process\n"
+	" --simd <c|sse2|avx2|neon> force a specific compare kernel; c also\n"
+	"                          disables the CRC32 instructions for --hash\n"
+	" --bench <name>           run a benchmark without the LCD and exit\n"
+	"                          (compare, coalesce, fused, hash, scale, shm,\n"
+	"                          shrink, workers)\n"
+	" --fps <integer>          target frame rate, defaults to 60\n"
+	" --budget                 only send the dirty tiles which fit in the SPI time\n"
+	"                          of a frame; the oldest and most changed go first\n"
+	" --max_stale <integer>    frames a tile may wait with --budget, defaults to 4\n"
+	" --interlace              send heavy frames as alternating even/odd fields\n"
+	" --interlace_on <percent> start fields when a frame needs more than this\n"
+	"                          much of the SPI time of a frame, defaults to 100\n"
+	" --interlace_off <percent> go back to full frames below this, defaults to 75\n"
+	" --hwscroll               use the panel's scroll register when the image\n"
+	"                          moves along the panel's scan direction\n"
+	"                          (--lcd virtual only for now)\n"
+	" --sync <auto|vsync|timer> capture timing; auto waits for the fb0 vblank if\n"
+	"                          possible and follows the source's frame rate,\n"
+	"                          timer is a fixed --fps grid\n"
+	" --idle_fps <integer>     poll rate while the screen is static, defaults to 10\n"
+	" --control <path|none>    control socket, defaults to /tmp/bbcp.sock\n"
+	"                          (fps <n>, tile <w>x<h>|auto, pause, resume, stats,\n"
+	"                          metrics [reset], quit)\n"
+	" --shm <socket>           accept finished frames and their changed areas\n"
+	"                          from a client (bbcp_client.h) instead of reading\n"
+	"                          fb0 while one is connected\n"
+	" --stats <file>           time each stage of every frame and write the\n"
+	"                          latency percentiles to this file once a second\n"
+	" --latency                time each GPIO key press until the first frame\n"
+	"                          drawn after it has been sent; printed on exit\n"
+	" --record <file>          save the frames sent to the LCD as a trace file\n"
+	" --replay <file>          benchmark tile sizes and strategies on a trace\n"
+        "\nExample usage:\n"
+        "sudo ./bbcp --spi_bus 1 spi_freq 46000000 --flip\n"
+    );
+} /* ShowHelp() */
+
+//
+// Fill a synthetic RGB565 frame with a repeatable pseudo-random pattern
+//
+static void BenchFillFrame(unsigned char *pFrame, int iSize, uint32_t u32Seed)
+{
+int i;
+uint16_t *pus = (uint16_t *)pFrame;
+
+	for (i=0; i<iSize/2; i++)
+	{
+		u32Seed = u32Seed * 1103515245 + 12345;
+		pus[i] = (uint16_t)(u32Seed >> 16);
+	}
+} /* BenchFillFrame() */
+
+//
+// Time FindChangedRegion() with each supported compare kernel on
+// identical, slightly changed (1%) and fully changed frames
+// The output of each kernel is checked against the C version
+//
+static int BenchCompare(void)
+{
+unsigned char *pOld, *pNew;
+uint64_t *pRef, *pRegions;
+uint64_t llStart, llTime;
+int i, k, x, y, iCase, iFrames, iSize;
+TILECOMPARE pfnOld = pfnTileCompare;
+const char *szCases[] = {"identical", "1% changed", "all changed"};
+
+	iLCDPitch = iLCDWidth * 2;
+	iSize = iLCDPitch * iLCDHeight;
+	pOld = malloc(iSize);
+	pNew = malloc(iSize);
+	pRef = AllocDirtyMap();
+	pRegions = AllocDirtyMap();
+	printf("FindChangedRegion() %dx%d, %dx%d tiles\n", iLCDWidth, iLCDHeight, iTileWidth, iTileHeight);
+	for (iCase = 0; iCase < 3; iCase++)
+	{
+		BenchFillFrame(pOld, iSize, 0x1234);
+		memcpy(pNew, pOld, iSize);
+		if (iCase == 1) // change a 28x28 block (~1% of the pixels) straddling 4 tiles
+		{
+			for (y=iLCDHeight/2-14; y<iLCDHeight/2+14; y++)
+				for (x=iLCDWidth/2-14; x<iLCDWidth/2+14; x++)
+					pNew[y*iLCDPitch + x*2] ^= 0x55;
+		}
+		else if (iCase == 2)
+		{
+			BenchFillFrame(pNew, iSize, 0x5678);
+		}
+		pfnTileCompare = TileCompareC;
+		FindChangedRegion(pNew, pOld, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pRef);
+		printf("%s:\n", szCases[iCase]);
+		for (k=0; CompareKernels[k].szName != NULL; k++)
+		{
+			if (!CompareKernels[k].bSupported)
+				continue;
+			pfnTileCompare = CompareKernels[k].pfnCompare;
+			FindChangedRegion(pNew, pOld, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pRegions);
+			if (memcmp(pRegions, pRef, iTilesY * iTileWords * sizeof(uint64_t)) != 0)
+			{
+				printf("  %-5s MISMATCH with the C kernel!\n", CompareKernels[k].szName);
+				continue;
+			}
+			iFrames = 0;
+			llStart = NanoClock();
+			do
+			{
+				for (i=0; i<100; i++)
+					FindChangedRegion(pNew, pOld, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pRegions);
+				iFrames += 100;
+				llTime = NanoClock() - llStart;
+			} while (llTime < 500000000LL); // run each one for 1/2 second
+			printf("  %-5s %8.2f us/frame\n", CompareKernels[k].szName, (double)llTime / (1000.0 * iFrames));
+		}
+	}
+	pfnTileCompare = pfnOld;
+	free(pOld);
+	free(pNew);
+	free(pRef);
+	free(pRegions);
+	return 0;
+} /* BenchCompare() */
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+//
+// Compare the time and memory traffic of the 3 pass capture
+// (FBCapture + FindChangedRegion + shadow copy) against FusedCapture()
+// for each supported framebuffer format. Each frame has a small moving
+// change (~1% of the pixels) like a typical game sprite.
+//
+static int BenchFused(void)
+{
+static const int iFormats[4][2] = {{1,16},{1,32},{2,16},{2,32}}; // scale, bpp
+uint64_t *pFused;
+uint64_t llStart, llTime3, llTimeF, llBytes3, llBytesF, llSrc, llFrame;
+int i, x, y, iFmt, iFrames, iBands;
+unsigned char *pFrames[2];
+
+	if (AllocBuffers())
+		return 1;
+	pFused = AllocDirtyMap();
+	printf("Capture path, %dx%d LCD, %dx%d tiles, ~1%% of pixels changing per frame\n", iLCDWidth, iLCDHeight, iTileWidth, iTileHeight);
+	printf("source           3-pass us  MB/frm | fused us  MB/frm\n");
+	for (iFmt=0; iFmt<4; iFmt++)
+	{
+		vinfo.xres = iLCDWidth * iFormats[iFmt][0];
+		vinfo.yres = iLCDHeight * iFormats[iFmt][0];
+		vinfo.bits_per_pixel = iFormats[iFmt][1];
+		iFBPitch = (vinfo.xres * vinfo.bits_per_pixel) / 8;
+		iScreenSize = iFBPitch * vinfo.yres;
+		// two source frames which differ in a 28x28 block (at the LCD scale)
+		pFrames[0] = malloc(iScreenSize);
+		pFrames[1] = malloc(iScreenSize);
+		BenchFillFrame(pFrames[0], iScreenSize, 0x4321);
+		memcpy(pFrames[1], pFrames[0], iScreenSize);
+		for (y=(iLCDHeight/2-14)*iFormats[iFmt][0]; y<(iLCDHeight/2+14)*iFormats[iFmt][0]; y++)
+			for (x=(iLCDWidth/2-14)*iFormats[iFmt][0]; x<(iLCDWidth/2+14)*iFormats[iFmt][0]; x++)
+				pFrames[1][y*iFBPitch + (x*vinfo.bits_per_pixel)/8 + 1] ^= 0x80;
+		SelectConverter();
+		llSrc = (uint64_t)iFBPitch * iLCDHeight; // fb0 lines we read
+		llFrame = (uint64_t)iLCDPitch * iLCDHeight;
+
+		// 3 pass version
+		pFB = pFrames[1]; FBCapture(pAltScreen); // start in sync
+		iFrames = 0; llBytes3 = 0;
+		llStart = NanoClock();
+		do
+		{
+			pFB = pFrames[iFrames & 1];
+			FBCapture(pScreen);
+			FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pDirtyMap);
+			iBands = CopyChangedBands(pScreen, pAltScreen, pDirtyMap);
+			// fb read + pScreen write + compare reads (upper bound) + shadow copy
+			llBytes3 += llSrc + llFrame + 2*llFrame + 2*iBands;
+			iFrames++;
+			llTime3 = NanoClock() - llStart;
+		} while (llTime3 < 500000000LL);
+		llTime3 /= iFrames; llBytes3 /= iFrames;
+
+		// fused version
+		pFB = pFrames[1]; FBCapture(pAltScreen);
+		iFrames = 0; llFusedWrites = 0;
+		llStart = NanoClock();
+		do
+		{
+			pFB = pFrames[iFrames & 1];
+			FusedCapture(pAltScreen, pFused);
+			iFrames++;
+			llTimeF = NanoClock() - llStart;
+		} while (llTimeF < 500000000LL);
+		llTimeF /= iFrames;
+		// fb read + shadow read + changed segments written
+		llBytesF = llSrc + llFrame + llFusedWrites / iFrames;
+		for (i=0; i<iTilesY * iTileWords; i++)
+		{
+			if (pFused[i] != pDirtyMap[i])
+				printf("MISMATCH in the dirty tiles of row %d!\n", i / iTileWords);
+		}
+		printf("%4dx%-4d %2d-bpp  %9.1f  %6.2f | %8.1f  %6.2f\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel,
+			(double)llTime3 / 1000.0, (double)llBytes3 / 1048576.0,
+			(double)llTimeF / 1000.0, (double)llBytesF / 1048576.0);
+		free(pFrames[0]);
+		free(pFrames[1]);
+	}
+	pFB = NULL;
+	FreeBuffers();
+	free(pFused);
+	return 0;
+} /* BenchFused() */
+
+//
+// Compare the exact capture path (FBCapture + FindChangedRegion + shadow
+// copy) against HashCapture() with each supported hash kernel, then see
+// how often each kernel misses a change: a tile is put through a long
+// series of small edits of the kinds which are hardest for a hash (single
+// bits, the same bit in 2 pixels, swapped pixels, 1 pixel shifts, small
+// fills) and the signature before and after each one is compared.
+//
+static int BenchHash(void)
+{
+static const int iBpps[2] = {16, 32};
+static const char *szEdits[5] = {"1 bit", "same bit x2", "swap", "shift", "fill"};
+uint64_t llStart, llTime, llBytes, llSrc, llFrame, u64Old, u64New;
+uint64_t *pExact;
+uint32_t u32Rand = 0x2468ace1;
+int i, k, x, y, iFmt, iFrames, iBands, iEdit, iTileBytes, iChanges;
+int iMisses[5], iEdits[5];
+unsigned char *pFrames[2], *pTile, *pPrev;
+uint16_t *pus, usTemp;
+
+	if (AllocBuffers())
+		return 1;
+	pExact = AllocDirtyMap();
+	printf("Change detection, %dx%d LCD, %dx%d tiles, ~1%% of pixels changing per frame\n", iLCDWidth, iLCDHeight, iTileWidth, iTileHeight);
+	printf("source          kernel      us/frame  MB/frm\n");
+	for (iFmt=0; iFmt<2; iFmt++)
+	{
+		vinfo.xres = iLCDWidth;
+		vinfo.yres = iLCDHeight;
+		vinfo.bits_per_pixel = iBpps[iFmt];
+		iFBPitch = (vinfo.xres * vinfo.bits_per_pixel) / 8;
+		iScreenSize = iFBPitch * vinfo.yres;
+		pFrames[0] = malloc(iScreenSize);
+		pFrames[1] = malloc(iScreenSize);
+		BenchFillFrame(pFrames[0], iScreenSize, 0x4321);
+		memcpy(pFrames[1], pFrames[0], iScreenSize);
+		for (y=iLCDHeight/2-14; y<iLCDHeight/2+14; y++)
+			for (x=iLCDWidth/2-14; x<iLCDWidth/2+14; x++)
+				pFrames[1][y*iFBPitch + (x*vinfo.bits_per_pixel)/8 + 1] ^= 0x80;
+		SelectConverter();
+		llSrc = (uint64_t)iFBPitch * iLCDHeight;
+		llFrame = (uint64_t)iLCDPitch * iLCDHeight;
+
+		pFB = pFrames[1]; FBCapture(pAltScreen); // start in sync
+		iFrames = 0; llBytes = 0;
+		llStart = NanoClock();
+		do
+		{
+			pFB = pFrames[iFrames & 1];
+			FBCapture(pScreen);
+			FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pExact);
+			iBands = CopyChangedBands(pScreen, pAltScreen, pExact);
+			// fb read + pScreen write + compare reads (upper bound) + shadow copy
+			llBytes += llSrc + llFrame + 2*llFrame + 2*iBands;
+			iFrames++;
+			llTime = NanoClock() - llStart;
+		} while (llTime < 500000000LL);
+		printf("%4dx%-4d %2d-bpp  exact     %9.1f  %6.2f\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel,
+			(double)llTime / (1000.0 * iFrames), (double)llBytes / (1048576.0 * iFrames));
+		for (k=0; HashKernels[k].szName != NULL; k++)
+		{
+			if (!HashKernels[k].bSupported)
+				continue;
+			pfnTileHash = HashKernels[k].pfnHash;
+			memset(pTileHash, 0xff, iTilesX * iTilesY * sizeof(uint64_t));
+			pFB = pFrames[1]; HashCapture();
+			iFrames = 0;
+			llStart = NanoClock();
+			do
+			{
+				pFB = pFrames[iFrames & 1];
+				HashCapture();
+				iFrames++;
+				llTime = NanoClock() - llStart;
+			} while (llTime < 500000000LL);
+			for (i=0; i<iTilesY * iTileWords; i++) // the last frames were 1 and 0 (odd count) or 0 and 1
+			{
+				if (pDirtyMap[i] != pExact[i])
+					printf("MISMATCH in the dirty tiles of row %d!\n", i / iTileWords);
+			}
+			// fb read + pScreen write
+			printf("                %-8s  %9.1f  %6.2f\n", HashKernels[k].szName,
+				(double)llTime / (1000.0 * iFrames), (double)(llSrc + llFrame) / 1048576.0);
+		}
+		free(pFrames[0]);
+		free(pFrames[1]);
+	}
+	pFB = NULL;
+
+	// collisions
+	iTileBytes = iTileWidth * iTileHeight * 2;
+	pTile = malloc(iTileBytes);
+	pPrev = malloc(iTileBytes);
+	pus = (uint16_t *)pTile;
+	iChanges = 1000000;
+	printf("Collisions in %d edits of a %dx%d tile:\n", iChanges, iTileWidth, iTileHeight);
+	for (k=0; HashKernels[k].szName != NULL; k++)
+	{
+		if (!HashKernels[k].bSupported)
+			continue;
+		pfnTileHash = HashKernels[k].pfnHash;
+		BenchFillFrame(pTile, iTileBytes, 0x1357);
+		memset(iMisses, 0, sizeof(iMisses));
+		memset(iEdits, 0, sizeof(iEdits));
+		u64Old = TILE_HASH_SEED;
+		for (y=0; y<iTileHeight; y++)
+			u64Old = (*pfnTileHash)(u64Old, &pTile[y * iTileWidth * 2], iTileWidth * 2);
+		llStart = NanoClock();
+		for (i=0; i<iChanges; i++)
+		{
+			memcpy(pPrev, pTile, iTileBytes);
+			u32Rand = u32Rand * 1103515245 + 12345;
+			iEdit = (u32Rand >> 16) % 5;
+			u32Rand = u32Rand * 1103515245 + 12345;
+			x = (u32Rand >> 8) % (iTileBytes / 2);
+			u32Rand = u32Rand * 1103515245 + 12345;
+			y = (u32Rand >> 8) % (iTileBytes / 2);
+			switch (iEdit)
+			{
+				case 0:
+					pus[x] ^= (1 << (u32Rand & 15));
+					break;
+				case 1:
+					pus[x] ^= 0x8000;
+					pus[y ^ (x == y)] ^= 0x8000;
+					break;
+				case 2:
+					usTemp = pus[x]; pus[x] = pus[y]; pus[y] = usTemp;
+					break;
+				case 3: // one line moves right by a pixel
+					x = (x / iTileWidth) * iTileWidth;
+					memmove(&pus[x+1], &pus[x], (iTileWidth-1) * 2);
+					break;
+				case 4: // a few pixels get the same color
+					for (y=0; y<4 && x+y < iTileBytes/2; y++)
+						pus[x+y] = (uint16_t)u32Rand;
+					break;
+			}
+			if (memcmp(pPrev, pTile, iTileBytes) == 0)
+				continue; // the edit didn't change anything
+			iEdits[iEdit]++;
+			// one line at a time, like HashCapture()
+			u64New = TILE_HASH_SEED;
+			for (y=0; y<iTileHeight; y++)
+				u64New = (*pfnTileHash)(u64New, &pTile[y * iTileWidth * 2], iTileWidth * 2);
+			if (u64New == u64Old)
+				iMisses[iEdit]++;
+			u64Old = u64New;
+		}
+		llTime = NanoClock() - llStart;
+		printf("  %-8s", HashKernels[k].szName);
+		for (i=0; i<5; i++)
+			printf(" %s %d/%d%s", szEdits[i], iMisses[i], iEdits[i], (i < 4) ? "," : "");
+		printf(" (%.2f us/tile)\n", (double)llTime / (1000.0 * iChanges));
+	}
+	free(pTile);
+	free(pPrev);
+	free(pExact);
+	FreeBuffers();
+	return 0;
+} /* BenchHash() */
+
+//
+// Time ParallelCapture() with 1 to 4 workers for sources which need
+// different amounts of work per line (copy, convert, 2:1 shrink, scale).
+// Each frame has a small moving change (~1% of the pixels); the dirty
+// tiles and the shadow copy are checked against the serial code.
+//
+static int BenchWorkers(void)
+{
+static const int iSources[][4] = {{320,240,16,SCALE_AUTO}, {320,240,32,SCALE_AUTO}, {640,480,32,SCALE_AUTO},
+	{1280,720,32,SCALE_BOX}, {1920,1080,32,SCALE_BOX}, {1920,1080,32,SCALE_BILINEAR}};
+static const char *szFilter[3] = {"", "box", "bilinear"};
+uint64_t *pRef;
+unsigned char *pFrames[2], *pRefShadow;
+uint64_t llStart, llTime, llOne = 0;
+int n, x, y, iSrc, iFrames, iMaxWorkers, iSaveFilter = iScaleFilter, bError = 0;
+
+	if (AllocBuffers())
+		return 1;
+	pRef = AllocDirtyMap();
+	pRefShadow = malloc(iLCDPitch * iLCDHeight);
+	iMaxWorkers = (MAX_WORKERS < 4) ? MAX_WORKERS : 4;
+	if (InitWorkers(iMaxWorkers))
+		return 1;
+	printf("Capture + compare, %dx%d LCD, %dx%d tiles, %ld CPUs online, ms/frame (speedup)\n", iLCDWidth, iLCDHeight,
+		iTileWidth, iTileHeight, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("source                     ");
+	for (n=1; n<=iMaxWorkers; n++)
+		printf("    %d worker%s", n, (n == 1) ? " " : "s");
+	printf("\n");
+	for (iSrc=0; iSrc<(int)(sizeof(iSources)/sizeof(iSources[0])); iSrc++)
+	{
+		vinfo.xres = iSources[iSrc][0];
+		vinfo.yres = iSources[iSrc][1];
+		vinfo.bits_per_pixel = iSources[iSrc][2];
+		iScaleFilter = iSources[iSrc][3];
+		iFBPitch = (vinfo.xres * vinfo.bits_per_pixel) / 8;
+		iScreenSize = iFBPitch * vinfo.yres;
+		pFrames[0] = malloc(iScreenSize);
+		pFrames[1] = malloc(iScreenSize);
+		BenchFillFrame(pFrames[0], iScreenSize, 0x4321);
+		memcpy(pFrames[1], pFrames[0], iScreenSize);
+		for (y=vinfo.yres/2-vinfo.yres/20; y<vinfo.yres/2+vinfo.yres/20; y++)
+			for (x=vinfo.xres/2-vinfo.xres/20; x<vinfo.xres/2+vinfo.xres/20; x++)
+				pFrames[1][y*iFBPitch + (x*vinfo.bits_per_pixel)/8 + 1] ^= 0x80;
+		SelectConverter();
+		printf("%4dx%-4d %2d-bpp %-8s ", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, szFilter[iScaleFilter]);
+		// what the serial code makes of frame 1 after frame 0
+		pFB = pFrames[0]; FBCapture(pAltScreen);
+		pFB = pFrames[1]; FBCapture(pScreen);
+		FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pRef);
+		memcpy(pRefShadow, pScreen, iLCDPitch * iLCDHeight);
+		for (n=1; n<=iMaxWorkers; n++)
+		{
+			iPoolActive = n;
+			pFB = pFrames[1]; FBCapture(pAltScreen);
+			iFrames = 0;
+			llStart = NanoClock();
+			do
+			{
+				pFB = pFrames[iFrames & 1];
+				ParallelCapture();
+				iFrames++;
+				llTime = NanoClock() - llStart;
+			} while (llTime < 500000000LL || !(iFrames & 1)); // end on frame 0
+			pFB = pFrames[1];
+			ParallelCapture(); // the frame the reference was made from
+			if (memcmp(pDirtyMap, pRef, iTilesY * iTileWords * sizeof(uint64_t)) != 0 ||
+				memcmp(pAltScreen, pRefShadow, iLCDPitch * iLCDHeight) != 0)
+			{
+				printf("\nERROR: %d workers don't match the serial capture!\n", n);
+				bError = 1;
+			}
+			llTime /= iFrames;
+			if (n == 1)
+				llOne = llTime;
+			printf(" %5.2f (%.1fx)", (double)llTime / 1000000.0, (double)llOne / (double)llTime);
+		}
+		printf("\n");
+		free(pFrames[0]);
+		free(pFrames[1]);
+	}
+	StopWorkers();
+	iPoolActive = 0;
+	iScaleFilter = iSaveFilter;
+	pFB = NULL;
+	free(pRef);
+	free(pRefShadow);
+	FreeBuffers();
+	return bError;
+} /* BenchWorkers() */
+
+//
+// Frames handed over by a --shm client vs the same frames read from fb0:
+// a box moves over a static background, and the client reports the box's
+// old and new places (or nothing, i.e. the whole frame). Each way has to
+// find the same dirty tiles and end up with the same LCD image.
+//
+#define SHM_BENCH_FRAMES 300
+#define SHM_BENCH_BOX 32
+static int BenchShm(void)
+{
+BBCP_SLOT *pSlot;
+unsigned char *pBack, *pSlotPixels, *pRefImage;
+uint64_t *pRefMaps, llStart, llTime[3];
+BBCP_RECT rects[2];
+int sv[2], i, f, x, y, iPass, iBoxX = 0, iBoxY = 0, iMapSize, bError = 0;
+static const char *szPass[3] = {"fb0 capture + compare", "shm, changed rectangles", "shm, whole frames"};
+
+	if (AllocBuffers())
+		return 1;
+	vinfo.xres = iLCDWidth;
+	vinfo.yres = iLCDHeight;
+	vinfo.bits_per_pixel = 16;
+	iFBPitch = iLCDPitch;
+	iScreenSize = iFBPitch * vinfo.yres;
+	SelectConverter();
+	pFB = malloc(iScreenSize);
+	pBack = malloc(iScreenSize);
+	pRefImage = malloc(iScreenSize);
+	iMapSize = iTilesY * iTileWords;
+	pRefMaps = malloc(SHM_BENCH_FRAMES * iMapSize * sizeof(uint64_t));
+	BenchFillFrame(pBack, iScreenSize, 0x1357);
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) || ShmAttach(sv[0]))
+	{
+		fprintf(stderr, "Unable to set up the frame ring\n");
+		return 1;
+	}
+	close(sv[0]);
+	close(sv[1]); // the "client" is us; the fds it was sent are closed with the socket
+	printf("%d frames of a %dx%d box moving over %dx%d, %dx%d tiles\n", SHM_BENCH_FRAMES, SHM_BENCH_BOX, SHM_BENCH_BOX,
+		iLCDWidth, iLCDHeight, iTileWidth, iTileHeight);
+	printf("source                     ms/frame\n");
+	for (iPass=0; iPass<3; iPass++)
+	{
+		memcpy(pFB, pBack, iScreenSize);
+		memcpy(pScreen, pBack, iScreenSize); // the LCD starts out matching
+		memcpy(pAltScreen, pBack, iScreenSize);
+		iBoxX = iBoxY = 0;
+		llTime[iPass] = 0;
+		for (f=0; f<SHM_BENCH_FRAMES; f++)
+		{
+			// the source draws the frame (not timed)
+			rects[0].x = iBoxX; rects[0].y = iBoxY;
+			for (y=iBoxY; y<iBoxY+SHM_BENCH_BOX; y++) // erase the old box
+				memcpy(&pFB[y*iFBPitch + iBoxX*2], &pBack[y*iFBPitch + iBoxX*2], SHM_BENCH_BOX*2);
+			iBoxX = (f * 7) % (iLCDWidth - SHM_BENCH_BOX);
+			iBoxY = (f * 3) % (iLCDHeight - SHM_BENCH_BOX);
+			rects[1].x = iBoxX; rects[1].y = iBoxY;
+			rects[0].w = rects[0].h = rects[1].w = rects[1].h = SHM_BENCH_BOX;
+			for (y=iBoxY; y<iBoxY+SHM_BENCH_BOX; y++)
+				for (x=iBoxX; x<iBoxX+SHM_BENCH_BOX; x++)
+					*(uint16_t *)&pFB[y*iFBPitch + x*2] = (uint16_t)(0xf81f ^ f);
+			if (iPass) // as the client would: draw into the next buffer and submit
+			{
+				i = pShm->u32Head % BBCP_SLOTS;
+				pSlot = &pShm->slot[i];
+				pSlotPixels = (unsigned char *)pShm + iShmHeader + i * iShmSlotSize;
+				memcpy(pSlotPixels, pFB, iScreenSize);
+				pSlot->u32Rects = (iPass == 1) ? 2 : 0;
+				memcpy(pSlot->rects, rects, sizeof(rects));
+				pShm->u32Head++;
+			}
+			llStart = NanoClock();
+			if (iPass == 0)
+			{
+				FBCapture(pScreen);
+				FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pDirtyMap);
+				CopyChangedBands(pScreen, pAltScreen, pDirtyMap);
+			}
+			else
+				ShmCapture();
+			llTime[iPass] += NanoClock() - llStart;
+			if (iPass == 0)
+				memcpy(&pRefMaps[f * iMapSize], pDirtyMap, iMapSize * sizeof(uint64_t));
+			else if (memcmp(&pRefMaps[f * iMapSize], pDirtyMap, iMapSize * sizeof(uint64_t)) != 0)
+			{
+				printf("ERROR: frame %d of '%s' has different dirty tiles than fb0\n", f, szPass[iPass]);
+				bError = 1;
+			}
+		}
+		if (iPass == 0)
+			memcpy(pRefImage, pAltScreen, iScreenSize);
+		else if (memcmp(pRefImage, pScreen, iScreenSize) != 0)
+		{
+			printf("ERROR: the LCD image of '%s' doesn't match fb0\n", szPass[iPass]);
+			bError = 1;
+		}
+		printf("%-26s %7.3f", szPass[iPass], (double)llTime[iPass] / (SHM_BENCH_FRAMES * 1000000.0));
+		if (iPass)
+			printf(" (%.1fx)", (double)llTime[0] / (double)llTime[iPass]);
+		printf("\n");
+	}
+	munmap(pShm, iShmSize);
+	close(fdShmFrame);
+	close(fdShmFree);
+	pShm = NULL;
+	free(pFB);
+	pFB = NULL;
+	free(pBack);
+	free(pRefImage);
+	free(pRefMaps);
+	FreeBuffers();
+	return bError;
+} /* BenchShm() */
+
+//
+// Time the general scaler for common fb0 sizes; the SIMD output is
+// checked against the C version
+//
+static int BenchScale(void)
+{
+static const int iSizes[][2] = {{640,480},{800,600},{1280,720},{1280,1024},{1920,1080}};
+static const int iBpps[2] = {16, 32};
+uint64_t llStart, llTime;
+int i, j, f, y, iFrames, iSaveFilter = iScaleFilter;
+unsigned char *pRef;
+VACCUM pfnAccum;
+VBLEND pfnBlend;
+
+	if (AllocBuffers())
+		return 1;
+	pRef = malloc(iLCDPitch * iLCDHeight);
+	printf("Scaling fb0 to %dx%d%s\n", iLCDWidth, iLCDHeight, bLetterbox ? " (letterboxed)" : "");
+	printf("source            box ms   fps | bilinear ms   fps\n");
+	for (i=0; i<(int)(sizeof(iSizes)/sizeof(iSizes[0])); i++)
+	{
+		for (j=0; j<2; j++)
+		{
+			vinfo.xres = iSizes[i][0];
+			vinfo.yres = iSizes[i][1];
+			vinfo.bits_per_pixel = iBpps[j];
+			iFBPitch = (vinfo.xres * vinfo.bits_per_pixel) / 8;
+			iScreenSize = iFBPitch * vinfo.yres;
+			pFB = malloc(iScreenSize);
+			BenchFillFrame(pFB, iScreenSize, 0x2468);
+			printf("%4dx%-4d %2d-bpp ", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+			for (f=SCALE_BOX; f<=SCALE_BILINEAR; f++)
+			{
+				iScaleFilter = f;
+				if (InitScaler())
+				{
+					printf("      n/a       ");
+					continue;
+				}
+				// reference image from the C kernels
+				pfnAccum = pfnVAccum; pfnBlend = pfnVBlend;
+				pfnVAccum = (vinfo.bits_per_pixel == 16) ? VAccum16C : VAccum32C;
+				pfnVBlend = (vinfo.bits_per_pixel == 16) ? VBlend16C : VBlend32C;
+				for (y=0; y<iLCDHeight; y++)
+					ConvertLineScaled(&pRef[y*iLCDPitch], y);
+				pfnVAccum = pfnAccum; pfnVBlend = pfnBlend;
+				iFrames = 0;
+				llStart = NanoClock();
+				do
+				{
+					for (y=0; y<iLCDHeight; y++)
+						ConvertLineScaled(&pScreen[y*iLCDPitch], y);
+					iFrames++;
+					llTime = NanoClock() - llStart;
+				} while (llTime < 500000000LL);
+				llTime /= iFrames;
+				printf("%s %7.2f %5d ", (f == SCALE_BOX) ? "  " : "|   ", (double)llTime / 1000000.0, (int)(1000000000LL / llTime));
+				if (memcmp(pRef, pScreen, iLCDPitch * iLCDHeight) != 0)
+					printf("(SIMD MISMATCH) ");
+			}
+			printf("\n");
+			free(pFB);
+		}
+	}
+	pFB = NULL;
+	iScaleFilter = iSaveFilter;
+	free(pRef);
+	FreeBuffers();
+	return 0;
+} /* BenchScale() */
+
+//
+// The 2:1 shrink code which was used before the 2x2 box filter;
+// kept to compare the speed of the new kernels against
+//
+static void ShrinkLegacy16(unsigned char *pDest, int y)
+{
+uint32_t *s, *d, u32Magic, u32_1, u32_2;
+int x;
+
+	u32Magic = 0xf7def7de;
+	s = (uint32_t *)&pFB[y*2*iFBPitch];
+	d = (uint32_t *)pDest;
+	for (x=0; x<iLCDWidth; x+=2)
+	{
+	// average horizontally
+		u32_1 = s[0];
+		u32_2 = s[1];
+		u32_1 = (u32_1 & u32Magic) >> 1;
+		u32_2 = (u32_2 & u32Magic) >> 1;
+		u32_1 += (u32_1 << 16);
+		u32_2 += (u32_2 >> 16); // average
+		u32_1 = (u32_1 >> 16) | (u32_2 << 16);
+		*d++ = u32_1;
+		s += 2;
+	} // for x
+} /* ShrinkLegacy16() */
+
+static void ShrinkLegacy32(unsigned char *pDest, int y)
+{
+uint32_t u32, *pSrc;
+uint16_t u16, *pus;
+int x;
+
+	pSrc = (uint32_t *)&pFB[iFBPitch * y * 2];
+	pus = (uint16_t *)pDest;
+	for (x=0; x<iLCDWidth; x++)
+	{
+		u32 = pSrc[0];
+		pSrc += 2;
+		u16 = ((u32 >> 3) & 0x1f) | ((u32 >> 5) & 0x7e0) |
+		((u32 >> 8) & 0xf800);
+		*pus++ = u16;
+	}
+} /* ShrinkLegacy32() */
+
+//
+// Check the 2:1 shrink kernels against known results (golden values)
+// and against each other, then time them
+//
+static int BenchShrink(void)
+{
+typedef struct tag_SHRINKTEST
+{
+	const char *szName;
+	SHRINK pfnShrink;
+	int iBpp;
+} SHRINKTEST;
+static const SHRINKTEST Kernels[] = {
+	{"c", Shrink16C, 16}, {"c", Shrink32C, 32},
+#if defined( __x86_64__ ) || defined( __i386__ )
+	{"sse2", Shrink16SSE2, 16}, {"sse2", Shrink32SSE2, 32},
+#endif
+#if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+	{"neon", Shrink16NEON, 16}, {"neon", Shrink32NEON, 32},
+#endif
+	{NULL, NULL, 0}
+};
+// 2x2 blocks (top-left, top-right, bottom-left, bottom-right) and the expected average
+static const uint16_t usGolden16[][5] = {
+	{0xffff, 0x0000, 0xffff, 0x0000, 0x8410}, // white + black = mid gray
+	{0xf800, 0xf800, 0x001f, 0x001f, 0x8010}, // red over blue
+	{0x07e0, 0x0000, 0x0000, 0x0000, 0x0200}, // 1/4 green: (63+2)/4 = 16
+	{0x0841, 0x0841, 0x0000, 0x0000, 0x0821}, // R,B: (1+1+2)/4 rounds up to 1, G: (2+2+2)/4 = 1
+	{0x0841, 0x0000, 0x0000, 0x0000, 0x0020}, // R,B: (1+2)/4 rounds down to 0, G: (2+2)/4 = 1
+	{0x1234, 0x1234, 0x1234, 0x1234, 0x1234}, // flat color is unchanged
+};
+static const uint32_t u32Golden32[][5] = {
+	{0xffffff, 0x000000, 0xffffff, 0x000000, 0x8410}, // 8-bit average 128
+	{0xff0000, 0xff0000, 0x0000ff, 0x0000ff, 0x8010}, // 128,0,128
+	{0x00ff00, 0x000000, 0x000000, 0x000000, 0x0200}, // (255+2)/4 = 64
+	{0x070707, 0x070707, 0x080808, 0x080808, 0x0841}, // 7.5 rounds to 8
+	{0x123456, 0x123456, 0x123456, 0x123456, 0x11aa}, // flat color
+};
+unsigned char *pSrc, *pRef, *pOut;
+uint16_t usOut[8];
+uint32_t u32Row[2][16];
+uint64_t llStart, llTime;
+int i, j, y, iFrames, iErrors = 0, iPitch;
+const int iCX = 320, iCY = 240; // output size
+
+	iPitch = iCX * 2 * 4; // source pitch big enough for 32-bpp
+	pSrc = malloc(iPitch * iCY * 2);
+	pRef = malloc(iCX * 2 * iCY);
+	pOut = malloc(iCX * 2 * iCY);
+	BenchFillFrame(pSrc, iPitch * iCY * 2, 0x9876);
+	for (i=0; Kernels[i].szName != NULL; i++)
+	{
+		if (!KernelSupported(Kernels[i].szName) && strcmp(Kernels[i].szName, "c") != 0)
+			continue;
+		// golden values; each test block is repeated so the SIMD loops are used too
+		if (Kernels[i].iBpp == 16)
+		{
+			for (j=0; j<(int)(sizeof(usGolden16)/sizeof(usGolden16[0])); j++)
+			{
+				for (y=0; y<8; y++)
+				{
+					((uint16_t *)u32Row[0])[y*2] = usGolden16[j][0]; ((uint16_t *)u32Row[0])[y*2+1] = usGolden16[j][1];
+					((uint16_t *)u32Row[1])[y*2] = usGolden16[j][2]; ((uint16_t *)u32Row[1])[y*2+1] = usGolden16[j][3];
+				}
+				(*Kernels[i].pfnShrink)((unsigned char *)u32Row[0], (unsigned char *)u32Row[1], usOut, 8);
+				for (y=0; y<8; y++)
+				{
+					if (usOut[y] != usGolden16[j][4])
+					{
+						printf("%s 16-bpp golden test %d failed: got 0x%04x, expected 0x%04x\n", Kernels[i].szName, j, usOut[y], usGolden16[j][4]);
+						iErrors++;
+						break;
+					}
+				}
+			}
+		}
+		else
+		{
+			for (j=0; j<(int)(sizeof(u32Golden32)/sizeof(u32Golden32[0])); j++)
+			{
+				for (y=0; y<8; y++)
+				{
+					u32Row[0][y*2] = u32Golden32[j][0]; u32Row[0][y*2+1] = u32Golden32[j][1];
+					u32Row[1][y*2] = u32Golden32[j][2]; u32Row[1][y*2+1] = u32Golden32[j][3];
+				}
+				(*Kernels[i].pfnShrink)((unsigned char *)u32Row[0], (unsigned char *)u32Row[1], usOut, 8);
+				for (y=0; y<8; y++)
 				{
-					u32 = pSrc[0];
-					pSrc += 2;					u16 = ((u32 >> 3) & 0x1f) | ((u32 >> 5) & 0x7e0) |
-					((u32 >> 8) & 0xf800);
-					*pDest++ = u16;
+					if (usOut[y] != u32Golden32[j][4])
+					{
+						printf("%s 32-bpp golden test %d failed: got 0x%04x, expected 0x%04x\n", Kernels[i].szName, j, usOut[y], (int)u32Golden32[j][4]);
+						iErrors++;
+						break;
+					}
 				}
 			}
 		}
+		// a full random image must match the C kernel exactly (odd width exercises the tails)
+		for (y=0; y<iCY; y++)
+		{
+			(Kernels[i].iBpp == 16 ? Shrink16C : Shrink32C)(&pSrc[y*2*iPitch], &pSrc[(y*2+1)*iPitch], (uint16_t *)&pRef[y*iCX*2], iCX-3);
+			(*Kernels[i].pfnShrink)(&pSrc[y*2*iPitch], &pSrc[(y*2+1)*iPitch], (uint16_t *)&pOut[y*iCX*2], iCX-3);
+			if (memcmp(&pRef[y*iCX*2], &pOut[y*iCX*2], (iCX-3)*2) != 0)
+			{
+				printf("%s %d-bpp doesn't match the C kernel on line %d\n", Kernels[i].szName, Kernels[i].iBpp, y);
+				iErrors++;
+				break;
+			}
+		}
+	}
+	printf("2:1 shrink golden tests: %s\n", iErrors ? "FAILED" : "passed");
+
+	// throughput of 640x480 -> 320x240
+	printf("640x480 -> 320x240   us/frame   Mpix/s (source)\n");
+	pFB = pSrc;
+	iLCDWidth = iCX;
+	for (j=16; j<=32; j+=16)
+	{
+		iFBPitch = 640 * j / 8;
+		for (i=-1; Kernels[i < 0 ? 0 : i].szName != NULL; i++)
+		{
+			if (i >= 0 && (Kernels[i].iBpp != j || (!KernelSupported(Kernels[i].szName) && strcmp(Kernels[i].szName, "c") != 0)))
+				continue;
+			iFrames = 0;
+			llStart = NanoClock();
+			do
+			{
+				for (y=0; y<iCY; y++)
+				{
+					if (i < 0) // the old code
+						(j == 16 ? ShrinkLegacy16 : ShrinkLegacy32)(&pOut[y*iCX*2], y);
+					else
+						(*Kernels[i].pfnShrink)(&pFB[y*2*iFBPitch], &pFB[(y*2+1)*iFBPitch], (uint16_t *)&pOut[y*iCX*2], iCX);
+				}
+				iFrames++;
+				llTime = NanoClock() - llStart;
+			} while (llTime < 500000000LL);
+			printf("  %2d-bpp %-8s %10.1f %8.1f\n", j, (i < 0) ? "old" : Kernels[i].szName,
+				(double)llTime / (1000.0 * iFrames), (640.0 * 480.0 * iFrames * 1000.0) / (double)llTime);
+		}
 	}
-	else // 1:1
+	pFB = NULL;
+	free(pSrc); free(pRef); free(pOut);
+	return iErrors != 0;
+} /* BenchShrink() */
+#endif // !_RPIZERO_
+
+//
+// Compare sending dirty tiles one at a time with the merged rectangles
+// of --coalesce for typical change patterns, using the SPI bus model
+//
+static int BenchCoalesce(void)
+{
+static const char *szPatterns[] = {"1 row of tiles", "3 rows (scroll band)", "full screen", "25% random tiles", "checkerboard", "2x2 tiles"};
+uint64_t llTileTime, llRectTime, llTileBytes, llRectBytes, llStart, llTime;
+int i, j, xc, yc, iTiles, iRects, iLoops;
+uint32_t u32Seed = 0x1357;
+
+	if (AllocBuffers())
+		return 1;
+	printf("SPI bus model: %d Hz, %d ns + %d command bytes per transaction\n", iSPIFreq, iSPIOverhead, SPI_WINDOW_BYTES);
+	printf("%dx%d LCD, %dx%d tiles\n", iLCDWidth, iLCDHeight, iTileWidth, iTileHeight);
+	printf("pattern               tiles   us  | rects   us  | saved  merge us\n");
+	for (i=0; i<(int)(sizeof(szPatterns)/sizeof(szPatterns[0])); i++)
 	{
-		if (vinfo.bits_per_pixel == 16)
+		memset(pDirtyMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+		for (yc=0; yc<iTilesY; yc++)
 		{
-			memcpy(pScreen, pFB, iFBPitch * vinfo.yres);
+			for (xc=0; xc<iTilesX; xc++)
+			{
+				switch (i)
+				{
+					case 0: j = (yc == 0); break;
+					case 1: j = (yc >= iTilesY/2 - 1 && yc <= iTilesY/2 + 1); break;
+					case 2: j = 1; break;
+					case 3: u32Seed = u32Seed * 1103515245 + 12345; j = ((u32Seed >> 16) & 3) == 0; break;
+					case 4: j = ((xc + yc) & 1); break;
+					default: j = (xc >= 1 && xc <= 2 && yc >= 1 && yc <= 2); break;
+				}
+				if (j)
+					pDirtyMap[yc * iTileWords + (xc >> 6)] |= (1ULL << (xc & 63));
+			}
 		}
-		else // need to convert the pixels
+		// one transaction per tile
+		iTiles = 0; llTileBytes = 0;
+		for (yc=0; yc<iTilesY; yc++)
+			for (xc=0; xc<iTilesX; xc++)
+				if (pDirtyMap[yc * iTileWords + (xc >> 6)] & (1ULL << (xc & 63)))
+				{
+					iTiles++;
+					llTileBytes += 2 * (((xc+1)*iTileWidth > iLCDWidth) ? iLCDWidth - xc*iTileWidth : iTileWidth) *
+						(((yc+1)*iTileHeight > iLCDHeight) ? iLCDHeight - yc*iTileHeight : iTileHeight);
+				}
+		llTileTime = SPITransferTime(iTiles, llTileBytes);
+		// merged
+		iRects = BuildRects(pDirtyMap, NULL, pRectList);
+		llRectBytes = 0;
+		for (j=0; j<iRects; j++)
+			llRectBytes += pRectList[j].w * pRectList[j].h * 2;
+		llRectTime = SPITransferTime(iRects, llRectBytes);
+		iLoops = 0;
+		llStart = NanoClock();
+		do
 		{
-		uint32_t u32, *pSrc;
-		int x, y;
-		uint16_t u16, *pDest;
+			BuildRects(pDirtyMap, NULL, pRectList);
+			iLoops++;
+			llTime = NanoClock() - llStart;
+		} while (llTime < 100000000LL);
+		printf("%-20s %5d %6d | %5d %6d | %4.1f%% %6.2f\n", szPatterns[i], iTiles, (int)(llTileTime / 1000), iRects, (int)(llRectTime / 1000),
+			llTileTime ? 100.0 * (double)(llTileTime - llRectTime) / (double)llTileTime : 0.0, (double)llTime / (1000.0 * iLoops));
+		if (llRectBytes != llTileBytes)
+			printf("  error: the rectangles cover %d bytes, the tiles %d\n", (int)llRectBytes, (int)llTileBytes);
+	}
+	FreeBuffers();
+	return 0;
+} /* BenchCoalesce() */
+
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+//
+// Replay a trace recorded with --record through the capture conversion,
+// FindChangedRegion() and the output stage (virtual LCD) for a range of
+// tile sizes and send strategies. The trace frame is used as fb0.
+// Frame latency is the CPU time from capture to the last transfer plus
+// the modeled bus time; fps is how fast frames could go back to back.
+//
+static int BenchReplay(void)
+{
+static const int iTileSizes[][2] = {{0,0},{32,16},{32,32},{64,30},{80,40},{160,60}}; // 0 = --tile / default
+static const char *szStrategy[9] = {"tiles", "tight", "coalesce", "tight+coal", "budget", "interlace", "hwscroll", "hash", "tight+fill"};
+unsigned char *pTrace, *pData, *pEnd, *pFrame, *pTile;
+TRACEHDR *pHdr;
+TRACEFRAME *pTF;
+TRACETILE *pTT;
+uint64_t *pLatency, *pExact;
+uint64_t llStart, llBus, llTotal, llBytes, llExact, llLast = 0;
+struct stat st;
+int iFile, i, y, iSize, iStrategy, iFrames, iTiles, iTileW, iTileH, iStale, iCollisions, bError = 0;
 
-			for (y=0; y<LCD_CY; y++)
+	iFile = open(szTrace, O_RDONLY);
+	if (iFile < 0 || fstat(iFile, &st) || st.st_size < (off_t)sizeof(TRACEHDR))
+	{
+		fprintf(stderr, "Unable to open the trace file %s\n", szTrace);
+		return 1;
+	}
+	pTrace = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, iFile, 0);
+	close(iFile);
+	if (pTrace == MAP_FAILED)
+		return 1;
+	pHdr = (TRACEHDR *)pTrace;
+	if (memcmp(pHdr->szMagic, TRACE_MAGIC, 4) != 0 || pHdr->u16Version != TRACE_VERSION || pHdr->u32Frames == 0)
+	{
+		fprintf(stderr, "%s is not a valid trace file\n", szTrace);
+		munmap(pTrace, st.st_size);
+		return 1;
+	}
+	pEnd = pTrace + st.st_size;
+	iTileW = iTileWidth; iTileH = iTileHeight; // requested size
+	iLCDWidth = pHdr->u16Width;
+	iLCDHeight = pHdr->u16Height;
+	// The trace frame becomes a 16-bpp fb0 of the same size
+	vinfo.xres = iLCDWidth;
+	vinfo.yres = iLCDHeight;
+	vinfo.bits_per_pixel = 16;
+	iFBPitch = iLCDWidth * 2;
+	iScreenSize = iFBPitch * iLCDHeight;
+	pFrame = malloc(iScreenSize);
+	pLatency = malloc(pHdr->u32Frames * sizeof(uint64_t));
+	SelectConverter();
+	pFB = pFrame;
+	for (pData = pTrace + sizeof(TRACEHDR), i=0; i<(int)pHdr->u32Frames && pData + sizeof(TRACEFRAME) <= pEnd; i++)
+	{
+		llLast = ((TRACEFRAME *)pData)->llTime;
+		pData += sizeof(TRACEFRAME) + ((TRACEFRAME *)pData)->u32Size;
+	}
+	printf("Trace %s: %dx%d, %d frames over %.1f seconds\n", szTrace, iLCDWidth, iLCDHeight, i, (double)llLast / 1000000000.0);
+	printf("SPI bus model: %d Hz, %d ns + %d command bytes per transaction\n", iSPIFreq, iSPIOverhead, SPI_WINDOW_BYTES);
+	printf("tiles    strategy     fps   p50 us   p99 us  xfers/frm  KB/frm  max wait\n");
+	pSink = &LCDSinks[sizeof(LCDSinks)/sizeof(LCDSinks[0]) - 2]; // virtual
+	for (iSize=0; iSize<(int)(sizeof(iTileSizes)/sizeof(iTileSizes[0])); iSize++)
+	{
+		if (iSize == 0)
+			SetTileSize(iTileW, iTileH);
+		else if (iTileSizes[iSize][0] == iTileW && iTileSizes[iSize][1] == iTileH)
+			continue; // already done
+		else
+			SetTileSize(iTileSizes[iSize][0], iTileSizes[iSize][1]);
+		for (iStrategy=0; iStrategy<9; iStrategy++)
+		{
+			bTightRects = ((iStrategy < 4) && (iStrategy & 1)) || iStrategy == 8;
+			bCoalesce = (iStrategy < 4) && (iStrategy & 2);
+			bBudget = (iStrategy == 4);
+			bInterlace = (iStrategy == 5);
+			bInterlaced = iField = 0;
+			bHWScroll = (iStrategy == 6);
+			bHashTiles = (iStrategy == 7);
+			bFillTiles = (iStrategy == 8);
+			if (AllocScroll()) // also resets the scroll offset
+				return 1;
+			if (AllocBuffers() || (*pSink->pfnInit)(0, 0, iSPIFreq, 0, 0, 0))
+				return 1;
+			pExact = AllocDirtyMap();
+			llExact = 0; iCollisions = 0;
+			memset(pFrame, 0, iScreenSize);
+			memset(pAltScreen, 0, iLCDPitch * iLCDHeight); // the LCD starts out black
+			if (bHashTiles)
+				HashCapture();
+			iBusTransactions = 0; llBusBytes = llBusTime = 0;
+			llTotal = 0;
+			pData = pTrace + sizeof(TRACEHDR);
+			for (iFrames=0; iFrames<(int)pHdr->u32Frames && pData + sizeof(TRACEFRAME) <= pEnd; iFrames++)
 			{
-				pSrc = (uint32_t *)&pFB[iFBPitch * y];
-				pDest = (uint16_t *)&pScreen[iLCDPitch * y];
-				for (x=0; x<LCD_CX; x++)
+				// draw the next frame into our fake fb0
+				pTF = (TRACEFRAME *)pData;
+				pData += sizeof(TRACEFRAME);
+				if (pData + pTF->u32Size > pEnd)
+					break;
+				for (pTile = pData, i=0; i<(int)pTF->u32Tiles; i++)
+				{
+					pTT = (TRACETILE *)pTile;
+					for (y=0; y<pTT->h; y++)
+						memcpy(&pFrame[(pTT->y + y) * iFBPitch + pTT->x * 2], &pTile[sizeof(TRACETILE) + y * pTT->w * 2], pTT->w * 2);
+					pTile += (sizeof(TRACETILE) + pTT->w * pTT->h * 2 + 7) & ~7;
+				}
+				pData += pTF->u32Size;
+				// the same steps as CopyLoop()
+				llBus = llBusTime;
+				llStart = NanoClock();
+				if (bHashTiles)
+				{
+					iTiles = HashCapture();
+					if (iTiles)
+						SendChanges(pScreen, pDirtyMap, NULL, iTiles);
+				}
+				else
 				{
-					u32 = *pSrc++;
-					u16 = ((u32 >> 3) & 0x1f) | ((u32 >> 5) & 0x7e0) |
-					((u32 >> 8) & 0xf800);
-					*pDest++ = u16;
+					FBCapture(pScreen);
+					if (bHWScroll)
+						ScrollFrame(pScreen, pAltScreen);
+					iTiles = FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pDirtyMap);
+					if (iTiles)
+					{
+						if (bTightRects)
+							FindTileBounds(pScreen, pAltScreen, pDirtyMap, pTileRects);
+						CopyChangedBands(pScreen, pAltScreen, pDirtyMap);
+					}
+					if (iTiles || iPendingTiles)
+						SendChanges(pAltScreen, pDirtyMap, bTightRects ? pTileRects : NULL, iTiles);
 				}
+				pLatency[iFrames] = NanoClock() - llStart + (llBusTime - llBus);
+				llTotal += pLatency[iFrames];
+				if (bHashTiles) // not timed: which changed tiles did the signatures miss?
+				{
+					llExact += FindChangedRegion(pScreen, pAltScreen, iLCDWidth, iLCDHeight, iLCDPitch, iTileWidth, iTileHeight, pExact);
+					for (i=0; i<iTilesY * iTileWords; i++)
+						iCollisions += __builtin_popcountll(pExact[i] & ~pDirtyMap[i]);
+					memcpy(pAltScreen, pScreen, iLCDPitch * iLCDHeight);
+				}
+			}
+			iStale = iStaleMax;
+			memset(pDirtyMap, 0, iTilesY * iTileWords * sizeof(uint64_t));
+			while (iPendingTiles) // finish what the budget held back
+				SendChanges(pAltScreen, pDirtyMap, NULL, 0);
+			VirtualSnapshot((uint16_t *)pScreen); // what the panel shows
+			if (memcmp(pScreen, pFrame, iScreenSize) != 0)
+			{
+				printf("ERROR: the LCD doesn't match the last frame of the trace!\n");
+				bError = 1;
+			}
+			qsort(pLatency, iFrames, sizeof(uint64_t), CompareU64);
+			llBytes = llBusBytes;
+			if (iFrames)
+				printf("%3dx%-3d  %-10s %6.1f %8.1f %8.1f %10.1f %7.1f  %8d\n", iTileWidth, iTileHeight, szStrategy[iStrategy],
+					llTotal ? (double)iFrames * 1000000000.0 / (double)llTotal : 0.0,
+					(double)pLatency[iFrames / 2] / 1000.0, (double)pLatency[(iFrames * 99) / 100] / 1000.0,
+					(double)iBusTransactions / iFrames, (double)llBytes / (1024.0 * iFrames), iStale);
+			iStaleMax = iDeferred = 0;
+			llStaleSum = llStaleTiles = 0;
+			if (bHWScroll)
+				printf("                  scrolled %d of %d frames, ~%d KB/frame saved\n", iScrollHits, iScrollFrames,
+					iFrames ? (int)(llScrollSaved / (1024 * iFrames)) : 0);
+			if (bHashTiles)
+				printf("                  %d hash collisions in %d changed tiles\n", iCollisions, (int)llExact);
+			if (bFillTiles)
+				printf("                  %d of %d rectangles solid, %d KB/frame sent from the fill line\n", iFillRects, iFillRects + iPixelRects,
+					iFrames ? (int)(llFillBytes / (1024 * iFrames)) : 0);
+			iFillRects = iPixelRects = 0;
+			llFillBytes = 0;
+			free(pExact);
+			iScrollHits = iScrollFrames = 0;
+			llScrollSaved = 0;
+			(*pSink->pfnShutdown)();
+			FreeBuffers();
+		}
+	}
+	pFB = NULL;
+	free(pFrame);
+	free(pLatency);
+	munmap(pTrace, st.st_size);
+	return bError;
+} /* BenchReplay() */
+#endif // !_RPIZERO_
+
+//
+// Run one of the built-in benchmarks; these don't touch the LCD
+//
+static int RunBench(char *szName)
+{
+	if (strcmp(szName, "compare") == 0)
+		return BenchCompare();
+	if (strcmp(szName, "coalesce") == 0)
+		return BenchCoalesce();
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+	if (strcmp(szName, "fused") == 0)
+		return BenchFused();
+	if (strcmp(szName, "hash") == 0)
+		return BenchHash();
+	if (strcmp(szName, "workers") == 0)
+		return BenchWorkers();
+	if (strcmp(szName, "shm") == 0)
+		return BenchShm();
+	if (strcmp(szName, "scale") == 0)
+		return BenchScale();
+	if (strcmp(szName, "shrink") == 0)
+		return BenchShrink();
+	if (strcmp(szName, "replay") == 0)
+		return BenchReplay();
+#endif
+	fprintf(stderr, "Unknown benchmark '%s'\n", szName);
+	return 1;
+} /* RunBench() */
+
+//
+// Capture scheduling
+// Without --sync timer, the copy thread doesn't just sample fb0 on a fixed
+// grid of --fps ticks:
+// - if the fb0 driver supports FBIO_WAITFORVSYNC, captures are made
+//   right after a vertical blank, when the source is least likely to be
+//   in the middle of drawing
+// - the frame cadence of the source (e.g. 50Hz or 30Hz) is measured from
+//   the times that changes were found; once it's slower than our frame
+//   rate, captures are phase-locked to just after each expected update
+// - after 1 second without changes, fb0 is only polled at --idle_fps
+//
+#define CADENCE_HISTORY 16
+static int fdVSync = -1; // fb0 handle used for FBIO_WAITFORVSYNC; -1 if not supported
+static uint64_t llVSyncPeriod; // measured refresh period of fb0
+static uint64_t llChangeTime[CADENCE_HISTORY]; // when the recent changed frames were captured
+static int iChangeHistory; // number of valid entries
+static uint64_t llLastChange; // time of the last frame with changes
+static uint64_t llSourcePeriod; // detected frame period of the source; 0 = not locked
+static int iEarly; // locked captures in a row which came before the source updated
+
+//
+// See if fb0 can wait for the vertical blank; the ioctl has to succeed
+// and actually block for a reasonable amount of time
+//
+static void InitSync(void)
+{
+uint64_t llTime;
+int i, iArg = 0;
+
+	if (iSyncMode == SYNC_TIMER)
+		return;
+	fdVSync = open("/dev/fb0", O_RDWR | O_CLOEXEC);
+	if (fdVSync >= 0)
+	{
+		llTime = NanoClock();
+		for (i=0; i<4; i++)
+		{
+			if (ioctl(fdVSync, FBIO_WAITFORVSYNC, &iArg) < 0)
+				break;
+			if (i == 0) // start timing on a vblank
+				llTime = NanoClock();
+		}
+		llVSyncPeriod = (NanoClock() - llTime) / 3;
+		if (i < 4 || llVSyncPeriod < 4000000LL || llVSyncPeriod > 50000000LL) // 20-250Hz
+		{
+			close(fdVSync);
+			fdVSync = -1;
+		}
+	}
+	if (fdVSync < 0 && iSyncMode == SYNC_VSYNC && !bBackground)
+		printf("Warning: fb0 doesn't support FBIO_WAITFORVSYNC; using a timer\n");
+	if (fdVSync >= 0 && !bBackground)
+		printf("Syncing captures to the fb0 vertical blank (%.1f Hz)\n", 1000000000.0 / (double)llVSyncPeriod);
+} /* InitSync() */
+
+//
+// Add a changed frame to the history and estimate the source's frame period
+//
+static void UpdateCadence(uint64_t llTime, uint64_t llFrameDelta)
+{
+uint64_t llPeriod;
+
+	// a pause longer than a few frames starts a new history
+	if (iChangeHistory && llTime - llChangeTime[iChangeHistory-1] > 250000000LL)
+		iChangeHistory = 0;
+	if (iChangeHistory == CADENCE_HISTORY)
+	{
+		memmove(&llChangeTime[0], &llChangeTime[1], (CADENCE_HISTORY-1) * sizeof(uint64_t));
+		iChangeHistory--;
+	}
+	llChangeTime[iChangeHistory++] = llTime;
+	llSourcePeriod = 0;
+	if (iChangeHistory >= CADENCE_HISTORY/2)
+	{
+		// The average interval is right even when our sampling makes the
+		// individual intervals uneven (50Hz seen at 60Hz is 1,1,1,2 ticks)
+		llPeriod = (llTime - llChangeTime[0]) / (iChangeHistory - 1);
+		if (llPeriod > llFrameDelta + llFrameDelta/8) // slower than us; worth locking to
+			llSourcePeriod = llPeriod;
+	}
+} /* UpdateCadence() */
+
+//
+// Decide when to capture the next frame
+// llTarget is the previous capture deadline
+//
+static uint64_t NextCapture(uint64_t llNow, int bChanged, uint64_t llFrameDelta, uint64_t llTarget)
+{
+	if (iSyncMode != SYNC_TIMER)
+	{
+		if (bChanged)
+		{
+			llLastChange = llNow;
+			iEarly = 0;
+			UpdateCadence(llNow, llFrameDelta);
+			// Aim a little before the expected update; if that turns out to be
+			// too early we look again shortly. This keeps the phase tight and lets
+			// the period estimate follow a source which speeds up.
+			if (llSourcePeriod)
+				return llNow + llSourcePeriod - llSourcePeriod/16;
+		}
+		else if (llSourcePeriod)
+		{
+			if (++iEarly < 8)
+				return llNow + llSourcePeriod/8;
+			llSourcePeriod = 0; // lost it; the source stopped or changed speed
+			iChangeHistory = 0;
+		}
+		if (llNow - llLastChange > 1000000000LL) // static screen; back off
+			return llNow + 1000000000LL / iIdleFPS;
+	}
+	// fixed grid of frame times
+	llTarget += llFrameDelta;
+	while (llTarget < llNow) // we fell behind
+		llTarget += llFrameDelta;
+	return llTarget;
+} /* NextCapture() */
+
+//
+// Wait until it's time for the next capture
+//
+static void WaitForCapture(uint64_t llTarget)
+{
+uint64_t llTime;
+int iArg = 0;
+
+	llTime = NanoClock();
+	if (fdVSync >= 0)
+	{
+		// capture at the first vblank which is no more than half a frame early
+		while (llTime + llVSyncPeriod/2 < llTarget && bRunning)
+		{
+			if (ioctl(fdVSync, FBIO_WAITFORVSYNC, &iArg) < 0)
+				break;
+			llTime = NanoClock();
+		}
+		if (llTime + llVSyncPeriod/2 >= llTarget)
+			return;
+	}
+	if (llTime < llTarget)
+		NanoSleep(llTarget - llTime);
+	else
+// sleep at least a little to yield the thread. On a single CPU core
+// this is necessary to not starve the game emulator thread
+		NanoSleep(4000LL);
+} /* WaitForCapture() */
+
+//
+// Tile size autotuner
+// Unless --tile pins it, the tile size is found by trying each candidate
+// on the live frames. The cost of a frame is the time it took to capture,
+// compare and send (plus the modeled bus time with the virtual LCD): small
+// tiles cost more compares and SPI transactions, big ones send more
+// pixels which didn't change. A round measures TUNE_FRAMES frames at the
+// current size, then at each of the other sizes, then at the current size
+// again; the two measurements of the current size are averaged so a scene
+// which gets busier or quieter during the round doesn't favor either end.
+// A size only replaces the current one if it's at least TUNE_MARGIN
+// percent cheaper, so the geometry doesn't flip between two which are
+// about the same, and after a round it's kept for TUNE_HOLD frames.
+// Only frames with changes count; static ones cost about the same with
+// any tile size. The winner is saved for the application (the newest
+// program which has fb0 or a KMS device open, or --profile), the LCD size
+// and the SPI clock, and used right away the next time that program runs.
+// Looking through /proc for that program is slow, so the main thread does
+// it now and then and the copy thread only sees the name change.
+//
+#define TUNE_SIZES 6
+#define TUNE_FRAMES 30 // measured at each size
+#define TUNE_HOLD 3600 // kept this long after a round
+#define TUNE_MARGIN 10 // percent
+#define TUNE_APP_CHECK 10000 // ms between looks for a different application
+static const int iTuneSizes[TUNE_SIZES][2] = {{32,16},{32,32},{64,30},{64,60},{80,40},{160,60}};
+static int iTuneOrder[TUNE_SIZES+2][2]; // sizes of this round: the current one, the others, the current one again
+static uint64_t llTuneCost[TUNE_SIZES+2];
+static int iTuneCount, iTuneStep = -1, iTuneFrames, bTuneSkip, bTuneStart = 1;
+static char szTuneApp[32];
+static int iTuneSaved[2]; // the size in the profile file for szTuneApp, 0x0 = none
+static pthread_mutex_t tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char szFoundApp[sizeof(szTuneApp)]; // the main thread's latest find
+static int iFoundApp, iTuneAppSeen; // bumped each time it changes; the copy thread's copy
+static uint64_t llAppCheck; // when the main thread looks again
+
+//
+// Name of the program which draws the display: the newest one (other
+// than us) with fb0 or a KMS device open, unless --profile gives it
+//
+static void FindApp(char *szApp, int iLen)
+{
+DIR *pDir, *pFDs;
+struct dirent *pEnt, *pFD;
+char szPath[300], szLink[64];
+int i, iPid, iNewest = 0, iSelf = (int)getpid();
+ssize_t n;
+FILE *pf;
+
+	snprintf(szApp, iLen, "%s", szProfile[0] ? szProfile : "default");
+	if (szProfile[0])
+		return;
+	pDir = opendir("/proc");
+	if (pDir == NULL)
+		return;
+	while ((pEnt = readdir(pDir)) != NULL)
+	{
+		iPid = atoi(pEnt->d_name);
+		if (iPid <= iNewest || iPid == iSelf)
+			continue;
+		snprintf(szPath, sizeof(szPath), "/proc/%d/fd", iPid);
+		pFDs = opendir(szPath);
+		if (pFDs == NULL) // gone, or not ours to look at
+			continue;
+		while ((pFD = readdir(pFDs)) != NULL)
+		{
+			snprintf(szPath, sizeof(szPath), "/proc/%d/fd/%s", iPid, pFD->d_name);
+			n = readlink(szPath, szLink, sizeof(szLink)-1);
+			if (n <= 0)
+				continue;
+			szLink[n] = 0;
+			if (strcmp(szLink, "/dev/fb0") == 0 || strncmp(szLink, "/dev/dri/card", 13) == 0)
+			{
+				iNewest = iPid;
+				break;
+			}
+		}
+		closedir(pFDs);
+	}
+	closedir(pDir);
+	if (iNewest == 0)
+		return;
+	snprintf(szPath, sizeof(szPath), "/proc/%d/comm", iNewest);
+	pf = fopen(szPath, "r");
+	if (pf == NULL)
+		return;
+	if (fgets(szApp, iLen, pf) == NULL)
+		snprintf(szApp, iLen, "default");
+	fclose(pf);
+	for (i=0; szApp[i]; i++)
+	{
+		if (szApp[i] == '\n')
+			szApp[i] = 0;
+		else if (szApp[i] == ' ')
+			szApp[i] = '_'; // the profile file is separated by spaces
+	}
+} /* FindApp() */
+
+//
+// Look for the application drawing now and pass it on if it changed
+// Called by the main thread at startup, every TUNE_APP_CHECK ms and on "tile auto"
+//
+static void CheckApp(void)
+{
+char szApp[sizeof(szFoundApp)];
+
+	FindApp(szApp, sizeof(szApp));
+	llAppCheck = NanoClock() + TUNE_APP_CHECK * 1000000ULL;
+	pthread_mutex_lock(&tune_mutex);
+	if (iFoundApp == 0 || strcmp(szApp, szFoundApp) != 0)
+	{
+		strcpy(szFoundApp, szApp);
+		__atomic_store_n(&iFoundApp, iFoundApp + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&tune_mutex);
+} /* CheckApp() */
+
+//
+// Look up the saved tile size of an application for this LCD and SPI clock
+// Returns 1 if there is one
+//
+static int LoadTileProfile(const char *szApp, int *pWidth, int *pHeight)
+{
+char szLine[128], szName[32];
+int iW, iH, iLCDW, iLCDH, iFreq, bFound = 0;
+FILE *pf;
+
+	if (szTileProfiles[0] == 0 || (pf = fopen(szTileProfiles, "r")) == NULL)
+		return 0;
+	while (fgets(szLine, sizeof(szLine), pf))
+	{
+		if (sscanf(szLine, "%31s %dx%d %d %dx%d", szName, &iLCDW, &iLCDH, &iFreq, &iW, &iH) == 6 &&
+			strcmp(szName, szApp) == 0 && iLCDW == iLCDWidth && iLCDH == iLCDHeight && iFreq == iSPIFreq && iW > 0 && iH > 0)
+		{
+			*pWidth = iW;
+			*pHeight = iH;
+			bFound = 1;
+		}
+	}
+	fclose(pf);
+	return bFound;
+} /* LoadTileProfile() */
+
+//
+// Remember the tile size which won for an application (written to a
+// temporary file and renamed, like the --stats file)
+//
+static void SaveTileProfile(const char *szApp, int iWidth, int iHeight)
+{
+char szLine[128], szName[32], szTemp[272], *p;
+int iW, iH, iLCDW, iLCDH, iFreq;
+FILE *pf, *pfOut;
+
+	if (szTileProfiles[0] == 0)
+		return;
+	snprintf(szTemp, sizeof(szTemp), "%s", szTileProfiles);
+	p = strrchr(szTemp, '/');
+	if (p && p != szTemp)
+	{
+		*p = 0;
+		mkdir(szTemp, 0755); // the first one saved
+	}
+	snprintf(szTemp, sizeof(szTemp), "%s.tmp", szTileProfiles);
+	pfOut = fopen(szTemp, "w");
+	if (pfOut == NULL)
+		return;
+	pf = fopen(szTileProfiles, "r");
+	if (pf == NULL)
+		fprintf(pfOut, "# tile sizes learned by bbcp: application LCD SPI-clock tile\n");
+	while (pf && fgets(szLine, sizeof(szLine), pf)) // keep everything except the old entry
+	{
+		if (sscanf(szLine, "%31s %dx%d %d %dx%d", szName, &iLCDW, &iLCDH, &iFreq, &iW, &iH) == 6 &&
+			strcmp(szName, szApp) == 0 && iLCDW == iLCDWidth && iLCDH == iLCDHeight && iFreq == iSPIFreq)
+			continue;
+		fputs(szLine, pfOut);
+	}
+	if (pf)
+		fclose(pf);
+	fprintf(pfOut, "%s %dx%d %d %dx%d\n", szApp, iLCDWidth, iLCDHeight, iSPIFreq, iWidth, iHeight);
+	fclose(pfOut);
+	rename(szTemp, szTileProfiles);
+} /* SaveTileProfile() */
+
+//
+// Ask the copy thread for a new tile size before the next frame
+//
+static void TuneSize(int iWidth, int iHeight)
+{
+	if (iWidth == iTileWidth && iHeight == iTileHeight)
+		return;
+	iNewTileHeight = iHeight;
+	iNewTileWidth = iWidth;
+	bTuneSkip = 1; // the first frame pays for the new buffers
+} /* TuneSize() */
+
+//
+// Start a round of measurements with the current size and each candidate
+//
+static void StartTuning(void)
+{
+int i, j, iW, iH;
+
+	iTuneCount = 0;
+	iTuneOrder[iTuneCount][0] = iTileWidth;
+	iTuneOrder[iTuneCount++][1] = iTileHeight;
+	for (i=0; i<TUNE_SIZES; i++)
+	{
+		iW = (iTuneSizes[i][0] < iLCDWidth) ? iTuneSizes[i][0] : iLCDWidth; // the same as SetTileSize() does
+		iH = (iTuneSizes[i][1] < iLCDHeight) ? iTuneSizes[i][1] : iLCDHeight;
+		for (j=0; j<iTuneCount && (iTuneOrder[j][0] != iW || iTuneOrder[j][1] != iH); j++) {};
+		if (j == iTuneCount) // not there yet
+		{
+			iTuneOrder[iTuneCount][0] = iW;
+			iTuneOrder[iTuneCount++][1] = iH;
+		}
+	}
+	iTuneOrder[iTuneCount][0] = iTileWidth;
+	iTuneOrder[iTuneCount++][1] = iTileHeight;
+	memset(llTuneCost, 0, sizeof(llTuneCost));
+	iTuneStep = (iTuneCount > 2) ? 0 : -1; // nothing to try on a tiny LCD
+	iTuneFrames = 0;
+} /* StartTuning() */
+
+//
+// Use the saved size of the application drawing now, or find one
+//
+static void TuneApp(void)
+{
+int iW, iH;
+
+	pthread_mutex_lock(&tune_mutex);
+	strcpy(szTuneApp, szFoundApp);
+	iTuneAppSeen = iFoundApp;
+	pthread_mutex_unlock(&tune_mutex);
+	iTuneSaved[0] = iTuneSaved[1] = 0;
+	if (LoadTileProfile(szTuneApp, &iW, &iH))
+	{
+		iTuneSaved[0] = iW;
+		iTuneSaved[1] = iH;
+		TuneSize(iW, iH);
+		iTuneStep = -1;
+		iTuneFrames = 0;
+		if (!bBackground)
+			printf("Tile size %dx%d (saved for %s)\n", iW, iH, szTuneApp);
+	}
+	else
+		StartTuning();
+} /* TuneApp() */
+
+//
+// Account for a frame and move the tuning along; called by the copy
+// thread after each frame with what it cost
+//
+static void TuneFrame(uint64_t llCost, int bChanged)
+{
+uint64_t llBase;
+int i, iBest;
+
+	if (bTuneStart) // the first frame, or "tile auto"
+	{
+		if (__atomic_load_n(&iFoundApp, __ATOMIC_ACQUIRE) == 0)
+			return; // the main thread hasn't looked for the application yet
+		bTuneStart = 0;
+		TuneApp();
+		return;
+	}
+	if (!bChanged || iPendingTiles || iNewTileWidth) // a new size isn't in place until nothing is pending
+		return;
+	if (bTuneSkip)
+	{
+		bTuneSkip = 0;
+		return;
+	}
+	if (iTuneStep < 0) // keeping the size
+	{
+		iTuneFrames++;
+		if (__atomic_load_n(&iFoundApp, __ATOMIC_RELAXED) != iTuneAppSeen) // a different program draws now
+		{
+			TuneApp();
+			return;
+		}
+		if (iTuneFrames >= TUNE_HOLD)
+			StartTuning();
+		return;
+	}
+	llTuneCost[iTuneStep] += llCost;
+	if (++iTuneFrames < TUNE_FRAMES)
+		return;
+	iTuneFrames = 0;
+	if (++iTuneStep < iTuneCount)
+	{
+		TuneSize(iTuneOrder[iTuneStep][0], iTuneOrder[iTuneStep][1]);
+		return;
+	}
+	// the round is over; the current size was measured first and last
+	llBase = (llTuneCost[0] + llTuneCost[iTuneCount-1]) / 2;
+	iBest = 0;
+	for (i=1; i<iTuneCount-1; i++)
+	{
+		if (llTuneCost[i] < (iBest ? llTuneCost[iBest] : llBase))
+			iBest = i;
+	}
+	if (iBest && llTuneCost[iBest] * 100 > llBase * (100 - TUNE_MARGIN)) // not worth a change
+		iBest = 0;
+	if (iBest && !bBackground)
+		printf("Tile size %dx%d for %s (%.0f us per frame instead of %.0f)\n", iTuneOrder[iBest][0], iTuneOrder[iBest][1],
+			szTuneApp, (double)llTuneCost[iBest] / (1000.0 * TUNE_FRAMES), (double)llBase / (1000.0 * TUNE_FRAMES));
+	TuneSize(iTuneOrder[iBest][0], iTuneOrder[iBest][1]);
+	if (iTuneOrder[iBest][0] != iTuneSaved[0] || iTuneOrder[iBest][1] != iTuneSaved[1]) // spare the SD card
+	{
+		SaveTileProfile(szTuneApp, iTuneOrder[iBest][0], iTuneOrder[iBest][1]);
+		iTuneSaved[0] = iTuneOrder[iBest][0];
+		iTuneSaved[1] = iTuneOrder[iBest][1];
+	}
+	iTuneStep = -1;
+} /* TuneFrame() */
+
+void *CopyThread(void *pArg)
+{
+uint64_t llTime, llFrameDelta, llTargetTime, llOldTime, llStart, llTune, llBus;
+float fps;
+int iVideoFrames = 0, bChanged;
+
+	SetAffinity(0);
+	llFrameDelta = 1000000000 / iTargetFPS; // time slice in nanoseconds
+	llTargetTime = llOldTime = NanoClock() + llFrameDelta; // end of frame time
+
+	while (bRunning)
+	{
+		if (bPaused)
+		{
+			pthread_mutex_lock(&ctl_mutex);
+			while (bPaused && bRunning)
+				pthread_cond_wait(&ctl_cond, &ctl_mutex);
+			pthread_mutex_unlock(&ctl_mutex);
+			llTargetTime = NanoClock() + llFrameDelta; // don't try to catch up
+			continue;
+		}
+		if (iNewTileWidth) // tile size changed by the control socket
+		{
+			if (ChangeTileSize(iNewTileWidth, iNewTileHeight))
+			{
+				fprintf(stderr, "Error allocating the buffers for the new tile size\n");
+				bRunning = 0;
+				break;
+			}
+			iNewTileWidth = 0;
+		}
+		llFrameDelta = 1000000000 / iTargetFPS;
+		if (bMetricsReset)
+			ResetMetrics();
+		llStart = StageStart();
+		llTune = bAutoTile ? NanoClock() : 0;
+		llBus = llBusTime;
+		if (bPipeline)
+			bChanged = PipelineLoop(); // capture + compare; the send thread does the rest
+		else
+			bChanged = CopyLoop(); // send the display to the LCD
+		iVideoFrames++;
+		llTime = NanoClock(); // get clock time in nanoseconds
+		if (llTune) // the virtual LCD only models the bus time, unless it waits for it
+			TuneFrame(llTime - llTune + (bVirtualRealtime ? 0 : llBusTime - llBus), bChanged);
+		if (llStart)
+		{
+			HistAdd(&Histograms[STAGE_FRAME], llTime - llStart);
+			u32MetricFrames++;
+			if (llTime - llStart > llFrameDelta)
+				u32MissedFrames++;
+		}
+		if ((llTime - llOldTime) > 1000000000LL) // update every second
+		{
+			fps = (float)iVideoFrames;
+			fps = fps * 1000000000.0;
+			fps = fps / (float)(llTime-llOldTime);
+			fLastFPS = fps; // for the control socket
+			if (bShowFPS)
+			{
+				if (!bBackground)
+					printf("%02.1f FPS\n", fps);
+				if (!bBackground && llBytesSent && bHashTiles) // no old pixels to count the changes
+					printf("  sent %d KB\n", (int)(llBytesSent >> 10));
+				else if (!bBackground && llBytesSent)
+					printf("  sent %d KB, changed %d KB (%.1f%% of the bytes sent)\n", (int)(llBytesSent >> 10), (int)(llBytesChanged >> 10),
+						(float)llBytesChanged * 100.0f / (float)llBytesSent);
+				llBytesSent = llBytesChanged = 0;
+				if (bPipeline)
+					ShowPipelineStats();
+				ShowBusStats(llTime - llOldTime);
+				if (bBudget)
+					ShowScheduleStats();
+				if (bInterlace)
+					ShowInterlaceStats();
+				if (bHWScroll)
+					ShowScrollStats();
+				if (bFillTiles)
+					ShowFillStats();
+#if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
+				ShowFlipStats();
+#endif // !_RPIZERO_
 			}
+			if (szStatsFile[0])
+				WriteStatsFile();
+			else if (bMetrics && !bLatency && llTime - llMetricsRead > 60000000000LL) // no one is looking
+				bMetrics = 0;
+			iVideoFrames = 0;
+			llOldTime = llTime;
+		}
+		if (pShm) // the client sets the pace
+			ShmWait();
+		else
+		{
+			llTargetTime = NextCapture(llTime, bChanged, llFrameDelta, llTargetTime);
+			WaitForCapture(llTargetTime);
 		}
+	} // while running
+	return NULL;
+} /* CopyThread() */
+
+//
+// Runtime control
+// The main thread sleeps in poll() on a signalfd (SIGINT/SIGTERM/SIGHUP),
+// the control socket and, in the foreground, stdin. Commands are lines
+// of text, e.g. echo "fps 30" | socat - UNIX-CONNECT:/tmp/bbcp.sock
+//
+#define MAX_CLIENTS 4
+static int iControlSock = -1;
+static int iClientSock[MAX_CLIENTS], iClientLen[MAX_CLIENTS];
+static char szClientBuf[MAX_CLIENTS][128];
+
+static int OpenControlSocket(char *szPath)
+{
+struct sockaddr_un addr;
+
+	iControlSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (iControlSock < 0)
+		return 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", szPath);
+	unlink(szPath); // left over from a previous run
+	if (bind(iControlSock, (struct sockaddr *)&addr, sizeof(addr)) || listen(iControlSock, MAX_CLIENTS))
+	{
+		close(iControlSock);
+		iControlSock = -1;
+		return 1;
+	}
+	chmod(szPath, 0600); // only our user can control us
+	return 0;
+} /* OpenControlSocket() */
+
+static void CloseControlSocket(void)
+{
+int i;
+
+	for (i=0; i<MAX_CLIENTS; i++)
+	{
+		if (iClientSock[i] > 0)
+			close(iClientSock[i]);
+		iClientSock[i] = 0;
 	}
-#endif // _RPIZERO_
-} /* FBCapture() */
+	if (iControlSock >= 0)
+	{
+		close(iControlSock);
+		unlink(szControl);
+		iControlSock = -1;
+	}
+} /* CloseControlSocket() */
 
 //
-// Turn GPIO button presses into keyboard events
-// This would be more efficient to do as interrupt driven events
-// but reading the keys every frame takes an insignificant amount
-// of time. This allows for simpler GPIO access which will work
-// on more platforms.
+// Change the tile size; called by the copy thread between frames
+// Return 0 for success, 1 for failure
 //
-void ProcessKeys(void)
+static int ChangeTileSize(int iWidth, int iHeight)
 {
-int i, rc, iState;
-struct input_event ie;
+int i, bPending;
 
-	memset(&ie, 0, sizeof(ie));
-
-	// Loop through all of the defined keys
-	for (i=0; i<iKeyDefs; i++)
+	if (bPipeline) // let the send thread finish with the queued frames
 	{
-		iState = spilcdReadPin(iGPIOList[i]);
-		if (iState != iKeyState[i]) // need to send an event
-		{
-			iKeyState[i] = iState;
-			if (iState) // if state is off, send release
-				ie.value = 0;
-			else
-				ie.value = 1; // send press
-			ie.type = EV_KEY; // key event
-			ie.code = iKeyList[i];
-			rc = write(fdui, &ie, sizeof(ie)); // send the event
-			ie.type = EV_SYN;
-			ie.code = SYN_REPORT;
-			ie.value = 0;
-			rc = write(fdui, &ie, sizeof(ie)); // send a report			
-			if (rc < 0) {}; // suppress compiler warning
-		}
-	} // for each key
-} /* ProcessKeys() */
+		pthread_mutex_lock(&pipe_mutex);
+		while (iFramesSent != iFramesQueued && bRunning)
+			pthread_cond_wait(&pipe_cond, &pipe_mutex);
+		pthread_mutex_unlock(&pipe_mutex);
+	}
+	bPending = (iPendingTiles != 0);
+	FreeTileBuffers();
+	SetTileSize(iWidth, iHeight);
+	if (AllocTileBuffers())
+		return 1;
+	if (bPending) // tiles which were still waiting can't be mapped; resend everything
+	{
+		for (i=0; i<iTilesY; i++)
+			memset(&pPending[i * iTileWords], 0xff, (iTilesX >> 6) * sizeof(uint64_t));
+		for (i=0; (iTilesX & 63) && i<iTilesY; i++)
+			pPending[i * iTileWords + (iTilesX >> 6)] = (1ULL << (iTilesX & 63)) - 1;
+		for (i=0; i<iTilesX * iTilesY; i++)
+			FullTileRect(i % iTilesX, i / iTilesX, &pPendRects[i]);
+		memcpy(pOwedMap, pPending, iTilesY * iTileWords * sizeof(uint64_t));
+		iPendingTiles = iTilesX * iTilesY;
+	}
+	for (i=0; bPipeline && i<iRingSize; i++)
+	{
+		free(PipeRing[i].pRegions);
+		free(PipeRing[i].pRects);
+		PipeRing[i].pRegions = AllocDirtyMap();
+		PipeRing[i].pRects = malloc(iTilesX * iTilesY * sizeof(TILERECT));
+		if (PipeRing[i].pRegions == NULL || PipeRing[i].pRects == NULL)
+			return 1;
+	}
+	return 0;
+} /* ChangeTileSize() */
 
 //
-// Copy the framebuffer changes to the LCD
-// checks for key events too
+// Execute one line received on the control socket and send the reply
+// Returns 1 if we were asked to quit
 //
-static void CopyLoop(void)
+static int ControlCommand(int iSock, char *szCmd)
 {
-int iChanged;
-uint32_t u32Flags, u32Regions[32], *pRegions;
-int i, j, k, x, y, iCount;
-
-	// Manage GPIO keys
-	ProcessKeys();
+char szReply[2048];
+int i, j, bQuit = 0;
 
-	// Capture the current framebuffer
-	FBCapture();
-
-	// Divide display into 10 x 10 tiles (32x24 pixels each)
-	iChanged = FindChangedRegion(pScreen, pAltScreen, LCD_CX, LCD_CY, iLCDPitch, iTileWidth, iTileHeight, u32Regions);
-	if (iChanged) // some area of the image changed
+	if (sscanf(szCmd, "fps %d", &i) == 1 && i > 0 && i <= 1000)
+	{
+		iTargetFPS = i;
+		snprintf(szReply, sizeof(szReply), "ok fps %d\n", i);
+	}
+	else if (sscanf(szCmd, "tile %dx%d", &i, &j) == 2 && i > 0 && j > 0)
+	{
+		bAutoTile = 0; // pinned
+		iNewTileHeight = j; // the copy thread applies it before its next frame
+		iNewTileWidth = i;
+		snprintf(szReply, sizeof(szReply), "ok tile %dx%d\n", i, j);
+	}
+	else if (strcmp(szCmd, "tile auto") == 0)
 	{
-		// Copy the changed areas to our backup framebuffer
-		k = 0;
-		for (i=0; i<LCD_CY; i+= iTileHeight)
+		if (bHashTiles || bPipeline || bBudget || bInterlace)
+			strcpy(szReply, "error: the tile size can't be tuned with --hash, --pipeline, --budget or --interlace\n");
+		else
 		{
-			if (u32Regions[k++])
-			{
-				j = iTileHeight;
-				if (i+j > LCD_CY) j = LCD_CY - i;
-				memcpy(&pAltScreen[i*iLCDPitch], (void *)&pScreen[i*iLCDPitch], j * iLCDPitch); // copy regions which changed
-			}
+			CheckApp();
+			bTuneStart = 1;
+			bAutoTile = 1;
+			strcpy(szReply, "ok tile auto\n");
 		}
-		// Draw the changed tiles
-		pRegions = u32Regions;
-		iCount = 0; // number we've drawn
-		for (y=0; y<LCD_CY; y+=iTileHeight)
+	}
+	else if (strcmp(szCmd, "pause") == 0 || strcmp(szCmd, "resume") == 0)
+	{
+		pthread_mutex_lock(&ctl_mutex);
+		bPaused = (szCmd[0] == 'p');
+		pthread_cond_broadcast(&ctl_cond);
+		pthread_mutex_unlock(&ctl_mutex);
+		snprintf(szReply, sizeof(szReply), "ok %s\n", szCmd);
+	}
+	else if (strcmp(szCmd, "stats") == 0)
+	{
+		snprintf(szReply, sizeof(szReply), "fps %.1f target %d tile %dx%d lcd %dx%d pending %d %s\n", fLastFPS, iTargetFPS,
+			iTileWidth, iTileHeight, iLCDWidth, iLCDHeight, iPendingTiles, bPaused ? "paused" : "running");
+	}
+	else if (strcmp(szCmd, "metrics") == 0)
+	{
+		llMetricsRead = NanoClock();
+		if (!bMetrics) // start collecting; there's nothing to show yet
 		{
-			u32Flags = *pRegions++; // next set of row tile flags
-			for (x=0; x<LCD_CX; x += iTileWidth)
-			{
-				if (u32Flags & 1) // this tile is dirty
-				{
-					spilcdDrawTile(x, y, iTileWidth, iTileHeight, &pAltScreen[(y*iLCDPitch)+x*2], iLCDPitch);
-					iCount++;
-					if (iCount == iChanged/2) // yield thread
-						NanoSleep(4000LL);
-				}
-				u32Flags >>= 1; // shift down to next bit flag	
-			}
+			bMetricsReset = 1;
+			bMetrics = 1;
+			strcpy(szReply, "ok metrics on; ask again for the numbers\n");
 		}
-
+		else
+			FormatMetrics(szReply, sizeof(szReply));
 	}
-} /* CopyLoop() */
+	else if (strcmp(szCmd, "metrics reset") == 0)
+	{
+		llMetricsRead = NanoClock();
+		bMetricsReset = 1;
+		bMetrics = 1;
+		strcpy(szReply, "ok metrics reset\n");
+	}
+	else if (strcmp(szCmd, "quit") == 0)
+	{
+		strcpy(szReply, "ok quit\n");
+		bQuit = 1;
+	}
+	else
+	{
+		strcpy(szReply, "error: commands are fps <n>, tile <w>x<h>|auto, pause, resume, stats, metrics [reset], quit\n");
+	}
+	if (write(iSock, szReply, strlen(szReply)) < 0) {}; // the client may be gone
+	return bQuit;
+} /* ControlCommand() */
 
 //
-// Parse the command  line options
+// Read from a control client and execute each complete line
+// Returns -1 when the client is done, 1 for quit, otherwise 0
 //
-static int ParseOpts(int argc, char *argv[])
+static int ControlRead(int iClient)
 {
-    int i = 1;
-
-    while (i < argc)
-    {
-        /* if it isn't a cmdline option, we're done */
-        if (0 != strncmp("--", argv[i], 2))
-            break;
-        /* GNU-style separator to support files with -- prefix
-         * example for a file named "--baz": ./foo --bar -- --baz
-         */
-        if (0 == strcmp("--", argv[i]))
-        {
-            i += 1;
-            break;
-        }
-        /* test for each specific flag */
-        if (0 == strcmp("--spi_bus", argv[i])) {
-            iSPIChan = atoi(argv[i+1]);
-            i += 2;
-	} else if (0 == strcmp("--background", argv[i])) {
-	    bBackground = 1;
-	    i++;
-        } else if (0 == strcmp("--spi_freq", argv[i])) {
-            iSPIFreq = atoi(argv[i+1]);
-            i += 2;
-        } else if (0 == strcmp("--flip", argv[i])) {
-            i++; 
-            bLCDFlip = 1;
-        } else if (0 == strcmp("--lcd_dc", argv[i])) {
-            iDC = atoi(argv[i+1]);
-            i += 2;
-        } else if (0 == strcmp("--lcd_rst", argv[i])) {
-            iReset = atoi(argv[i+1]); 
-            i += 2;
-        } else if (0 == strcmp("--lcd_led", argv[i])) {
-            iLED = atoi(argv[i+1]);
-            i += 2; 
-	} else if (0 == strcmp("--gpiokeys", argv[i])) {
-	    strcpy(szKeyConfig, argv[i+1]);
-	    i += 2;
-        } else if (0 == strcmp("--showfps",argv[i])) {        
-            bShowFPS = 1;
-            i++;
-        }  else {
-            fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
-            exit(1);
-        }   
-    }       
-    return i;
-
-} /* ParseOpts() */
+char *pBuf = szClientBuf[iClient], *pEOL;
+int iLen, iRC = 0;
 
-static void ShowHelp(void)
-{
-    printf(
-        "BB-CP: copy framebuffer to SPI LCD\n"
-        "Copyright (c) 2017 BitBank Software, Inc.\n"
-        "Written by Larry Bank\n\n"
-        "Options:\n"
-        " --spi_bus <integer>      defaults to 0\n"
-        " --spi_freq <integer>     defaults to 31250000\n"
-        " --lcd_dc <pin number>    defaults to 18\n"
-        " --lcd_rst <pin number>   defaults to 22\n"
-        " --lcd_led <pin number>   defaults to 13\n"
-	" --gpiokeys <config file> \n"
-        " --flip                   flips display 180 degrees\n"
-        " --showfps                Show framerate\n"
-	" --background             suppress printf output if running as a bkgd process\n"
-        "\nExample usage:\n"
-        "sudo ./bbcp --spi_bus 1 spi_freq 46000000 --flip\n"
-    );
-} /* ShowHelp() */
+	iLen = read(iClientSock[iClient], &pBuf[iClientLen[iClient]], sizeof(szClientBuf[0]) - 1 - iClientLen[iClient]);
+	if (iLen <= 0)
+		return -1;
+	iClientLen[iClient] += iLen;
+	pBuf[iClientLen[iClient]] = 0;
+	while (iRC == 0 && (pEOL = strchr(pBuf, '\n')) != NULL)
+	{
+		*pEOL = 0;
+		if (pEOL > pBuf && pEOL[-1] == '\r')
+			pEOL[-1] = 0;
+		iRC = ControlCommand(iClientSock[iClient], pBuf);
+		iClientLen[iClient] -= (int)(pEOL + 1 - pBuf);
+		memmove(pBuf, pEOL + 1, iClientLen[iClient] + 1);
+	}
+	if (iClientLen[iClient] >= (int)sizeof(szClientBuf[0]) - 1) // line too long
+		return -1;
+	return iRC;
+} /* ControlRead() */
 
-void *CopyThread(void *pArg)
+//
+// Sleep until a quit signal, ENTER (foreground only) or a quit command
+// and handle control socket requests in the meantime
+//
+static void EventLoop(int iSignalFD)
 {
-int64_t ns;
-uint64_t llTime, llFrameDelta, llTargetTime, llOldTime;
-float fps;
-int iVideoFrames = 0;
-
-	llFrameDelta = 1000000000 / 60; // time slice in nanoseconds (60 FPS)
-	llTargetTime = llOldTime = NanoClock() + llFrameDelta; // end of frame time
+struct pollfd fds[5 + MAX_CLIENTS];
+int iClient[5 + MAX_CLIENTS]; // client index of each poll entry (-1 = not a client)
+struct signalfd_siginfo si;
+uint64_t u64 = 1, llTime;
+int i, j, iCount, iSock, iRC, iTimeout, bQuit = 0;
+char c;
 
-	while (bRunning)
+	while (!bQuit && bRunning)
 	{
-		CopyLoop(); // send the display to the LCD
-		iVideoFrames++;
-		llTime = NanoClock(); // get clock time in nanoseconds
-		ns = llTargetTime - llTime;
-		if (bShowFPS && (llTime - llOldTime) > 1000000000LL) // update every second
+		iTimeout = bShmDetach ? 10 : -1;
+		if (bAutoTile) // see if a different program draws now
 		{
-			fps = (float)iVideoFrames;
-			fps = fps * 1000000000.0;
-			fps = fps / (float)(llTime-llOldTime);
-			if (!bBackground)
-				printf("%02.1f FPS\n", fps);
-			iVideoFrames = 0;
-			llOldTime = llTime;
+			llTime = NanoClock();
+			if (llTime >= llAppCheck)
+			{
+				CheckApp();
+				llTime = NanoClock();
+			}
+			i = (int)((llAppCheck - llTime) / 1000000) + 1;
+			if (iTimeout < 0 || i < iTimeout)
+				iTimeout = i;
+		}
+		iCount = 0;
+		fds[iCount].fd = iSignalFD; iClient[iCount] = -1; fds[iCount++].events = POLLIN;
+		if (!bBackground)
+		{
+			fds[iCount].fd = STDIN_FILENO; iClient[iCount] = -1; fds[iCount++].events = POLLIN;
+		}
+		if (iControlSock >= 0)
+		{
+			fds[iCount].fd = iControlSock; iClient[iCount] = -1; fds[iCount++].events = POLLIN;
+		}
+		if (iShmSock >= 0 && !bShmDetach) // a new client waits until the last one is cleaned up
+		{
+			fds[iCount].fd = iShmSock; iClient[iCount] = -1; fds[iCount++].events = POLLIN;
+		}
+		if (iShmClient >= 0) // only to see it hang up
+		{
+			fds[iCount].fd = iShmClient; iClient[iCount] = -1; fds[iCount++].events = POLLIN;
 		}
-		if (ns < 0) // we fell behind
+		for (i=0; i<MAX_CLIENTS; i++)
 		{
-			while (ns < 0)
+			if (iClientSock[i] > 0)
 			{
-				ns += llFrameDelta;
-				llTargetTime += llFrameDelta;
+				fds[iCount].fd = iClientSock[i]; iClient[iCount] = i; fds[iCount++].events = POLLIN;
 			}
-// sleep at least a little to yield the thread. On a single CPU core
-// this is necessary to not starve the game emulator thread
-
-			NanoSleep(4000LL); 		
 		}
-		else // just sleep to fill the rest of the 1/60th second
+		if (poll(fds, iCount, iTimeout) < 0)
+			continue; // interrupted
+		for (i=0; i<iCount && !bQuit; i++)
 		{
-			NanoSleep(ns);
+			if (fds[i].revents == 0)
+				continue;
+			if (iClient[i] >= 0) // a control client
+			{
+				iRC = ControlRead(iClient[i]);
+				if (iRC < 0)
+				{
+					close(iClientSock[iClient[i]]);
+					iClientSock[iClient[i]] = 0;
+				}
+				bQuit = (iRC > 0);
+			}
+			else if (fds[i].fd == iSignalFD)
+			{
+				if (read(iSignalFD, &si, sizeof(si)) == sizeof(si) && !bBackground)
+					printf("%s; exiting...\n", strsignal(si.ssi_signo));
+				bQuit = 1;
+			}
+			else if (fds[i].fd == iShmSock)
+			{
+				iSock = accept(iShmSock, NULL, NULL);
+				// one client at a time, and the last one has to be gone
+				if (iSock >= 0 && (iShmClient >= 0 || pShm || ShmAttach(iSock)))
+					close(iSock);
+				else if (iSock >= 0)
+				{
+					iShmClient = iSock;
+					if (!bBackground)
+						printf("Frame client connected; not reading fb0\n");
+				}
+			}
+			else if (fds[i].fd == iShmClient)
+			{
+				if (read(iShmClient, &c, 1) <= 0) // it went away
+				{
+					close(iShmClient);
+					iShmClient = -1;
+					if (write(fdShmFrame, &u64, sizeof(u64)) < 0) {}; // wake up the copy thread
+					bShmDetach = 1;
+				}
+			}
+			else if (fds[i].fd == iControlSock)
+			{
+				iSock = accept(iControlSock, NULL, NULL);
+				for (j=0; j<MAX_CLIENTS && iClientSock[j] > 0; j++) {};
+				if (iSock >= 0 && j < MAX_CLIENTS)
+				{
+					iClientSock[j] = iSock;
+					iClientLen[j] = 0;
+				}
+				else if (iSock >= 0)
+					close(iSock); // too many clients
+			}
+			else // stdin
+			{
+				if (read(STDIN_FILENO, &c, 1) <= 0 || c == '\n')
+					bQuit = 1; // ENTER or end of input
+			}
 		}
-		llTargetTime += llFrameDelta;
-	} // while running
-	return NULL;
-} /* CopyThread() */
-
-//
-// Catch CTRL-C here
-//
-void signal_handler(int signum)
-{
-	printf("Ctrl-C hit; exiting...\n");
-	shutdown();
-	exit(0); // quit the program quietly
-} /* signal_handler() */
+	}
+} /* EventLoop() */
 
-void shutdown(void)
+void Shutdown(void)
 {
     // Quit library and free resources
-        bRunning = 0; // tell background thread to stop
-        NanoSleep(50000000LL); // wait 50ms for work to finish
-        spilcdShutdown();
+        bRunning = 0; // tell background threads to stop
+        pthread_mutex_lock(&ctl_mutex);
+        pthread_cond_broadcast(&ctl_cond); // wake up the copy thread if paused
+        pthread_mutex_unlock(&ctl_mutex);
+        pthread_mutex_lock(&pipe_mutex);
+        pthread_cond_broadcast(&pipe_cond); // wake up any stalled stage
+        pthread_mutex_unlock(&pipe_mutex);
+        pthread_join(tinfo, NULL); // wait for the work in progress to finish
+        StopWorkers();
+        if (bPipeline)
+                pthread_join(tinfoSend, NULL);
+        ShmDetach();
+        if (iShmClient >= 0)
+                close(iShmClient);
+        if (iShmSock >= 0)
+        {
+                close(iShmSock);
+                unlink(szShmSock);
+        }
+        (*pSink->pfnShutdown)();
+        CloseRecording();
+        CloseControlSocket();
+        StopKeyThread(); // before uinput goes away
+        if (fdVSync >= 0)
+                close(fdVSync);
     // shut down the keypress simulator device
         if (fdui >= 0)
         {
                 ioctl(fdui, UI_DEV_DESTROY);
                 close(fdui);
         }
+#ifdef HAVE_DRM
+        CloseDRM();
+#endif // HAVE_DRM
 #if defined( _RPIZERO_ ) || defined( _RPI3_ )
         vc_dispmanx_resource_delete(screen_resource);
         vc_dispmanx_display_close(display);
 #endif // _RPIZERO_
-} /* shutdown() */
+} /* Shutdown() */
 
 int main(int argc, char* argv[])
 {
-int i;
-pthread_t tinfo;
+int i, iSignalFD;
+sigset_t sigmask;
 
 	if (argc < 2)
 	{
@@ -687,16 +7148,75 @@ pthread_t tinfo;
 	bLCDFlip = 0;
 	strcpy(szKeyConfig, ""); // assume no GPIO keyboard mapping
 	iKeyDefs = 0; // assume no GPIO keys
+	iDebounce = 5;
 	fdui = -1;
 	bBackground = 0; // assume we're not a background process
+	bPipeline = 0; // single threaded capture + send
+	bFused = 0; // separate capture/compare/update passes
+	bTightRects = 0; // send whole tiles
+	bCoalesce = 0; // one transfer per tile
+	iSPIOverhead = 25000; // typical for a user space SPI driver
+	iScaleFilter = SCALE_AUTO;
+	bLetterbox = 0;
+	iRingSize = 3;
+	iTargetFPS = 60;
+	iSyncMode = SYNC_AUTO;
+	iIdleFPS = 10;
+	bBudget = 0;
+	iMaxStale = 4;
+	bInterlace = 0;
+	iInterlaceOn = 100;
+	iInterlaceOff = 75;
+	strcpy(szControl, "/tmp/bbcp.sock");
 	// These are the header pin numbers of the ILI9341 control lines
 	// 18 means pin 18 on the 40 pin IO header
 	iDC = 18; iReset = 22; iLED = 13;
 
-	iTileWidth = 64; // for now - different values might be more efficient
+	iTileWidth = 64; // until the autotuner finds a better size (or --tile)
 	iTileHeight = 30;
 
+	pLCDType = &LCDTypes[0]; // ILI9341 unless told otherwise
+	iLCDWidth = iLCDHeight = 0; // use the controller's size
+
 	ParseOpts(argc, argv); // gather the command line parameters
+	if (iLCDWidth <= 0 || iLCDHeight <= 0)
+	{
+		iLCDWidth = pLCDType->iWidth;
+		iLCDHeight = pLCDType->iHeight;
+	}
+	SetTileSize(iTileWidth, iTileHeight);
+	InitKernels(); // pick the fastest compare code for this CPU
+	if (bInterlace && bBudget)
+	{
+		fprintf(stderr, "--interlace and --budget can't be used together; using --budget\n");
+		bInterlace = 0;
+	}
+	if (iInterlaceOff > iInterlaceOn)
+		iInterlaceOff = iInterlaceOn;
+	if (bHashTiles || bPipeline) // a new grid means resending everything (--hash); the send thread isn't measured (--pipeline)
+		bAutoTile = 0;
+	if (bBudget || bInterlace) // tiles are left pending under load, so a new size would rarely get its turn
+		bAutoTile = 0;
+	if (pLCDType->iType < 0 && strcmp(pSink->szName, "spi") == 0) // the virtual LCD only needs the size
+	{
+		fprintf(stderr, "LCD type '%s' isn't in the SPI_LCD library this was built with; update it and rebuild\n", pLCDType->szName);
+		return 1;
+	}
+	if (szKeyConfig[0] && strcmp(pSink->szName, "spi") != 0 && szGPIOChip[0] == 0) // the pins are read through SPI_LCD
+	{
+		fprintf(stderr, "GPIO keys need the SPI LCD backend or --gpiochip; ignoring --gpiokeys\n");
+		szKeyConfig[0] = 0;
+	}
+
+#ifdef BBCP_BENCH
+	if (szBench[0] == 0) // the bench build doesn't drive a display
+	{
+		fprintf(stderr, "Usage: bbcp-bench --replay <trace file> [options]\n");
+		return 1;
+	}
+#endif // BBCP_BENCH
+	if (szBench[0]) // run a benchmark instead of the display copy
+		return RunBench(szBench);
 
 	if (strlen(szKeyConfig)) // if config file specified, parse it
 	{
@@ -717,22 +7237,72 @@ pthread_t tinfo;
 	// Initialize the header pins specified to be GPIO inputs
 	// This needs to be done after initializing the LCD since
 	// SPI_LCD initializes the gpio functions in the LCD init
-	for (i=0; i<iKeyDefs; i++)
+	for (i=0; i<iKeyDefs && szGPIOChip[0] == 0; i++)
 	{
 		if (spilcdConfigurePin(iGPIOList[i])) // problem
 		{
 			fprintf(stderr, "Error configuring pin %d as an input\n", iGPIOList[i]);
 		}
 	}
+	if (bHashTiles && bPipeline)
+	{
+		fprintf(stderr, "--hash is not used in pipelined mode; ignoring it\n");
+		bHashTiles = 0;
+	}
+	if (bHashTiles && (bFused || bHWScroll || bTightRects))
+	{
+		fprintf(stderr, "--fused, --hwscroll and --tight need the shadow copy which --hash replaces; ignoring them\n");
+		bFused = bHWScroll = bTightRects = 0;
+	}
+	if (iWorkers > 1 && (bPipeline || bFused))
+	{
+		fprintf(stderr, "--workers is not used with --pipeline or --fused\n");
+		iWorkers = 1;
+	}
+	if (iWorkers > 1 && InitWorkers(iWorkers))
+	{
+		fprintf(stderr, "Unable to start the worker threads\n");
+		StopWorkers();
+	}
+	if (bHWScroll && pSink->pfnScroll == NULL)
+	{
+		fprintf(stderr, "--hwscroll only works with --lcd virtual for now; ignoring it\n");
+		bHWScroll = 0;
+	}
+	if (bHWScroll && (bPipeline || bFused))
+	{
+		fprintf(stderr, "--hwscroll can't be used with --pipeline or --fused; ignoring it\n");
+		bHWScroll = 0;
+	}
+	if (bHWScroll && AllocScroll())
+		bHWScroll = 0;
+	if (szRecord[0] && OpenRecording(szRecord))
+	{
+		fprintf(stderr, "Unable to create the trace file %s\n", szRecord);
+		szRecord[0] = 0;
+	}
 
 #if !defined( _RPIZERO_ ) && !defined( _RPI3_ )
-	if (vinfo.xres > 640)
-		printf("Warning: the framebuffer is too large and will not be copied properly; sipported sizes are 640x480 and 320x240\n");
+	if (pfnConvertLine == ConvertLineScaled && !bBackground)
+		printf("Scaling the %dx%d framebuffer to %dx%d (%s)\n", vinfo.xres, vinfo.yres, iScaleCX, iScaleCY, (iScaleFilter == SCALE_BILINEAR) ? "bilinear" : "box");
 	if (vinfo.bits_per_pixel == 32)
 		printf("Warning: the framebuffer bit depth is 32-bpp, ideally it should be 16-bpp for fastest results\n");
 #endif // !_RPIZERO_
 
-	signal(SIGINT, signal_handler); // catch CTRL-C
+	// Handle the quit signals synchronously in the main thread; the threads
+	// we start inherit the blocked mask
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+	iSignalFD = signalfd(-1, &sigmask, SFD_CLOEXEC);
+	if (szControl[0] && OpenControlSocket(szControl))
+		fprintf(stderr, "Unable to open the control socket %s\n", szControl);
+	if (szShmSock[0] && bPipeline)
+		fprintf(stderr, "--shm is not used in pipelined mode; ignoring it\n");
+	else if (szShmSock[0] && OpenShmSocket(szShmSock))
+		fprintf(stderr, "Unable to open the frame socket %s\n", szShmSock);
 
 // Do a quick performance test to make sure everything is working correctly
 	{
@@ -741,10 +7311,13 @@ pthread_t tinfo;
 		llTime = NanoClock() + 1000000000LL;
 		while (NanoClock() < llTime) // run for 1 second
 		{	// force total redraw each frame
-			memset(pAltScreen, 0xff, iLCDPitch * LCD_CY);
+			memset(pAltScreen, 0xff, iLCDPitch * iLCDHeight);
+			memset(pTileHash, 0xff, iTilesX * iTilesY * sizeof(uint64_t));
+			bDRMFull = 1;
 			CopyLoop();
 			iFrames++;
 		}
+		bMetricsReset = 1; // don't count the test frames
 		if (!bBackground)
 		{
 			printf("Perf test: worst case framerate = %d FPS\n", iFrames);
@@ -753,20 +7326,41 @@ pthread_t tinfo;
 		}
 	}
 
+#if defined( _RPIZERO_ ) || defined( _RPI3_ )
+	bFused = 0; // dispmanx does the capture for us
+#endif
+	if (bFused && bPipeline)
+	{
+		bFused = 0; // the pipeline keeps full frames in its ring
+		if (!bBackground)
+			printf("Warning: --fused is not used in pipelined mode\n");
+	}
+
 	// Start screen copy thread
 	bRunning = 1;
+	if (bPipeline)
+	{
+		if (InitPipeline())
+		{
+			fprintf(stderr, "Error allocating the pipeline buffers\n");
+			return 0;
+		}
+		pthread_create(&tinfoSend, NULL, SendThread, NULL);
+	}
+	if (szGPIOChip[0] && iKeyDefs && InitKeyThread())
+		fprintf(stderr, "Unable to start the GPIO key thread; the keys won't work\n");
+	InitSync();
+	if (bAutoTile)
+		CheckApp(); // so the first frame can use a saved tile size
         pthread_create(&tinfo, NULL, CopyThread, NULL);
 	if (!bBackground)
-	{
 		printf("Press ENTER to quit\n");
-		getchar(); // wait for user to press enter
-	}
-	else // run forever
-	{
-		while (1) {};
-	}
+	EventLoop(iSignalFD); // sleep until it's time to quit
 
-	shutdown();
+	Shutdown();
+	close(iSignalFD);
+	if (bLatency && !bBackground)
+		ShowLatency();
 
    return 0;
 } /* main() */
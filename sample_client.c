@@ -0,0 +1,172 @@
+//
+// BB-CP sample frame client
+// Draws a box bouncing over a pattern and hands each frame to bbcp through
+// the shared memory ring (bbcp --shm <socket>). Reports how many frames per
+// second bbcp accepts and how long a frame takes from submission until bbcp
+// has sent it to the LCD.
+//
+// Copyright (c) 2017 Larry Bank
+// email: bitbank@pobox.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "bbcp_client.h"
+
+#define BOX_SIZE 32
+
+static uint64_t NanoClock(void)
+{
+struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_nsec + (ts.tv_sec * 1000000000LL);
+} /* NanoClock() */
+
+static int CompareTimes(const void *p1, const void *p2)
+{
+uint64_t ll1 = *(const uint64_t *)p1, ll2 = *(const uint64_t *)p2;
+
+	return (ll1 > ll2) - (ll1 < ll2);
+} /* CompareTimes() */
+
+//
+// Draw the background and the box into one rectangle of the frame
+//
+static void DrawRect(BBCP_CLIENT *pClient, uint16_t *pFrame, BBCP_RECT *pRect, int iBoxX, int iBoxY, uint16_t usBox)
+{
+uint16_t *pLine;
+int x, y;
+
+	for (y=pRect->y; y<pRect->y + pRect->h; y++)
+	{
+		pLine = (uint16_t *)((uint8_t *)pFrame + y * pClient->iPitch);
+		for (x=pRect->x; x<pRect->x + pRect->w; x++)
+		{
+			if (x >= iBoxX && x < iBoxX + BOX_SIZE && y >= iBoxY && y < iBoxY + BOX_SIZE)
+				pLine[x] = usBox;
+			else
+				pLine[x] = (uint16_t)(((x >> 3) ^ (y >> 3)) & 1 ? 0x39e7 : 0x18c3); // checkerboard
+		}
+	}
+} /* DrawRect() */
+
+static void ShowHelp(void)
+{
+	printf("sample_client - sends frames to bbcp --shm\n"
+	"usage: ./sample_client <options>\n"
+	" --socket <path>    defaults to " BBCP_SOCKET "\n"
+	" --frames <n>       frames to send, defaults to 600\n"
+	" --full             redraw and submit the whole frame each time\n"
+	" --latency          wait for each frame to reach the LCD before drawing\n"
+	"                    the next (otherwise frames are sent as fast as bbcp\n"
+	"                    takes them)\n");
+} /* ShowHelp() */
+
+int main(int argc, char *argv[])
+{
+BBCP_CLIENT *pClient;
+BBCP_RECT rects[2], rectAll;
+uint16_t *pFrame;
+uint64_t llStart, llTime, *pLatency;
+const char *szSocket = BBCP_SOCKET;
+int i, f, iFrames = 600, bFull = 0, bLatency = 0, iTimed = 0;
+int iBoxX = 0, iBoxY = 0, dx = 3, dy = 2;
+
+	for (i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--socket") == 0 && i+1 < argc)
+			szSocket = argv[++i];
+		else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+			iFrames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--full") == 0)
+			bFull = 1;
+		else if (strcmp(argv[i], "--latency") == 0)
+			bLatency = 1;
+		else
+		{
+			ShowHelp();
+			return 1;
+		}
+	}
+	if (iFrames < 1) iFrames = 1;
+	pClient = bbcpConnect(szSocket);
+	if (pClient == NULL)
+	{
+		fprintf(stderr, "Unable to connect to bbcp at %s (is it running with --shm, or busy?)\n", szSocket);
+		return 1;
+	}
+	printf("Connected; the LCD is %dx%d\n", pClient->iWidth, pClient->iHeight);
+	pLatency = malloc(iFrames * sizeof(uint64_t));
+	rectAll.x = rectAll.y = 0;
+	rectAll.w = pClient->iWidth;
+	rectAll.h = pClient->iHeight;
+
+	// The first frame is drawn everywhere; after that only the box's
+	// old and new places change
+	pFrame = bbcpGetFrame(pClient);
+	if (pFrame)
+	{
+		DrawRect(pClient, pFrame, &rectAll, iBoxX, iBoxY, 0xffff);
+		bbcpSubmit(pClient, NULL, 0);
+	}
+	llStart = NanoClock();
+	for (f=1; f<=iFrames && pFrame; f++)
+	{
+		rects[0].x = iBoxX; rects[0].y = iBoxY;
+		if (iBoxX + dx < 0 || iBoxX + dx + BOX_SIZE > pClient->iWidth) dx = -dx;
+		if (iBoxY + dy < 0 || iBoxY + dy + BOX_SIZE > pClient->iHeight) dy = -dy;
+		iBoxX += dx; iBoxY += dy;
+		rects[1].x = iBoxX; rects[1].y = iBoxY;
+		rects[0].w = rects[0].h = rects[1].w = rects[1].h = BOX_SIZE;
+
+		pFrame = bbcpGetFrame(pClient);
+		if (pFrame == NULL)
+			break; // bbcp quit
+		if (bFull)
+			DrawRect(pClient, pFrame, &rectAll, iBoxX, iBoxY, (uint16_t)(f * 0x0841));
+		else
+		{
+			DrawRect(pClient, pFrame, &rects[0], iBoxX, iBoxY, (uint16_t)(f * 0x0841));
+			DrawRect(pClient, pFrame, &rects[1], iBoxX, iBoxY, (uint16_t)(f * 0x0841));
+		}
+		i = bbcpSubmit(pClient, rects, bFull ? 0 : 2);
+		if (i < 0)
+			break;
+		if (bLatency) // wait until bbcp has sent it
+		{
+			while ((int)(__atomic_load_n(&pClient->pRing->u32Shown, __ATOMIC_ACQUIRE) - (uint32_t)i) <= 0)
+				usleep(100);
+			pLatency[iTimed++] = pClient->pRing->llShownTime[i % BBCP_SLOTS] - pClient->pRing->slot[i % BBCP_SLOTS].llSubmitTime;
+		}
+	}
+	llTime = NanoClock() - llStart;
+	f--;
+	printf("%d frames in %.2f s = %.1f frames/s (%s)\n", f, (double)llTime / 1000000000.0,
+		(double)f * 1000000000.0 / (double)llTime, bFull ? "whole frames" : "changed rectangles");
+	if (iTimed)
+	{
+		qsort(pLatency, iTimed, sizeof(uint64_t), CompareTimes);
+		printf("submit to LCD: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+			pLatency[iTimed/2] / 1000000.0, pLatency[(iTimed*9)/10] / 1000000.0,
+			pLatency[(iTimed*99)/100] / 1000000.0, pLatency[iTimed-1] / 1000000.0);
+	}
+	free(pLatency);
+	bbcpDisconnect(pClient);
+	return 0;
+} /* main() */